@@ -14,11 +14,36 @@
 #include <stdint.h>
 #include <error.h>
 #include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include <sys/vfs.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <sys/file.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <spawn.h>
+#include <time.h>
+#include <pwd.h>
 
 #include "lib/stdio_helpers.h"
 #include "lib/tty.h"
 #include "lib/esc.h"
 #include "lib/keys.h"
+#include "lib/key_decoder.h"
+#include "lib/event_loop.h"
+#include "lib/perfect_hash.h"
+#include "lib/utf8.h"
+#include "lib/front_coding.h"
+#include "lib/inode_map.h"
+#include "lib/preview.h"
 
 enum { LsColor_Count = 20 };
 enum LsColor {
@@ -64,952 +89,6396 @@ static enum LsColor lookup_ls_color(const char *s, size_t len)
 
 static const int tty_flags = ECHO|ICANON;
 
+// An entry of the listing. Its name is kept apart, in file_names or the
+// windowed listing, and found by index through entry_name().
 struct file
 {
-	char *name;
-	char *name_lower;
-	size_t length;
 	unsigned char type;
 	bool exec;
+	bool ascii;             // Width is length; no UTF-8 handling needed
+	bool unresolved;        // Lazy stat: type, exec bit and color not known yet
+	uint16_t length;        // Of the name: at most NAME_MAX bytes, or STREAM_PATH_MAX for --stdin
+	uint16_t cols;          // Display width, saturated at UINT16_MAX
+
+	// Render cache, valid while span_cols matches win_cols
+	uint16_t span_cols;
+	uint16_t shown_len;     // Bytes of the name that fit
+	uint16_t color;         // Index into color_prefix
+	bool truncated;
 };
 
 static struct file *files;
-static size_t files_capacity = 8, files_size;
+static size_t files_size;
+
+// Names of files[], sorted and front coded: sorted names mostly differ in
+// their last few bytes, so each is stored as what it adds to the one before
+static struct front_coded file_names;
+static struct front_cursor file_names_cursor = { .idx = SIZE_MAX };
+
+// Paths read with --stdin that are too long to be front coded, in the
+// order of their entries; file_names holds an empty name in their place
+enum { STREAM_PATH_MAX = PATH_MAX - 1 };
+
+struct long_name
+{
+	size_t idx;
+	char *name;
+};
+
+static struct long_name *long_names;
+static size_t long_names_size, long_names_capacity;
+
+// Windowed listing, for directories that would not fit the memory budget
+// as files[]. The names are spilled to an unlinked temporary file that is
+// mapped read-only, and only a sorted index of fixed-size name prefixes
+// stays resident. A struct file is materialized for the entries being
+// looked at, into a small cache indexed like files[].
+enum {
+	WINDOW_PREFIX = 22,
+	WINDOW_SLOTS = 1024,
+};
+
+struct window_entry
+{
+	char prefix[WINDOW_PREFIX];   // First bytes of the name, NUL padded
+	unsigned char type;
+	unsigned char length;         // Names are at most NAME_MAX bytes
+	uint64_t offset;              // Of the NUL-terminated name in the spill file
+};
+
+struct window_slot
+{
+	uint32_t idx;
+	bool used;
+	struct file file;
+};
 
-static inline const char *file_name(const struct file *file)
+static bool windowed;
+static struct window_entry *window_index;
+static size_t window_index_capacity;
+static const char *window_names;    // The mapped spill file
+static size_t window_names_size;
+static struct window_slot *window_cache;
+static size_t memory_budget = (size_t)512 << 20;
+static bool listing_truncated;      // Entries past the memory budget were left out
+static bool stream_mode;            // --stdin: the listing is paths read from stdin
+
+static struct file *window_file(size_t i);
+
+// Entry i of the listing. In windowed mode, the pointer is only good until
+// the next call.
+static inline struct file *file_at(size_t i)
 {
-	return file->name ? file->name : "";
+	return windowed ? window_file(i) : files + i;
 }
 
-static inline const char *file_name_lower(const struct file *file)
+// Name of entry i, without materializing it. Outside windowed mode, it is
+// only good until the next call.
+static const char *long_name_find(size_t i);
+
+static inline const char *entry_name(size_t i)
 {
-	return file->name_lower ? file->name_lower : file_name(file);
+	if (windowed)
+		return window_names + window_index[i].offset;
+	if (long_names_size > 0 && files[i].length > FRONT_MAX)
+		return long_name_find(i);
+	return front_coded_get(&file_names, &file_names_cursor, i);
 }
 
-static int compare_files(const void *a, const void *b)
+static inline size_t entry_length(size_t i)
 {
-	const struct file *file1 = a;
-	const struct file *file2 = b;
-	return strcmp(file_name(file1), file_name(file2));
+	return windowed ? window_index[i].length : files[i].length;
 }
 
-static int compare_name_to_file(const void *key, const void *elem)
+// Disk usage measured with z and Z, indexed like files[], SIZE_UNKNOWN
+// until known. With sort_by_size the view is ordered by it.
+enum {
+	SIZE_COLS = 6,          // "12.3G "
+};
+#define SIZE_UNKNOWN UINT64_MAX
+
+static uint64_t *du_sizes;
+static size_t du_known;         // Entries with a size
+static bool sizes_shown;        // Their column fits and is drawn
+static bool sort_by_size;
+static bool sort_pending;       // New sizes to sort the view by
+
+static void du_clear(void)
 {
-	const char *name = key;
-	const struct file *file = elem;
-	return strcmp(name, file_name(file));
+	free(du_sizes);
+	du_sizes = NULL;
+	du_known = 0;
 }
 
+// The entries shown: search matches, or with filtered NULL all of them
 struct filtered_file
 {
 	uint32_t idx;
-	size_t match_start;
+	uint32_t match_start;
 };
 
-static int compare_name_to_filtered(const void *key, const void *elem)
+static struct filtered_file *filtered;
+static size_t filtered_size, filtered_capacity;
+static bool filter_truncated;       // Matches past the memory budget were left out
+
+static inline uint32_t view_idx(size_t k)
 {
-	const char *name = key;
-	const struct filtered_file *ff = elem;
-	return strcmp(name, file_name(files + ff->idx));
+	return filtered ? filtered[k].idx : (uint32_t)k;
 }
 
-static struct filtered_file *filtered;
-static size_t filtered_size;
+static inline size_t view_match(size_t k)
+{
+	return filtered ? filtered[k].match_start : 0;
+}
+
+// Returns the position in the view of the entry called name, or SIZE_MAX
+static size_t view_find(const char *name)
+{
+	if (sort_by_size || stream_mode) {
+		for (size_t k = 0; k < filtered_size; ++k)
+			if (strcmp(name, entry_name(view_idx(k))) == 0)
+				return k;
+		return SIZE_MAX;
+	}
+	size_t lo = 0, hi = filtered_size;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		int c = strcmp(name, entry_name(view_idx(mid)));
+		if (c == 0)
+			return mid;
+		if (c < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return SIZE_MAX;
+}
+
+// Marked entries, a bit per index of files[], so filtering leaves them
+// alone. Enter and D act on all of them when there are any.
+static uint64_t *marks;
+static size_t marks_count;
+static bool null_output;    // -0: end each path printed with a NUL
+
+static inline bool bit_test(const uint64_t *set, size_t i)
+{
+	return (set[i / 64] >> (i % 64)) & 1;
+}
+
+static inline void bit_assign(uint64_t *set, size_t i, bool on)
+{
+	if (on)
+		set[i / 64] |= (uint64_t)1 << (i % 64);
+	else
+		set[i / 64] &= ~((uint64_t)1 << (i % 64));
+}
+
+// Returns a cleared set of n bits, or NULL if out of memory
+static uint64_t *bit_set_new(size_t n)
+{
+	return calloc(n / 64 + 1, sizeof(uint64_t));
+}
+
+static inline bool is_marked(size_t i)
+{
+	return marks && bit_test(marks, i);
+}
+
+static void marks_clear(void)
+{
+	free(marks);
+	marks = NULL;
+	marks_count = 0;
+}
 
 static char search_query[256];
 static char search_query_lower[256];
+static char prev_query[256];
 static size_t search_len;
 static size_t search_cursor;
 static bool search_open;
 static bool filter_case_sensitive;
 static size_t prev_search_len;
 
-static char cwd[PATH_MAX];
+static char *cwd;         // Path of the directory shown, as navigated
+static int dir_fd = -1;  // The directory shown; the process cwd stays where it started
+static dev_t dir_dev;
+static ino_t dir_ino;
 static const char *home_dir;
 static size_t home_len;
 
-static size_t page, page_size, win_cols;
-static volatile sig_atomic_t term_resized = 0;
-static volatile sig_atomic_t terminate_signal = 0;
+static size_t top, page_size, win_cols;
+static size_t list_cols;  // Columns of the file list: win_cols, or the left part with the preview pane
+static size_t name_cols;  // Columns for the marker and name: list_cols less the long listing fields
+static bool meta_shown;   // Long listing fields fit and are drawn
+static bool continuous_scroll;
+static int exit_status = -1;
+static sigset_t handled_signals, saved_sigmask;
+static bool confirm_delete;
+static bool confirm_cancel;
+
+// Progress of the filesystem task in flight, as last drawn
+enum fs_status { FS_IDLE, FS_LOADING, FS_NOT_RESPONDING };
+static enum fs_status fs_status_shown;
+static bool status_shown;   // Line 2 carries a message besides the up arrow
+static char restore_error[NAME_MAX + 64];  // Why U failed, on line 2 until the next key
 
 static size_t idx, cursor, prev_cursor;
 
-static size_t cursor_stack[64];
-static size_t cursor_stack_size;
-
-static char ls_colors[LsColor_Count][9];
-
-static void name_pool_reset(void)
+// Grid layout (-C): entries fill columns top to bottom, ls -C style, and a
+// screen shows grid_cols columns of grid_rows entries. A page is always
+// page_entries consecutive entries, so top, cursor and idx keep their
+// meaning; with one column this is the plain list.
+static bool grid_mode;
+static size_t grid_cols = 1, grid_rows;
+static size_t page_entries;
+static uint16_t *grid_widths;       // Widest entry of each column of grid_rows entries
+static size_t grid_widths_capacity;
+
+// Key handlers only record what needs redrawing; the main loop renders once
+// after all immediately available input has been handled.
+enum redraw { REDRAW_NONE, REDRAW_SELECTION, REDRAW_FULL };
+static enum redraw redraw;
+static bool filter_pending;
+static size_t drawn_top;
+
+static struct {
+	size_t frames_rendered;
+	size_t frames_skipped;
+	size_t frames_throttled;
+} stats;
+static bool show_stats;
+
+static inline void request_redraw(enum redraw level)
 {
-	if (!files || files_size == 0)
-		return;
-
-	for (size_t i = 0; i < files_size; ++i) {
-		free(files[i].name);
-		free(files[i].name_lower);
-		files[i].name = NULL;
-		files[i].name_lower = NULL;
-	}
+	if (level > redraw)
+		redraw = level;
 }
 
-static void parse_ls_colors(void)
+static uint64_t now_ms(void)
 {
-	char *env_ls_colors = getenv("LS_COLORS");
-	if (!env_ls_colors) return;
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
 
-	char *start = env_ls_colors;
-	while (*start != '\0') {
-		enum LsColor c = lookup_ls_color(start, 2);
-		if (c) {
-			// ls_colors[*] is 9 bytes; cap scan to 8 + NUL
-			sscanf(start + 3, "%8[0-9;]", ls_colors[c]);
-		}
+// Frames are written through a buffer on stderr and flushed once per frame.
+// When the terminal falls behind (output still queued on the tty, or the
+// flush itself blocking), frames are spaced out so intermediate states are
+// dropped instead of queued; the spacing decays once output drains.
+static char frame_buf[1 << 16];
+
+enum {
+	THROTTLE_MIN_MS = 16,
+	THROTTLE_MAX_MS = 250,
+	THROTTLE_SLOW_WRITE_MS = 10,
+	THROTTLE_QUEUE_BYTES = 1024,
+	FRAME_LATENCY_MAX_MS = 100,   // Events that never let up still get a frame this often
+};
 
-		char *next = strchr(start, ':');
-		if (!next) break;
-		start = next + 1;
-	}
+static struct {
+	uint64_t interval;    // Minimum ms between frames, 0 when unthrottled
+	uint64_t last_frame;
+} throttle;
+static bool frame_held;
+
+static size_t tty_output_queued(void)
+{
+	int queued;
+	if (ioctl(STDERR_FILENO, TIOCOUTQ, &queued) != 0 || queued < 0)
+		return 0;
+	return (size_t)queued;
 }
 
-static void get_files(void)
+// Returns ms to wait before the next frame may be written, 0 if it may be written now
+static int frame_delay(void)
 {
-	name_pool_reset();
-	files_size = 0;
+	if (throttle.interval == 0)
+		return 0;
+
+	// A held frame is still written when the interval ends, even if no
+	// further input arrives
+	uint64_t now = now_ms();
+	uint64_t due = throttle.last_frame + throttle.interval;
+	return now >= due ? 0 : (int)(due - now);
+}
 
-	DIR *dir = opendir(".");
-	if (!dir) {
-		filtered_size = 0;
-		prev_search_len = 0;
-		return;
+static void flush_frame(void)
+{
+	uint64_t start = now_ms();
+	FLUSH_FILE(stderr);
+	uint64_t end = now_ms();
+
+	if (end - start > THROTTLE_SLOW_WRITE_MS || tty_output_queued() > THROTTLE_QUEUE_BYTES) {
+		throttle.interval = throttle.interval ? throttle.interval * 2 : THROTTLE_MIN_MS;
+		if (throttle.interval > THROTTLE_MAX_MS)
+			throttle.interval = THROTTLE_MAX_MS;
+	} else {
+		throttle.interval /= 2;
+		if (throttle.interval < THROTTLE_MIN_MS)
+			throttle.interval = 0;
 	}
+	throttle.last_frame = end;
+}
 
-	struct dirent *entry;
-
-	while ((entry = readdir(dir)) != NULL) {
-		if (entry->d_name[0] == '.')
-			continue;
+// Results from worker threads, handed to the main thread through worker_fd
+struct completion
+{
+	struct completion *next;
+	void (*fn)(void *arg);
+	void *arg;
+};
 
-		if (files_size == UINT32_MAX) {
-			PUTS_ERR("Error: too many files\n");
-			exit(EXIT_FAILURE);
-		}
+static pthread_mutex_t completions_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct completion *completions;
+static int worker_fd = -1;
 
-		if (files_size == files_capacity) {
-			size_t old_capacity = files_capacity;
-			if (files_capacity > SIZE_MAX / 2) {
-				PUTS_ERR("Error: too many files\n");
-				exit(EXIT_FAILURE);
-			}
-			files_capacity *= 2;
-			struct file *new_files = realloc(files, files_capacity * sizeof(struct file));
-			if (!new_files) {
-				perror("realloc");
-				exit(EXIT_FAILURE);
-			}
-			files = new_files;
-			memset(files + old_capacity, 0, (files_capacity - old_capacity) * sizeof(struct file));
-		}
+// Queues c->fn(c->arg) to run on the main thread. Safe to call from any thread.
+static inline void post_completion(struct completion *c)
+{
+	pthread_mutex_lock(&completions_lock);
+	c->next = completions;
+	completions = c;
+	pthread_mutex_unlock(&completions_lock);
+
+	uint64_t one = 1;
+	ssize_t written = write(worker_fd, &one, sizeof(one));
+	(void)written;
+}
 
-		size_t name_len = strlen(entry->d_name);
-		if (name_len == 0)
-			continue;
-		if (name_len == SIZE_MAX) {
-			PUTS_ERR("Error: out of memory\n");
-			exit(EXIT_FAILURE);
-		}
-		size_t one_name_len = name_len + 1;
-		if (one_name_len == 0) {
-			PUTS_ERR("Error: out of memory\n");
-			exit(EXIT_FAILURE);
-		}
-		char *name = strdup(entry->d_name);
-		char *name_lower = malloc(one_name_len);
-		if (!name || !name_lower) {
-			free(name);
-			free(name_lower);
-			perror("malloc");
-			exit(EXIT_FAILURE);
-		}
-		if (name[0] == '\0') {
-			free(name);
-			free(name_lower);
-			continue;
-		}
-		for (size_t i = 0; i < name_len; ++i)
-			name_lower[i] = (char)tolower((unsigned char)entry->d_name[i]);
-		name_lower[name_len] = '\0';
-		files[files_size] = (struct file){
-			.name = name,
-			.name_lower = name_lower,
-			.length = name_len,
-			.type = entry->d_type,
-			.exec = false,
-		};
-		struct file *file = files + files_size;
-		files_size++;
+// Preview pane. The entry under the cursor is previewed on a worker thread
+// once the cursor has rested for PREVIEW_SETTLE_MS; every selection change
+// bumps preview_generation, which cancels a load still in progress.
+enum {
+	PREVIEW_SETTLE_MS = 60,
+	PREVIEW_CACHE_SIZE = 64,
+	PREVIEW_MIN_COLS = 40,   // Narrower terminals hide the pane
+};
 
-		// Some filesystems report DT_UNKNOWN; resolve type and exec bit via lstat().
-		if (file->type == DT_UNKNOWN || file->type == DT_REG) {
-			struct stat info;
-			if (lstat(file_name(file), &info) == 0) {
-				if (S_ISDIR(info.st_mode))
-					file->type = DT_DIR;
-				else if (S_ISREG(info.st_mode))
-					file->type = DT_REG;
-				else if (S_ISLNK(info.st_mode))
-					file->type = DT_LNK;
-
-				if (S_ISREG(info.st_mode))
-					file->exec = info.st_mode & (S_IXUSR | S_IXGRP | S_IXOTH);
-			}
-		}
-	}
+static bool preview_enabled;
+static bool preview_dirty;            // Pane needs drawing without the rest of the view
+static struct preview *preview_shown;
+static char preview_wanted[STREAM_PATH_MAX + 1]; // Entry the pane should show, "" for none
+static uint64_t preview_wanted_files;     // files_generation of the listing it is in
+static uint64_t preview_due;          // When to request preview_wanted, 0 if requested
+static _Atomic uint64_t preview_generation;
+static struct preview_cache preview_cache = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.capacity = PREVIEW_CACHE_SIZE,
+};
 
-	closedir(dir);
-	qsort(files, files_size, sizeof(struct file), compare_files);
+// Single request slot for the worker; a newer request replaces an unstarted one
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	int dir_fd;             // Owned by the job
+	char name[STREAM_PATH_MAX + 1];
+	uint64_t generation;
+	bool pending;
+	bool started;
+} preview_job = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.wake = PTHREAD_COND_INITIALIZER,
+	.dir_fd = -1,
+};
 
-	if (files_size > 0) {
-		if (files_size > SIZE_MAX / sizeof(struct filtered_file)) {
-			PUTS_ERR("Error: too many files\n");
-			exit(EXIT_FAILURE);
-		}
-		struct filtered_file *new_filtered = realloc(filtered, files_size * sizeof(struct filtered_file));
-		if (!new_filtered) {
-			perror("realloc");
-			exit(EXIT_FAILURE);
-		}
-		filtered = new_filtered;
-	} else {
-		free(filtered);
-		filtered = NULL;
-	}
-	filtered_size = files_size;
-	for (size_t i = 0; i < files_size; ++i) {
-		filtered[i].idx = (uint32_t)i;
-		filtered[i].match_start = 0;
-	}
+struct preview_result
+{
+	struct completion completion;
+	struct preview *preview;
+	uint64_t generation;
+};
 
-	prev_search_len = 0;  // Reset incremental filter state
-}
+static const char *ls_colors[LsColor_Count];  // SGR codes by file class, NULL when unset
+static bool link_as_target;                  // ln=target: color links like what they point to
 
-static void apply_filter(void)
+// Prebuilt SGR sequence for each color index: the LsColor_Count file
+// classes, then one per distinct code used by LS_COLORS globs
+struct color_prefix
 {
-	// Determine case sensitivity (only when query changes)
-	filter_case_sensitive = false;
-	for (size_t i = 0; i < search_len; ++i) {
-		if (isupper((unsigned char)search_query[i])) {
-			filter_case_sensitive = true;
-			break;
-		}
-	}
-	for (size_t i = 0; i < search_len; ++i)
-		search_query_lower[i] = (char)tolower((unsigned char)search_query[i]);
-	search_query_lower[search_len] = '\0';
+	char *seq;
+	size_t len;
+};
 
-	// Incremental filtering: if adding chars, filter from current matches
-	bool incremental = search_len > prev_search_len && prev_search_len > 0;
-	prev_search_len = search_len;
+static struct color_prefix *color_prefix;
+static size_t color_prefix_size;
 
-	if (search_len == 0) {
-		// No filter - show all files
-		filtered_size = files_size;
-		for (size_t i = 0; i < files_size; ++i) {
-			filtered[i].idx = (uint32_t)i;
-			filtered[i].match_start = 0;
-		}
-	} else if (incremental) {
-		// Filter from current matches (subset)
-		size_t new_size = 0;
-		for (size_t i = 0; i < filtered_size; ++i) {
-			struct file *file = files + filtered[i].idx;
-			const char *hay = filter_case_sensitive ? file_name(file) : file_name_lower(file);
-			const char *needle = filter_case_sensitive ? search_query : search_query_lower;
-			const char *match = strstr(hay, needle);
-			if (match) {
-				filtered[new_size].idx = filtered[i].idx;
-				filtered[new_size].match_start = (size_t)(match - hay);
-				new_size++;
-			}
-		}
-		filtered_size = new_size;
-	} else {
-		// Full filter from all files
-		filtered_size = 0;
-		for (size_t i = 0; i < files_size; ++i) {
-			const char *hay = filter_case_sensitive ? file_name(files + i) : file_name_lower(files + i);
-			const char *needle = filter_case_sensitive ? search_query : search_query_lower;
-			const char *match = strstr(hay, needle);
-			if (match) {
-				filtered[filtered_size].idx = (uint32_t)i;
-				filtered[filtered_size].match_start = (size_t)(match - hay);
-				filtered_size++;
-			}
-		}
-	}
+// A "*suffix=code" entry of LS_COLORS
+struct color_glob
+{
+	const char *suffix;     // Lowercased, without the '*'
+	size_t len;
+	uint16_t color;
+};
 
-	idx = cursor = page = 0;
-}
+// "*.ext" globs, found through ext_hash by lowercase extension
+static struct color_glob *ext_globs;
+static size_t ext_globs_size;
+static struct perfect_hash ext_hash;
 
-static void print_view(void);
+// Other globs ("*~", "*README"), checked in order
+static struct color_glob *suffix_globs;
+static size_t suffix_globs_size;
 
-static void clear_screen(void)
+static char *ls_colors_spec;    // The copy of LS_COLORS that codes and globs point into
+
+static void name_pool_reset(void)
 {
-	PUTS_ERR(CLS);
+	front_coded_free(&file_names);
+	front_cursor_reset(&file_names_cursor);
 }
 
-static void clear_screen_and_reset(void)
+// GNU ls treats an empty, "0" or "00" code as no color
+static bool color_set(enum LsColor c)
 {
-	PUTS_ERR(SYNC_END HOME CLSB);
+	const char *code = ls_colors[c];
+	return code && code[0] && strcmp(code, "0") != 0 && strcmp(code, "00") != 0;
 }
 
-static void handle_sigwinch(int sig)
+static bool valid_sgr_code(const char *code)
 {
-	(void)sig;
-	term_resized = 1;
+	size_t len = strspn(code, "0123456789;");
+	return code[len] == '\0' && len <= 64;
 }
 
-static void handle_terminate(int sig)
+static uint16_t add_color_prefix(const char *code)
 {
-	terminate_signal = sig;
+	for (size_t c = LsColor_Count; c < color_prefix_size; ++c) {
+		if (strcmp(color_prefix[c].seq + sizeof(CSI) - 1, code) == 0
+			&& color_prefix[c].len == sizeof(CSI) + strlen(code))
+			return (uint16_t)c;
+	}
+
+	if (color_prefix_size == UINT16_MAX) {
+		PUTS_ERR("Error: too many colors in LS_COLORS\n");
+		exit(EXIT_FAILURE);
+	}
+	struct color_prefix *new_prefix = realloc(color_prefix, (color_prefix_size + 1) * sizeof(*color_prefix));
+	char *seq = malloc(sizeof(CSI) + strlen(code) + 1);
+	if (!new_prefix || !seq) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	color_prefix = new_prefix;
+	int n = sprintf(seq, CSI "%sm", code);
+	color_prefix[color_prefix_size] = (struct color_prefix){ .seq = seq, .len = (size_t)n };
+	return (uint16_t)color_prefix_size++;
 }
 
-static void handle_sigtstp(int sig)
+static void add_color_glob(struct color_glob **globs, size_t *size, char *suffix, const char *code)
 {
-	(void)sig;
-	clear_screen();
-	reset_tty();
-	signal(SIGTSTP, SIG_DFL);
-	raise(SIGTSTP);
+	for (char *p = suffix; *p; ++p)
+		*p = (char)tolower((unsigned char)*p);
+
+	struct color_glob *new_globs = realloc(*globs, (*size + 1) * sizeof(**globs));
+	if (!new_globs) {
+		perror("realloc");
+		exit(EXIT_FAILURE);
+	}
+	*globs = new_globs;
+	(*globs)[(*size)++] = (struct color_glob){
+		.suffix = suffix,
+		.len = strlen(suffix),
+		.color = add_color_prefix(code),
+	};
 }
 
-static void handle_sigcont(int sig)
+static int compare_globs(const void *a, const void *b)
 {
-	(void)sig;
-	disable_tty_flags(tty_flags);
-	print_view();
-	signal(SIGTSTP, handle_sigtstp);
+	const struct color_glob *glob1 = a;
+	const struct color_glob *glob2 = b;
+	int cmp = strcmp(glob1->suffix, glob2->suffix);
+	if (cmp != 0)
+		return cmp;
+	// Later entries override earlier ones
+	return glob1 < glob2 ? 1 : -1;
 }
 
-// Returns true if print_view() was called (full redraw), false if only selection changed
-static bool move_to_previous(void)
+static void parse_ls_colors(void)
 {
-	if (filtered_size == 0)
-		return false;
+	color_prefix_size = LsColor_Count;
+	color_prefix = calloc(color_prefix_size, sizeof(*color_prefix));
+	if (!color_prefix) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
 
-	if (idx == 0) {
-		idx = filtered_size - 1;
-		size_t new_page = idx / page_size;
-		cursor = idx % page_size;
+	char *env_ls_colors = getenv("LS_COLORS");
+	char *spec = ls_colors_spec = env_ls_colors ? strdup(env_ls_colors) : NULL;
+	char *entry;
 
-		if (new_page != page) {
-			page = new_page;
-			print_view();
-			return true;
-		}
-	} else {
-		idx -= 1;
+	// Entries are "key=code" separated by ':'; spec is split in place and kept
+	while (spec && (entry = strsep(&spec, ":")) != NULL) {
+		char *code = strchr(entry, '=');
+		if (!code)
+			continue;
+		*code++ = '\0';
 
-		if (cursor == 0) {
-			cursor = page_size - 1;
-			page -= 1;
-			print_view();
-			return true;
-		} else {
-			cursor -= 1;
+		if (entry[0] == '*') {
+			if (!valid_sgr_code(code) || entry[1] == '\0')
+				continue;
+			if (entry[1] == '.' && entry[2] != '\0')
+				add_color_glob(&ext_globs, &ext_globs_size, entry + 2, code);
+			else
+				add_color_glob(&suffix_globs, &suffix_globs_size, entry + 1, code);
+			continue;
 		}
+
+		enum LsColor c = lookup_ls_color(entry, strlen(entry));
+		if (c == LsColor_Unknown)
+			continue;
+		if (c == LsColor_ln && strcmp(code, "target") == 0)
+			link_as_target = true;
+		else if (valid_sgr_code(code))
+			ls_colors[c] = code;
 	}
-	return false;
-}
 
-static bool move_to_next(void)
-{
-	if (filtered_size == 0)
-		return false;
+	for (size_t c = 0; c < LsColor_Count; ++c) {
+		const char *code = ls_colors[c] ? ls_colors[c] : "";
+		char *seq = malloc(sizeof(CSI) + strlen(code) + 1);
+		if (!seq) {
+			perror("malloc");
+			exit(EXIT_FAILURE);
+		}
+		int n = sprintf(seq, CSI "%sm", code);
+		color_prefix[c] = (struct color_prefix){ .seq = seq, .len = (size_t)n };
+	}
 
-	if (idx == filtered_size - 1) {
-		idx = cursor = 0;
+	if (ext_globs_size == 0)
+		return;
 
-		if (page > 0) {
-			page = 0;
-			print_view();
-			return true;
-		}
-	} else {
-		idx += 1;
-		cursor += 1;
+	// Keep only the last entry for each extension, then index them
+	qsort(ext_globs, ext_globs_size, sizeof(*ext_globs), compare_globs);
+	size_t unique = 0;
+	for (size_t i = 0; i < ext_globs_size; ++i) {
+		if (unique == 0 || strcmp(ext_globs[unique - 1].suffix, ext_globs[i].suffix) != 0)
+			ext_globs[unique++] = ext_globs[i];
+	}
+	ext_globs_size = unique;
 
-		if (cursor == page_size) {
-			cursor = 0;
-			page += 1;
-			print_view();
-			return true;
-		}
+	const char **keys = malloc(unique * sizeof(*keys));
+	size_t *lens = malloc(unique * sizeof(*lens));
+	if (!keys || !lens) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
 	}
-	return false;
+	for (size_t i = 0; i < unique; ++i) {
+		keys[i] = ext_globs[i].suffix;
+		lens[i] = ext_globs[i].len;
+	}
+	if (!perfect_hash_build(&ext_hash, keys, lens, unique)) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	free(keys);
+	free(lens);
 }
 
-static bool move_to_first(void)
+// Forgets what parse_ls_colors() set up, to parse another LS_COLORS
+static void free_ls_colors(void)
 {
-	if (filtered_size == 0)
-		return false;
-
-	idx = cursor = 0;
+	for (size_t c = 0; c < color_prefix_size; ++c)
+		free(color_prefix[c].seq);
+	free(color_prefix);
+	color_prefix = NULL;
+	color_prefix_size = 0;
+	free(ext_globs);
+	free(suffix_globs);
+	ext_globs = suffix_globs = NULL;
+	ext_globs_size = suffix_globs_size = 0;
+	perfect_hash_free(&ext_hash);
+	free(ls_colors_spec);
+	ls_colors_spec = NULL;
+	memset(ls_colors, 0, sizeof(ls_colors));
+	link_as_target = false;
+}
 
-	if (page > 0) {
-		page = 0;
-		print_view();
-		return true;
+// Case folds a name into dst, NUL terminated, for search and globs. The
+// folded name has the same length.
+static void fold_name(char *dst, const char *name, size_t len)
+{
+	if (utf8_is_ascii(name, len)) {
+		for (size_t i = 0; i < len; ++i)
+			dst[i] = (char)tolower((unsigned char)name[i]);
+	} else {
+		utf8_fold(dst, name, len);
 	}
-	return false;
+	dst[len] = '\0';
 }
 
-static bool move_to_last(void)
+// Returns the glob color for a lowercased name, or LsColor_fi if no glob matches
+static uint16_t glob_color(const char *name_lower, size_t len)
 {
-	if (filtered_size == 0)
-		return false;
-
-	idx = filtered_size - 1;
-	size_t new_page = idx / page_size;
-	cursor = idx % page_size;
+	// Longest extension first: "a.tar.gz" tries "tar.gz", then "gz"
+	for (const char *dot = memchr(name_lower, '.', len); dot; ) {
+		const char *ext = dot + 1;
+		size_t ext_len = len - (size_t)(ext - name_lower);
+		uint32_t i = perfect_hash_lookup(&ext_hash, ext, ext_len);
+		if (i != PERFECT_HASH_NONE && ext_globs[i].len == ext_len
+			&& memcmp(ext_globs[i].suffix, ext, ext_len) == 0)
+			return ext_globs[i].color;
+		dot = memchr(ext, '.', ext_len);
+	}
 
-	if (new_page != page) {
-		page = new_page;
-		print_view();
-		return true;
+	for (size_t i = 0; i < suffix_globs_size; ++i) {
+		const struct color_glob *glob = suffix_globs + i;
+		if (glob->len <= len && memcmp(name_lower + len - glob->len, glob->suffix, glob->len) == 0)
+			return glob->color;
 	}
-	return false;
+	return LsColor_fi;
 }
 
-static bool move_page_up(void)
+static enum LsColor mode_color(mode_t mode)
 {
-	if (filtered_size == 0)
-		return false;
+	if (S_ISDIR(mode))  return LsColor_di;
+	if (S_ISLNK(mode))  return LsColor_ln;
+	if (S_ISFIFO(mode)) return LsColor_pi;
+	if (S_ISSOCK(mode)) return LsColor_so;
+	if (S_ISBLK(mode))  return LsColor_bd;
+	if (S_ISCHR(mode))  return LsColor_cd;
+	return mode & (S_IXUSR | S_IXGRP | S_IXOTH) ? LsColor_ex : LsColor_fi;
+}
 
-	if (cursor == 0) {
-		if (page == 0)
-			return false;
-		page -= 1;
-		idx = page * page_size;
-		cursor = 0;
-		print_view();
-		return true;
+static enum LsColor file_color(const struct file *file)
+{
+	switch (file->type) {
+		case DT_BLK:  return LsColor_bd;
+		case DT_CHR:  return LsColor_cd;
+		case DT_DIR:  return LsColor_di;
+		case DT_FIFO: return LsColor_pi;
+		case DT_LNK:  return LsColor_ln;
+		case DT_REG:  return file->exec ? LsColor_ex : LsColor_fi;
+		case DT_SOCK: return LsColor_so;
+		default:      return LsColor_fi;
 	}
+}
 
-	idx = page * page_size;
-	cursor = 0;
-	return false;
+// Returns true if symlink colors depend on the link target
+static bool link_colors_need_target(void)
+{
+	return link_as_target || color_set(LsColor_or) || color_set(LsColor_mi);
 }
 
-static bool move_page_down(void)
+// Resolves the color of an entry called name. info is its lstat() result,
+// or NULL if it was not needed to classify the entry. For symlinks whose
+// color depends on the target, target is the stat() of the target, or NULL
+// if it is missing.
+static uint16_t resolve_color(const struct file *file, const char *name, const struct stat *info,
+                              const struct stat *target)
 {
-	if (filtered_size == 0)
-		return false;
+	enum LsColor c = file_color(file);
 
-	size_t last_page = (filtered_size - 1) / page_size;
-	size_t page_end = (page < last_page) ? page_size - 1 : (filtered_size - 1) % page_size;
+	if (file->type == DT_LNK && link_colors_need_target()) {
+		if (!target) {
+			if (color_set(LsColor_or))
+				return LsColor_or;
+			return color_set(LsColor_mi) ? LsColor_mi : LsColor_ln;
+		}
+		if (!link_as_target)
+			return LsColor_ln;
+		c = mode_color(target->st_mode);
+	}
 
-	if (cursor == page_end) {
-		if (page >= last_page)
-			return false;
-		page += 1;
-		page_end = (page < last_page) ? page_size - 1 : (filtered_size - 1) % page_size;
-		idx = page * page_size + page_end;
-		cursor = page_end;
-		print_view();
-		return true;
+	if (info && S_ISREG(info->st_mode)) {
+		if ((info->st_mode & S_ISUID) && color_set(LsColor_su))
+			return LsColor_su;
+		if ((info->st_mode & S_ISGID) && color_set(LsColor_sg))
+			return LsColor_sg;
+		if (c == LsColor_fi && info->st_nlink > 1 && color_set(LsColor_mh))
+			return LsColor_mh;
 	}
 
-	idx = page * page_size + page_end;
-	cursor = page_end;
-	return false;
+	// Like ls, globs only apply to files without a more specific class
+	// Only the end of a longer path can match
+	if (c == LsColor_fi) {
+		char name_lower[NAME_MAX + 1];
+		size_t len = file->length < NAME_MAX ? file->length : NAME_MAX;
+		fold_name(name_lower, name + file->length - len, len);
+		return glob_color(name_lower, len);
+	}
+	return c;
 }
 
-static void clear_search(void)
+// Long listing (-l): permissions, owner, size, mtime and link target. They
+// are fetched off the UI thread, only for the entries about to be drawn
+// plus one page ahead, into a sparse column indexed like files[] whose
+// chunks are allocated when first requested. Nothing is fetched twice
+// until the directory is reloaded.
+enum { META_NONE, META_PENDING, META_READY, META_FAILED };
+
+enum {
+	META_CHUNK = 256,
+	META_COLS = 39,         // "drwxr-xr-x owner    size Mmm dd hh:mm "
+	META_MIN_NAME_COLS = 20,
+};
+
+struct file_meta
 {
-	char selection[PATH_MAX] = "";
+	uint8_t state;
+	mode_t mode;
+	off_t size;
+	time_t mtime;
+	nlink_t nlink;
+	char owner[9];
+	char *target;           // Symlink target, NULL otherwise
+	mode_t target_mode;     // Symlink target type, 0 if it is missing or was not needed
+};
 
-	if (filtered_size > 0)
-		snprintf(selection, sizeof(selection), "%s", file_name(files + filtered[idx].idx));
+static bool long_mode;
+static bool lazy_stat, lazy_stat_forced;
+static struct file_meta **meta_chunks;
+static size_t meta_chunks_size;
+static uint64_t files_generation;   // Bumped on every reload; older results are dropped
 
-	search_query[0] = '\0';
-	search_len = search_cursor = 0;
-	search_open = false;
-	prev_search_len = 0;  // Reset incremental filter state
-	apply_filter();
+struct meta_item
+{
+	uint32_t idx;           // Index into files
+	const char *name;       // Copied into the request
+	struct file_meta meta;
+};
 
-		if (selection[0]) {
-			struct filtered_file *found = bsearch(selection, filtered, filtered_size,
-				sizeof(struct filtered_file), compare_name_to_filtered);
-			if (found) {
-				idx = (size_t)(found - filtered);
-				page = idx / page_size;
-				cursor = idx % page_size;
-			}
+struct meta_request
+{
+	struct completion completion;
+	struct meta_request *next;
+	uint64_t generation;
+	int dir_fd;
+	int statx_flags;
+	bool follow_links;      // Also stat symlink targets, for their color
+	size_t count;
+	struct meta_item items[];
+};
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	struct meta_request *head, *tail;
+	bool started;
+} meta_queue = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.wake = PTHREAD_COND_INITIALIZER,
+};
+
+// Returns the metadata slot of files[i], allocating its chunk if create is set
+static struct file_meta *meta_slot(size_t i, bool create)
+{
+	size_t chunk = i / META_CHUNK;
+	if (chunk >= meta_chunks_size) {
+		if (!create)
+			return NULL;
+		size_t size = (files_size + META_CHUNK - 1) / META_CHUNK;
+		if (size <= chunk)
+			size = chunk + 1;
+		struct file_meta **chunks = realloc(meta_chunks, size * sizeof(*chunks));
+		if (!chunks)
+			return NULL;
+		memset(chunks + meta_chunks_size, 0, (size - meta_chunks_size) * sizeof(*chunks));
+		meta_chunks = chunks;
+		meta_chunks_size = size;
+	}
+	if (!meta_chunks[chunk]) {
+		if (!create)
+			return NULL;
+		meta_chunks[chunk] = calloc(META_CHUNK, sizeof(struct file_meta));
+		if (!meta_chunks[chunk])
+			return NULL;
+	}
+	return meta_chunks[chunk] + i % META_CHUNK;
+}
+
+static void meta_reset(void)
+{
+	for (size_t c = 0; c < meta_chunks_size; ++c) {
+		if (!meta_chunks[c])
+			continue;
+		for (size_t i = 0; i < META_CHUNK; ++i)
+			free(meta_chunks[c][i].target);
+		free(meta_chunks[c]);
+	}
+	free(meta_chunks);
+	meta_chunks = NULL;
+	meta_chunks_size = 0;
+	files_generation++;
+}
+
+static void meta_fetch_one(const struct meta_request *req, struct meta_item *item,
+                           uid_t *cached_uid, char *cached_owner)
+{
+	struct file_meta *meta = &item->meta;
+	struct statx stx;
+	unsigned mask = STATX_TYPE | STATX_MODE | STATX_NLINK | STATX_SIZE | STATX_MTIME | STATX_UID;
+	int flags = AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT | req->statx_flags;
+	if (statx(req->dir_fd, item->name, flags, mask, &stx) != 0) {
+		meta->state = META_FAILED;
+		return;
+	}
+
+	meta->mode = stx.stx_mode;
+	meta->nlink = stx.stx_nlink;
+	meta->size = (off_t)stx.stx_size;
+	meta->mtime = (time_t)stx.stx_mtime.tv_sec;
+
+	if (stx.stx_uid != *cached_uid) {
+		struct passwd pw, *found = NULL;
+		char buf[1024];
+		if (getpwuid_r(stx.stx_uid, &pw, buf, sizeof(buf), &found) == 0 && found)
+			snprintf(cached_owner, sizeof(meta->owner), "%s", found->pw_name);
+		else
+			snprintf(cached_owner, sizeof(meta->owner), "%u", stx.stx_uid);
+		*cached_uid = stx.stx_uid;
+	}
+	memcpy(meta->owner, cached_owner, sizeof(meta->owner));
+
+	if (S_ISLNK(stx.stx_mode)) {
+		char target[PATH_MAX];
+		ssize_t n = readlinkat(req->dir_fd, item->name, target, sizeof(target) - 1);
+		if (n >= 0)
+			meta->target = strndup(target, (size_t)n);
+
+		struct statx target_stx;
+		int target_flags = AT_NO_AUTOMOUNT | req->statx_flags;
+		if (req->follow_links && statx(req->dir_fd, item->name, target_flags, STATX_TYPE, &target_stx) == 0)
+			meta->target_mode = target_stx.stx_mode;
+	}
+	meta->state = META_READY;
+}
+
+static void meta_done(void *arg);
+
+static void *meta_worker(void *arg)
+{
+	(void)arg;
+
+	for (;;) {
+		pthread_mutex_lock(&meta_queue.lock);
+		while (!meta_queue.head)
+			pthread_cond_wait(&meta_queue.wake, &meta_queue.lock);
+		struct meta_request *req = meta_queue.head;
+		meta_queue.head = req->next;
+		if (!meta_queue.head)
+			meta_queue.tail = NULL;
+		pthread_mutex_unlock(&meta_queue.lock);
+
+		uid_t cached_uid = (uid_t)-1;
+		char cached_owner[sizeof(req->items[0].meta.owner)];
+		for (size_t i = 0; i < req->count; ++i)
+			meta_fetch_one(req, req->items + i, &cached_uid, cached_owner);
+		close(req->dir_fd);
+
+		req->completion = (struct completion){ .fn = meta_done, .arg = req };
+		post_completion(&req->completion);
+	}
+	return NULL;
+}
+
+// Sets the type and exec bit of an entry from its lstat() mode
+static void apply_mode(struct file *file, mode_t mode)
+{
+	file->type = (unsigned char)IFTODT(mode);
+	file->exec = S_ISREG(mode) && (mode & (S_IXUSR | S_IXGRP | S_IXOTH));
+}
+
+// Lazy stat: classifies an entry called name from its fetched metadata
+static void resolve_lazy(struct file *file, const char *name, const struct file_meta *meta)
+{
+	file->unresolved = false;
+	if (meta->state != META_READY)
+		return;
+
+	apply_mode(file, meta->mode);
+	struct stat info = { .st_mode = meta->mode, .st_nlink = meta->nlink };
+	struct stat target = { .st_mode = meta->target_mode };
+	file->color = resolve_color(file, name, &info, meta->target_mode ? &target : NULL);
+}
+
+// Lazy stat: entries whose class d_type alone does not settle
+static bool needs_stat(const struct file *file)
+{
+	return file->type == DT_UNKNOWN || file->type == DT_REG
+		|| (file->type == DT_LNK && link_colors_need_target());
+}
+
+// Materializes entry i of a windowed listing into its cache slot. It is
+// classified like in the lazy stat mode, from its metadata once fetched.
+static struct file *window_file(size_t i)
+{
+	struct window_slot *slot = window_cache + i % WINDOW_SLOTS;
+	if (slot->used && slot->idx == i)
+		return &slot->file;
+
+	const struct window_entry *entry = window_index + i;
+	const char *name = window_names + entry->offset;
+	size_t len = entry->length;
+	bool ascii = utf8_is_ascii(name, len);
+	size_t cols = ascii ? len : utf8_width(name, len);
+	slot->idx = (uint32_t)i;
+	slot->used = true;
+
+	struct file *file = &slot->file;
+	*file = (struct file){
+		.length = entry->length,
+		.type = entry->type,
+		.ascii = ascii,
+		.cols = (uint16_t)(cols < UINT16_MAX ? cols : UINT16_MAX),
+		.color = LsColor_fi,
+	};
+	struct file_meta *meta = meta_slot(i, false);
+	if (meta && (meta->state == META_READY || meta->state == META_FAILED))
+		resolve_lazy(file, name, meta);
+	else if (needs_stat(file))
+		file->unresolved = true;
+	else
+		file->color = resolve_color(file, name, NULL, NULL);
+	return file;
+}
+
+// Entry i if it is materialized, NULL otherwise
+static struct file *file_cached(size_t i)
+{
+	if (!windowed)
+		return files + i;
+	struct window_slot *slot = window_cache + i % WINDOW_SLOTS;
+	return slot->used && slot->idx == i ? &slot->file : NULL;
+}
+
+static void update_grid(void);
+static void update_layout(void);
+static void scroll_to_idx(void);
+
+// Runs on the main thread with a fetched batch
+static void meta_done(void *arg)
+{
+	struct meta_request *req = arg;
+	bool current = req->generation == files_generation;
+	bool resolved = false;
+
+	for (size_t i = 0; i < req->count; ++i) {
+		struct file_meta *slot = current ? meta_slot(req->items[i].idx, false) : NULL;
+		if (!slot) {
+			free(req->items[i].meta.target);
+			continue;
+		}
+		*slot = req->items[i].meta;
+		struct file *file = file_cached(req->items[i].idx);
+		if (file && file->unresolved) {
+			resolve_lazy(file, req->items[i].name, slot);
+			resolved = true;
+		}
+	}
+	free(req);
+
+	if (current) {
+		// A directory gained its '/', which may change the grid
+		if (resolved && grid_cols > 1) {
+			update_grid();
+			scroll_to_idx();
+		}
+		request_redraw(REDRAW_FULL);
+	}
+}
+
+static void meta_submit(struct meta_request *req)
+{
+	pthread_mutex_lock(&meta_queue.lock);
+	if (!meta_queue.started) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, meta_worker, NULL) != 0) {
+			pthread_mutex_unlock(&meta_queue.lock);
+			close(req->dir_fd);
+			free(req);
+			return;
+		}
+		pthread_detach(thread);
+		meta_queue.started = true;
+	}
+	req->next = NULL;
+	if (meta_queue.tail)
+		meta_queue.tail->next = req;
+	else
+		meta_queue.head = req;
+	meta_queue.tail = req;
+	pthread_cond_signal(&meta_queue.wake);
+	pthread_mutex_unlock(&meta_queue.lock);
+}
+
+// Returns true if filtered entry i needs a metadata fetch
+static bool meta_wanted(size_t i)
+{
+	if (!meta_shown && !file_at(view_idx(i))->unresolved)
+		return false;
+	struct file_meta *slot = meta_slot(view_idx(i), true);
+	return slot && slot->state == META_NONE;
+}
+
+// Requests metadata for filtered entries [first, first + count) not yet
+// requested, as one batch: everything for the long listing, otherwise
+// only entries the lazy stat mode has not classified
+static void meta_prefetch(size_t first, size_t count)
+{
+	if (first >= filtered_size)
+		return;
+	if (count > filtered_size - first)
+		count = filtered_size - first;
+
+	size_t wanted = 0, names_size = 0;
+	for (size_t i = first; i < first + count; ++i) {
+		if (meta_wanted(i)) {
+			wanted++;
+			names_size += entry_length(view_idx(i)) + 1;
+		}
+	}
+	if (wanted == 0)
+		return;
+
+	struct meta_request *req = malloc(sizeof(*req) + wanted * sizeof(struct meta_item) + names_size);
+	int fd = fcntl(dir_fd, F_DUPFD_CLOEXEC, 0);
+	if (!req || fd < 0) {
+		free(req);
+		if (fd >= 0)
+			close(fd);
+		return;
+	}
+	*req = (struct meta_request){
+		.generation = files_generation,
+		.dir_fd = fd,
+		// On network filesystems, cached attributes are good enough for display
+		.statx_flags = lazy_stat ? AT_STATX_DONT_SYNC : 0,
+		.follow_links = link_colors_need_target(),
+		.count = wanted,
+	};
+
+	char *names = (char *)(req->items + wanted);
+	size_t n = 0;
+	for (size_t i = first; i < first + count; ++i) {
+		if (!meta_wanted(i))
+			continue;
+		struct file_meta *slot = meta_slot(view_idx(i), false);
+		size_t len = entry_length(view_idx(i));
+		memcpy(names, entry_name(view_idx(i)), len + 1);
+		req->items[n++] = (struct meta_item){ .idx = view_idx(i), .name = names };
+		names += len + 1;
+		slot->state = META_PENDING;
+	}
+	meta_submit(req);
+}
+
+// Child counts (-n): the number of entries of each directory shown, as a
+// badge after its name. A worker reads each directory with getdents64 and
+// nothing else, stopping at COUNT_CAP. Only the rows drawn are requested;
+// when they change, requests still queued for the old rows are abandoned.
+// Counts are kept per (device, inode) for as long as the directory keeps
+// its modification time, so scrolling back costs one open and fstat.
+enum {
+	COUNT_CAP = 10000,
+	COUNT_CACHE_MAX = 1 << 16,
+	COUNT_BUFFER = 32 * 1024,
+};
+
+struct child_count
+{
+	uint8_t state;          // META_NONE, ...
+	uint32_t count;         // At most COUNT_CAP, which stands for more
+	uint64_t epoch;         // Of the request it is pending in
+};
+
+struct count_item
+{
+	uint32_t idx;           // Index into files
+	const char *name;       // Copied into the request
+	uint8_t state;
+	uint32_t count;
+};
+
+struct count_request
+{
+	struct completion completion;
+	struct count_request *next;
+	uint64_t generation;
+	uint64_t epoch;
+	int dir_fd;
+	size_t count;
+	struct count_item items[];
+};
+
+static bool counts_enabled;
+static struct child_count **count_chunks;
+static size_t count_chunks_size;
+static atomic_uint_fast64_t count_epoch;   // Bumped when the rows drawn change
+static uint32_t *count_rows;                // Entries drawn at the last request
+static size_t count_rows_size;
+static struct inode_map count_cache;        // Worker only
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	struct count_request *head, *tail;
+	bool started;
+} count_queue = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.wake = PTHREAD_COND_INITIALIZER,
+};
+
+static inline bool counts_shown(void)
+{
+	return counts_enabled && grid_cols <= 1;
+}
+
+// Returns the count slot of files[i], allocating its chunk if create is set
+static struct child_count *count_slot(size_t i, bool create)
+{
+	size_t chunk = i / META_CHUNK;
+	if (chunk >= count_chunks_size) {
+		if (!create)
+			return NULL;
+		size_t size = (files_size + META_CHUNK - 1) / META_CHUNK;
+		if (size <= chunk)
+			size = chunk + 1;
+		struct child_count **chunks = realloc(count_chunks, size * sizeof(*chunks));
+		if (!chunks)
+			return NULL;
+		memset(chunks + count_chunks_size, 0, (size - count_chunks_size) * sizeof(*chunks));
+		count_chunks = chunks;
+		count_chunks_size = size;
+	}
+	if (!count_chunks[chunk]) {
+		if (!create)
+			return NULL;
+		count_chunks[chunk] = calloc(META_CHUNK, sizeof(struct child_count));
+		if (!count_chunks[chunk])
+			return NULL;
+	}
+	return count_chunks[chunk] + i % META_CHUNK;
+}
+
+// Drops the counts of the listing and abandons the requests for them
+static void counts_reset(void)
+{
+	for (size_t c = 0; c < count_chunks_size; ++c)
+		free(count_chunks[c]);
+	free(count_chunks);
+	count_chunks = NULL;
+	count_chunks_size = 0;
+	count_rows_size = 0;
+	atomic_fetch_add(&count_epoch, 1);
+}
+
+// Counts the entries of directory name that would be listed, up to COUNT_CAP
+static void count_one(int dir_fd, struct count_item *item, char *buf)
+{
+	int fd = openat(dir_fd, item->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	struct stat info;
+	if (fd < 0 || fstat(fd, &info) != 0) {
+		if (fd >= 0)
+			close(fd);
+		item->state = META_FAILED;
+		return;
+	}
+
+	struct inode_entry *cached = inode_map_find(&count_cache, info.st_dev, info.st_ino);
+	if (cached && cached->stamp.tv_sec == info.st_mtim.tv_sec && cached->stamp.tv_nsec == info.st_mtim.tv_nsec) {
+		close(fd);
+		item->count = (uint32_t)cached->value;
+		item->state = META_READY;
+		return;
+	}
+
+	uint32_t count = 0;
+	ssize_t n;
+	while (count < COUNT_CAP && (n = syscall(SYS_getdents64, fd, buf, COUNT_BUFFER)) > 0) {
+		for (ssize_t off = 0; off < n; ) {
+			const struct dirent64 *ent = (const struct dirent64 *)(buf + off);
+			const char *d = ent->d_name;
+			if (d[0] != '.')  // Hidden ones are not listed either
+				count++;
+			off += ent->d_reclen;
+		}
+	}
+	close(fd);
+	if (count < COUNT_CAP && n < 0) {
+		item->state = META_FAILED;
+		return;
+	}
+	item->count = count < COUNT_CAP ? count : COUNT_CAP;
+	item->state = META_READY;
+
+	if (count_cache.size >= COUNT_CACHE_MAX)
+		inode_map_free(&count_cache);
+	bool added;
+	struct inode_entry *entry = inode_map_insert(&count_cache, info.st_dev, info.st_ino, &added);
+	if (entry) {
+		entry->stamp = info.st_mtim;
+		entry->value = item->count;
+	}
+}
+
+static void count_done(void *arg);
+
+static void *count_worker(void *arg)
+{
+	(void)arg;
+	char *buf = malloc(COUNT_BUFFER);
+
+	for (;;) {
+		pthread_mutex_lock(&count_queue.lock);
+		while (!count_queue.head)
+			pthread_cond_wait(&count_queue.wake, &count_queue.lock);
+		struct count_request *req = count_queue.head;
+		count_queue.head = req->next;
+		if (!count_queue.head)
+			count_queue.tail = NULL;
+		pthread_mutex_unlock(&count_queue.lock);
+
+		// Items left as META_NONE were abandoned
+		for (size_t i = 0; i < req->count && atomic_load(&count_epoch) == req->epoch; ++i) {
+			if (buf)
+				count_one(req->dir_fd, req->items + i, buf);
+			else
+				req->items[i].state = META_FAILED;
+		}
+		close(req->dir_fd);
+
+		req->completion = (struct completion){ .fn = count_done, .arg = req };
+		post_completion(&req->completion);
+	}
+	return NULL;
+}
+
+// Runs on the main thread with a counted batch
+static void count_done(void *arg)
+{
+	struct count_request *req = arg;
+	bool changed = false;
+
+	if (req->generation == files_generation) {
+		for (size_t i = 0; i < req->count; ++i) {
+			const struct count_item *item = req->items + i;
+			struct child_count *slot = count_slot(item->idx, false);
+			if (!slot || slot->state != META_PENDING)
+				continue;
+			// An abandoned entry may be pending again in a newer request
+			if (item->state == META_NONE && slot->epoch != req->epoch)
+				continue;
+			slot->state = item->state;
+			slot->count = item->count;
+			changed = true;
+		}
+	}
+	free(req);
+
+	if (changed)
+		request_redraw(REDRAW_FULL);
+}
+
+static void count_submit(struct count_request *req)
+{
+	pthread_mutex_lock(&count_queue.lock);
+	if (!count_queue.started) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, count_worker, NULL) != 0) {
+			pthread_mutex_unlock(&count_queue.lock);
+			close(req->dir_fd);
+			free(req);
+			return;
+		}
+		pthread_detach(thread);
+		count_queue.started = true;
+	}
+	req->next = NULL;
+	if (count_queue.tail)
+		count_queue.tail->next = req;
+	else
+		count_queue.head = req;
+	count_queue.tail = req;
+	pthread_cond_signal(&count_queue.wake);
+	pthread_mutex_unlock(&count_queue.lock);
+}
+
+// Returns true if filtered entry i is a directory to count for this epoch
+static bool count_wanted(size_t i, uint64_t epoch)
+{
+	if (file_at(view_idx(i))->type != DT_DIR)
+		return false;
+	struct child_count *slot = count_slot(view_idx(i), true);
+	return slot && (slot->state == META_NONE || (slot->state == META_PENDING && slot->epoch != epoch));
+}
+
+// Requests counts for the directories among filtered entries [first,
+// first + count), the rows drawn. If they are not the rows of the last
+// request, what is still queued for those is abandoned first.
+static void count_prefetch(size_t first, size_t count)
+{
+	if (first >= filtered_size)
+		return;
+	if (count > filtered_size - first)
+		count = filtered_size - first;
+
+	bool same = count == count_rows_size;
+	for (size_t i = 0; same && i < count; ++i)
+		same = count_rows[i] == view_idx(first + i);
+	if (!same) {
+		uint32_t *rows = realloc(count_rows, count * sizeof(*rows));
+		if (!rows)
+			return;
+		count_rows = rows;
+		count_rows_size = count;
+		for (size_t i = 0; i < count; ++i)
+			count_rows[i] = view_idx(first + i);
+		atomic_fetch_add(&count_epoch, 1);
+	}
+	uint64_t epoch = atomic_load(&count_epoch);
+
+	size_t wanted = 0, names_size = 0;
+	for (size_t i = first; i < first + count; ++i) {
+		if (count_wanted(i, epoch)) {
+			wanted++;
+			names_size += entry_length(view_idx(i)) + 1;
+		}
+	}
+	if (wanted == 0)
+		return;
+
+	struct count_request *req = malloc(sizeof(*req) + wanted * sizeof(struct count_item) + names_size);
+	int fd = fcntl(dir_fd, F_DUPFD_CLOEXEC, 0);
+	if (!req || fd < 0) {
+		free(req);
+		if (fd >= 0)
+			close(fd);
+		return;
+	}
+	*req = (struct count_request){
+		.generation = files_generation,
+		.epoch = epoch,
+		.dir_fd = fd,
+		.count = wanted,
+	};
+
+	char *names = (char *)(req->items + wanted);
+	size_t n = 0;
+	for (size_t i = first; i < first + count; ++i) {
+		if (!count_wanted(i, epoch))
+			continue;
+		struct child_count *slot = count_slot(view_idx(i), false);
+		size_t len = entry_length(view_idx(i));
+		memcpy(names, entry_name(view_idx(i)), len + 1);
+		req->items[n++] = (struct count_item){ .idx = view_idx(i), .name = names };
+		names += len + 1;
+		slot->state = META_PENDING;
+		slot->epoch = epoch;
+	}
+	count_submit(req);
+}
+
+// Filesystems where a stat() per entry is a network round trip
+static bool is_slow_filesystem(int fd)
+{
+	struct statfs fs;
+	if (fstatfs(fd, &fs) != 0)
+		return false;
+
+	switch ((unsigned long)fs.f_type) {
+		case 0x6969:        // NFS
+		case 0x65735546:    // FUSE (sshfs, ...)
+		case 0xff534d42:    // CIFS
+		case 0xfe534d42:    // SMB2
+		case 0x517b:        // SMB
+		case 0x00c36400:    // Ceph
+		case 0x01021997:    // 9P
+		case 0x5346414f:    // AFS
+		case 0x47504653:    // GPFS
+		case 0x0bd00bd0:    // Lustre
+			return true;
+		default:
+			return false;
+	}
+}
+
+// The entries of a directory, read off the main thread and then installed
+// as files[], or as a windowed listing once they outgrow the memory budget
+struct listing
+{
+	// Names as read, each after a type and a length byte and NUL terminated,
+	// until they are sorted into files[] and file_names
+	char *read;
+	size_t read_size, read_capacity;
+	size_t *offsets;        // Of each name in read
+	struct file *files;
+	struct front_coded file_names;
+	size_t size, capacity;  // Entries, and room in offsets
+	size_t bytes;           // Estimated peak size while building files[]
+	bool lazy_stat;
+	bool truncated;         // Stopped at the memory budget
+
+	// Windowed
+	struct window_entry *index;
+	size_t index_capacity;
+	int spill_fd;
+	uint64_t spill_size;
+	char *spill_buf;        // Names not written out yet
+	size_t spill_buffered;
+	char *names;            // The spill file, mapped once complete
+};
+
+enum { SPILL_BUF_SIZE = 1 << 16 };
+
+static void listing_free(struct listing *listing)
+{
+	free(listing->read);
+	free(listing->offsets);
+	free(listing->files);
+	front_coded_free(&listing->file_names);
+	free(listing->index);
+	free(listing->spill_buf);
+	if (listing->names)
+		munmap(listing->names, listing->spill_size);
+	if (listing->index && listing->spill_fd >= 0)
+		close(listing->spill_fd);
+	*listing = (struct listing){ 0 };
+}
+
+// Bytes the windowed listing holds besides the index
+static size_t window_overhead(void)
+{
+	return WINDOW_SLOTS * sizeof(struct window_slot) + SPILL_BUF_SIZE;
+}
+
+static int spill_flush(struct listing *listing)
+{
+	for (size_t done = 0; done < listing->spill_buffered; ) {
+		ssize_t n = write(listing->spill_fd, listing->spill_buf + done, listing->spill_buffered - done);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return errno;
+		}
+		done += (size_t)n;
+	}
+	listing->spill_buffered = 0;
+	return 0;
+}
+
+// Adds an entry to a windowed listing. Returns ENOSPC once the index
+// reaches the memory budget.
+static int window_append(struct listing *listing, const char *name, size_t len, unsigned char type)
+{
+	if (listing->size == UINT32_MAX)
+		return ENOSPC;
+	if (listing->size == listing->index_capacity) {
+		size_t budget = memory_budget > window_overhead() ? memory_budget - window_overhead() : 0;
+		size_t limit = budget / sizeof(struct window_entry);
+		size_t capacity = listing->index_capacity ? listing->index_capacity * 2 : 4096;
+		if (capacity > limit)
+			capacity = limit;
+		if (capacity <= listing->size)
+			return ENOSPC;
+		struct window_entry *index = realloc(listing->index, capacity * sizeof(*index));
+		if (!index)
+			return ENOMEM;
+		listing->index = index;
+		listing->index_capacity = capacity;
+	}
+
+	if (listing->spill_buffered + len + 1 > SPILL_BUF_SIZE) {
+		int error = spill_flush(listing);
+		if (error)
+			return error;
+	}
+	memcpy(listing->spill_buf + listing->spill_buffered, name, len + 1);
+	listing->spill_buffered += len + 1;
+
+	struct window_entry *entry = listing->index + listing->size++;
+	memset(entry->prefix, 0, sizeof(entry->prefix));
+	memcpy(entry->prefix, name, len < WINDOW_PREFIX ? len : WINDOW_PREFIX);
+	entry->type = type;
+	entry->length = (unsigned char)len;
+	entry->offset = listing->spill_size;
+	listing->spill_size += len + 1;
+	return 0;
+}
+
+// Switches a listing that outgrew the memory budget to windowed: the
+// entries read so far move to the spill file, and the rest are only
+// classified by d_type
+static int window_begin(struct listing *listing)
+{
+	const char *tmpdir = getenv("TMPDIR");
+	if (!tmpdir || !*tmpdir)
+		tmpdir = "/tmp";
+	listing->index = malloc(sizeof(struct window_entry));  // Marks the listing windowed
+	listing->spill_buf = malloc(SPILL_BUF_SIZE);
+	if (!listing->index || !listing->spill_buf)
+		return ENOMEM;
+	listing->index_capacity = 1;
+	listing->spill_fd = open(tmpdir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+	if (listing->spill_fd < 0)
+		return errno;
+
+	char *read = listing->read;
+	size_t *offsets = listing->offsets;
+	size_t count = listing->size;
+	listing->read = NULL;
+	listing->offsets = NULL;
+	listing->size = listing->capacity = 0;
+	listing->lazy_stat = true;
+
+	int error = 0;
+	for (size_t i = 0; i < count && !error; ++i) {
+		const char *name = read + offsets[i];
+		error = window_append(listing, name, (unsigned char)name[-1], (unsigned char)name[-2]);
+	}
+	free(read);
+	free(offsets);
+	return error;
+}
+
+static int window_compare(const struct window_entry *a, const struct window_entry *b, const char *names)
+{
+	int c = memcmp(a->prefix, b->prefix, WINDOW_PREFIX);
+	if (c != 0 || (a->length <= WINDOW_PREFIX && b->length <= WINDOW_PREFIX))
+		return c;
+	// A name that fits in the prefix comes before the longer names it starts
+	if (a->length <= WINDOW_PREFIX || b->length <= WINDOW_PREFIX)
+		return a->length < b->length ? -1 : 1;
+	// Equal prefixes of names longer than them
+	return strcmp(names + a->offset + WINDOW_PREFIX, names + b->offset + WINDOW_PREFIX);
+}
+
+static inline void window_swap(struct window_entry *a, struct window_entry *b)
+{
+	struct window_entry t = *a;
+	*a = *b;
+	*b = t;
+}
+
+// Sorts in place; qsort() may allocate a copy of the whole index
+static void window_sort(struct window_entry *v, size_t n, const char *names)
+{
+	while (n > 16) {
+		// Median of three, which also leaves sentinels at both ends
+		size_t mid = n / 2;
+		if (window_compare(v + mid, v, names) < 0)
+			window_swap(v + mid, v);
+		if (window_compare(v + n - 1, v, names) < 0)
+			window_swap(v + n - 1, v);
+		if (window_compare(v + n - 1, v + mid, names) < 0)
+			window_swap(v + n - 1, v + mid);
+		window_swap(v + mid, v + n - 2);
+		const struct window_entry pivot = v[n - 2];
+
+		size_t i = 0, j = n - 2;
+		for (;;) {
+			while (window_compare(v + ++i, &pivot, names) < 0) {
+			}
+			while (window_compare(&pivot, v + --j, names) < 0) {
+			}
+			if (i >= j)
+				break;
+			window_swap(v + i, v + j);
+		}
+		window_swap(v + i, v + n - 2);
+
+		// Recurse into the smaller side to bound the stack
+		if (i < n - i - 1) {
+			window_sort(v, i, names);
+			v += i + 1;
+			n -= i + 1;
+		} else {
+			window_sort(v + i + 1, n - i - 1, names);
+			n = i;
+		}
+	}
+	for (size_t i = 1; i < n; ++i)
+		for (size_t j = i; j > 0 && window_compare(v + j, v + j - 1, names) < 0; --j)
+			window_swap(v + j, v + j - 1);
+}
+
+static int window_finish(struct listing *listing)
+{
+	int error = spill_flush(listing);
+	if (error)
+		return error;
+	free(listing->spill_buf);
+	listing->spill_buf = NULL;
+
+	if (listing->spill_size > 0) {
+		listing->names = mmap(NULL, listing->spill_size, PROT_READ, MAP_SHARED, listing->spill_fd, 0);
+		if (listing->names == MAP_FAILED) {
+			listing->names = NULL;
+			return errno;
+		}
+	}
+	window_sort(listing->index, listing->size, listing->names);
+
+	// Return the slack of the last doubling to the budget, for search results
+	struct window_entry *index = realloc(listing->index, (listing->size ? listing->size : 1) * sizeof(*index));
+	if (index) {
+		listing->index = index;
+		listing->index_capacity = listing->size ? listing->size : 1;
+	}
+	return 0;
+}
+
+// Adds an entry read to a listing that is not windowed
+static int listing_append(struct listing *listing, const char *name, size_t len, unsigned char type)
+{
+	if (listing->size == listing->capacity) {
+		size_t capacity = listing->capacity ? listing->capacity * 2 : 64;
+		size_t *offsets = realloc(listing->offsets, capacity * sizeof(*offsets));
+		if (!offsets)
+			return ENOMEM;
+		listing->offsets = offsets;
+		listing->capacity = capacity;
+	}
+	if (listing->read_size + len + 3 > listing->read_capacity) {
+		size_t capacity = listing->read_capacity ? listing->read_capacity * 2 : 4096;
+		while (capacity < listing->read_size + len + 3)
+			capacity *= 2;
+		char *read = realloc(listing->read, capacity);
+		if (!read)
+			return ENOMEM;
+		listing->read = read;
+		listing->read_capacity = capacity;
+	}
+
+	char *p = listing->read + listing->read_size;
+	p[0] = (char)type;
+	p[1] = (char)len;
+	memcpy(p + 2, name, len + 1);
+	listing->offsets[listing->size++] = listing->read_size + 2;
+	listing->read_size += len + 3;
+	return 0;
+}
+
+static int compare_read(const void *a, const void *b, void *read)
+{
+	return strcmp((const char *)read + *(const size_t *)a, (const char *)read + *(const size_t *)b);
+}
+
+// Sorts the names read, and builds files[] and the front-coded names from
+// them in that order. The entries are classified here, so that the stat()
+// calls at least go in name order.
+static int listing_build(int fd, struct listing *listing)
+{
+	if (listing->size > 1)
+		qsort_r(listing->offsets, listing->size, sizeof(*listing->offsets), compare_read, listing->read);
+	if (listing->size > 0) {
+		listing->files = malloc(listing->size * sizeof(struct file));
+		if (!listing->files)
+			return ENOMEM;
+	}
+
+	for (size_t i = 0; i < listing->size; ++i) {
+		const char *name = listing->read + listing->offsets[i];
+		size_t name_len = (unsigned char)name[-1];
+		if (!front_coded_append(&listing->file_names, name, name_len))
+			return ENOMEM;
+
+		bool ascii = utf8_is_ascii(name, name_len);
+		size_t cols = ascii ? name_len : utf8_width(name, name_len);
+		struct file *file = listing->files + i;
+		*file = (struct file){
+			.length = (unsigned char)name_len,
+			.type = (unsigned char)name[-2],
+			.exec = false,
+			.ascii = ascii,
+			.cols = (uint16_t)(cols < UINT16_MAX ? cols : UINT16_MAX),
+		};
+
+		// Lazy stat trusts d_type and leaves the rest to the rows that get drawn
+		if (listing->lazy_stat && needs_stat(file)) {
+			file->unresolved = true;
+			file->color = LsColor_fi;
+			continue;
+		}
+
+		// Some filesystems report DT_UNKNOWN; resolve type and exec bit via lstat().
+		bool need_lstat = file->type == DT_UNKNOWN || file->type == DT_REG;
+		bool need_target = file->type == DT_LNK && link_colors_need_target();
+		struct stat info, target;
+		bool have_info = need_lstat && fstatat(fd, name, &info, AT_SYMLINK_NOFOLLOW) == 0;
+		if (have_info)
+			apply_mode(file, info.st_mode);
+		bool have_target = need_target && fstatat(fd, name, &target, 0) == 0;
+		file->color = resolve_color(file, name, have_info ? &info : NULL, have_target ? &target : NULL);
+	}
+	front_coded_shrink(&listing->file_names);
+
+	free(listing->read);
+	free(listing->offsets);
+	listing->read = NULL;
+	listing->offsets = NULL;
+	listing->read_size = listing->read_capacity = listing->capacity = 0;
+	return 0;
+}
+
+// Reads the directory open as fd into *listing, sorted by name. Only reads
+// shared state that is fixed after startup, so it can run on any thread.
+// Returns 0 or an errno value.
+static int load_listing(int fd, struct listing *listing)
+{
+	*listing = (struct listing){
+		.lazy_stat = lazy_stat_forced || is_slow_filesystem(fd),
+		.spill_fd = -1,
+	};
+
+	int list_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	DIR *dir = list_fd >= 0 ? fdopendir(list_fd) : NULL;
+	if (!dir) {
+		int error = errno;
+		if (list_fd >= 0)
+			close(list_fd);
+		return error;
+	}
+
+	int error = 0;
+	struct dirent *entry;
+
+	while ((entry = readdir(dir)) != NULL) {
+		if (entry->d_name[0] == '.')
+			continue;
+
+		size_t name_len = strlen(entry->d_name);
+		if (name_len == 0 || name_len > NAME_MAX)
+			continue;
+
+		if (listing->index) {
+			error = window_append(listing, entry->d_name, name_len, entry->d_type);
+			if (error)
+				break;
+			continue;
+		}
+
+		// The names as read and front coded, their offset and the entry
+		listing->bytes += sizeof(struct file) + sizeof(struct filtered_file) + sizeof(size_t) + 2 * (name_len + 3);
+		if (listing->bytes > memory_budget) {
+			error = window_begin(listing);
+			if (!error)
+				error = window_append(listing, entry->d_name, name_len, entry->d_type);
+		} else {
+			error = listing_append(listing, entry->d_name, name_len, entry->d_type);
+		}
+		if (error)
+			break;
+	}
+
+	closedir(dir);
+	// The budget cuts the listing short rather than failing it
+	if (error == ENOSPC) {
+		listing->truncated = true;
+		error = 0;
+	}
+	if (!error)
+		error = listing->index ? window_finish(listing) : listing_build(fd, listing);
+	if (error) {
+		listing_free(listing);
+		return error;
+	}
+	return 0;
+}
+
+// Server mode (--server): a long-lived process that every later explorer
+// in the same account hands its session to, so that nothing starts cold.
+// The server has LS_COLORS parsed and keeps the listings of the last
+// directories asked for, for as long as their modification time stays the
+// same. A client sends its arguments, environment, umask and terminal fds
+// over a unix socket; the server forks, and the child runs the session on
+// those fds with all of that already in memory. A directory the server has
+// no current listing of is read by the session as usual, and meanwhile on a
+// thread of the server's for the next one, so a slow directory never holds
+// up the other clients. The client only passes on the signals the terminal
+// sends it, and exits with the session's status.
+enum {
+	SERVER_CACHE_SIZE = 8,
+	SERVER_REQUEST_MAX = 1 << 20,
+	SERVER_FDS = 5,         // stdin, stdout, stderr, cwd and the directory to list
+	SERVER_LOAD_MS = 2000,  // A load still running after this is taken for hung, as FS_DEADLINE_MS
+};
+
+struct server_request
+{
+	uint32_t argc, envc;
+	uint32_t size;          // Of the strings that follow, each NUL terminated
+	uint32_t umask;
+};
+
+struct server_session
+{
+	pid_t pid;
+	int conn;
+	bool hung_up;           // The client went away; the session was sent SIGHUP
+};
+
+static struct {
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;
+	struct listing listing;
+	uint64_t used;          // Tick of the last request, for eviction
+	uint64_t loading;       // Id of the load in progress, 0 for none
+	uint64_t loading_since;
+	bool valid;             // dev, ino and mtime are set
+	bool cached;            // The listing is held too
+} server_cache[SERVER_CACHE_SIZE];
+static uint64_t server_tick;
+static uint64_t server_load_id;
+static pid_t server_client;     // In a session: the client, stopped on suspend
+static int server_listen_fd = -1, server_signal_fd = -1;
+static struct server_session *server_sessions;
+static size_t server_sessions_size;
+static struct pollfd *server_pfds;
+static char *server_colors;     // The LS_COLORS parsed by the server
+static sigset_t server_sigmask; // To restore in sessions
+
+static bool server_address(struct sockaddr_un *addr)
+{
+	const char *runtime = getenv("XDG_RUNTIME_DIR");
+	*addr = (struct sockaddr_un){ .sun_family = AF_UNIX };
+	int n = runtime && runtime[0] == '/'
+		? snprintf(addr->sun_path, sizeof(addr->sun_path), "%s/explorer.sock", runtime)
+		: snprintf(addr->sun_path, sizeof(addr->sun_path), "/tmp/explorer-%u.sock", (unsigned)getuid());
+	return n > 0 && (size_t)n < sizeof(addr->sun_path);
+}
+
+// Returns true if the other end of the socket is a process of this user
+static bool peer_trusted(int fd, pid_t *pid)
+{
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0 || cred.uid != getuid())
+		return false;
+	if (pid)
+		*pid = cred.pid;
+	return true;
+}
+
+static bool write_full(int fd, const void *buf, size_t size)
+{
+	for (size_t done = 0; done < size; ) {
+		ssize_t n = write(fd, (const char *)buf + done, size - done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		done += (size_t)n;
+	}
+	return true;
+}
+
+static bool read_full(int fd, void *buf, size_t size)
+{
+	for (size_t done = 0; done < size; ) {
+		ssize_t n = read(fd, (char *)buf + done, size - done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		done += (size_t)n;
+	}
+	return true;
+}
+
+static bool same_mtime(const struct timespec *a, const struct timespec *b)
+{
+	return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
+
+// Returns the cache slot of the directory, or SIZE_MAX
+static size_t server_cache_find(const struct stat *st)
+{
+	for (size_t i = 0; i < SERVER_CACHE_SIZE; ++i)
+		if ((server_cache[i].valid || server_cache[i].loading)
+			&& server_cache[i].dev == st->st_dev && server_cache[i].ino == st->st_ino)
+			return i;
+	return SIZE_MAX;
+}
+
+// In a session: takes the listing the server had of the directory open as
+// fd, if it has not changed since. Returns false if there is none.
+static bool server_listing_take(int fd, struct listing *listing)
+{
+	struct stat st;
+	if (!server_client || fstat(fd, &st) != 0)
+		return false;
+	size_t i = server_cache_find(&st);
+	if (i == SIZE_MAX || !server_cache[i].cached || !same_mtime(&server_cache[i].mtime, &st.st_mtim)
+		|| server_cache[i].listing.bytes > memory_budget)
+		return false;
+	*listing = server_cache[i].listing;
+	server_cache[i].cached = false;
+	return true;
+}
+
+// A directory loaded on a thread of the server's
+struct server_load
+{
+	struct completion completion;
+	uint64_t id;
+	int fd;
+	struct timespec mtime;  // From before the load, so a change during it shows next time
+	int error;
+	struct listing listing;
+};
+
+// In the server: puts a listing loaded into its cache slot, unless the slot
+// was given up to another directory meanwhile
+static void server_load_done(void *arg)
+{
+	struct server_load *load = arg;
+	size_t slot = SIZE_MAX;
+	for (size_t i = 0; i < SERVER_CACHE_SIZE; ++i)
+		if (server_cache[i].loading == load->id)
+			slot = i;
+	close(load->fd);
+	if (slot != SIZE_MAX) {
+		server_cache[slot].loading = 0;
+		if (load->error == 0) {
+			server_cache[slot].mtime = load->mtime;
+			server_cache[slot].valid = true;
+		}
+	}
+	// Windowed listings live in a temporary file of their own. The slot
+	// still remembers not to read the directory again until it changes.
+	if (load->error == 0) {
+		if (slot == SIZE_MAX || load->listing.index || load->listing.truncated) {
+			listing_free(&load->listing);
+		} else {
+			server_cache[slot].listing = load->listing;
+			server_cache[slot].cached = true;
+		}
+	}
+	free(load);
+}
+
+static void *server_load_thread(void *arg)
+{
+	struct server_load *load = arg;
+	load->error = load_listing(load->fd, &load->listing);
+	load->completion = (struct completion){ .fn = server_load_done, .arg = load };
+	post_completion(&load->completion);
+	return NULL;
+}
+
+// In the server: starts reading the directory open as fd into the cache,
+// unless the listing there is still current or being loaded. Network
+// filesystems are left out, as reading them can hang. A load running for
+// longer than SERVER_LOAD_MS holds on to its slot only until it is the one
+// to evict.
+static void server_listing_refresh(int fd)
+{
+	struct stat st;
+	if (fstat(fd, &st) != 0 || is_slow_filesystem(fd))
+		return;
+
+	uint64_t now = now_ms();
+	size_t slot = server_cache_find(&st);
+	if (slot != SIZE_MAX && (server_cache[slot].loading || same_mtime(&server_cache[slot].mtime, &st.st_mtim))) {
+		server_cache[slot].used = ++server_tick;
+		return;
+	}
+	if (slot == SIZE_MAX) {
+		for (size_t i = 0; i < SERVER_CACHE_SIZE; ++i) {
+			if (server_cache[i].loading && now - server_cache[i].loading_since < SERVER_LOAD_MS)
+				continue;
+			if (slot == SIZE_MAX || server_cache[i].used < server_cache[slot].used)
+				slot = i;
+		}
+		if (slot == SIZE_MAX)
+			return;
+	}
+
+	struct server_load *load = malloc(sizeof(*load));
+	int load_fd = load ? fcntl(fd, F_DUPFD_CLOEXEC, 0) : -1;
+	if (load_fd < 0) {
+		free(load);
+		return;
+	}
+	if (server_cache[slot].cached)
+		listing_free(&server_cache[slot].listing);
+	*load = (struct server_load){ .id = ++server_load_id, .fd = load_fd, .mtime = st.st_mtim };
+	server_cache[slot].dev = st.st_dev;
+	server_cache[slot].ino = st.st_ino;
+	server_cache[slot].used = ++server_tick;
+	server_cache[slot].loading = load->id;
+	server_cache[slot].loading_since = now;
+	server_cache[slot].valid = server_cache[slot].cached = false;
+
+	// The thread inherits the blocked signal mask, so signals stay on the signalfd
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, server_load_thread, load) != 0) {
+		server_cache[slot].loading = 0;
+		close(load_fd);
+		free(load);
+		return;
+	}
+	pthread_detach(thread);
+}
+
+// Hands this session to a server, if one is running. Returns its exit
+// status, or -1 to run here.
+static int client_attach(int argc, char **argv, const char *dir)
+{
+	struct sockaddr_un addr;
+	if (server_client || !server_address(&addr))
+		return -1;
+	int conn = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (conn < 0)
+		return -1;
+	int fds[SERVER_FDS] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO, -1, -1 };
+	if (connect(conn, (struct sockaddr *)&addr, sizeof(addr)) != 0 || !peer_trusted(conn, NULL)
+		|| (fds[3] = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0
+		|| (fds[4] = open(dir ? dir : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+		if (fds[3] >= 0)
+			close(fds[3]);
+		close(conn);
+		return -1;
+	}
+
+	// Blocked before the session starts, so that none is lost
+	sigset_t forwarded, saved;
+	sigemptyset(&forwarded);
+	int forward[] = { SIGINT, SIGTERM, SIGHUP, SIGQUIT, SIGWINCH, SIGTSTP, SIGCONT };
+	for (size_t i = 0; i < sizeof(forward) / sizeof(*forward); ++i)
+		sigaddset(&forwarded, forward[i]);
+	sigprocmask(SIG_BLOCK, &forwarded, &saved);
+
+	struct server_request req = { .argc = (uint32_t)argc };
+	mode_t mask = umask(0);
+	umask(mask);
+	req.umask = mask;
+	for (int i = 0; i < argc; ++i)
+		req.size += (uint32_t)strlen(argv[i]) + 1;
+	for (char **env = environ; *env && req.size < SERVER_REQUEST_MAX; ++env, ++req.envc)
+		req.size += (uint32_t)strlen(*env) + 1;
+
+	char *strings = req.size <= SERVER_REQUEST_MAX ? malloc(req.size) : NULL;
+	pid_t pid = 0;
+	if (strings) {
+		char *p = strings;
+		for (int i = 0; i < argc; ++i)
+			p = stpcpy(p, argv[i]) + 1;
+		for (uint32_t i = 0; i < req.envc; ++i)
+			p = stpcpy(p, environ[i]) + 1;
+
+		union {
+			char buf[CMSG_SPACE(sizeof(fds))];
+			struct cmsghdr align;
+		} control;
+		struct iovec iov = { .iov_base = &req, .iov_len = sizeof(req) };
+		struct msghdr msg = {
+			.msg_iov = &iov,
+			.msg_iovlen = 1,
+			.msg_control = control.buf,
+			.msg_controllen = sizeof(control.buf),
+		};
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+		memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+		int32_t started;
+		if (sendmsg(conn, &msg, MSG_NOSIGNAL) == (ssize_t)sizeof(req) && write_full(conn, strings, req.size)
+			&& read_full(conn, &started, sizeof(started)))
+			pid = (pid_t)started;
+		free(strings);
+	}
+	close(fds[3]);
+	close(fds[4]);
+	if (pid <= 0) {
+		close(conn);
+		sigprocmask(SIG_SETMASK, &saved, NULL);
+		return -1;
+	}
+
+	int signal_fd = signalfd(-1, &forwarded, SFD_CLOEXEC);
+	struct pollfd pfds[2] = {
+		{ .fd = conn, .events = POLLIN },
+		{ .fd = signal_fd, .events = POLLIN },
+	};
+	for (;;) {
+		if (poll(pfds, signal_fd >= 0 ? 2 : 1, -1) < 0 && errno != EINTR)
+			break;
+		struct signalfd_siginfo info;
+		if (pfds[1].revents && read(signal_fd, &info, sizeof(info)) == sizeof(info))
+			kill(pid, (int)info.ssi_signo);
+		if (pfds[0].revents) {
+			int32_t status;
+			return read_full(conn, &status, sizeof(status)) ? status : EXIT_FAILURE;
+		}
+	}
+	return EXIT_FAILURE;
+}
+
+static int explorer_main(int argc, char **argv);
+static void on_worker(int fd, short revents);
+
+// Runs in the child the server forked for a request; does not return
+static void server_session_run(pid_t client, const struct server_request *req, int *fds, char *strings)
+{
+	close(server_listen_fd);
+	close(server_signal_fd);
+	// Loads still running in the server end there. The lock may have been
+	// held by one of their threads at the fork.
+	close(worker_fd);
+	pthread_mutex_init(&completions_lock, NULL);
+	completions = NULL;
+	sigprocmask(SIG_SETMASK, &server_sigmask, NULL);
+	signal(SIGPIPE, SIG_DFL);
+	setsid();
+	for (int i = 0; i < 3; ++i) {
+		dup2(fds[i], i);
+		close(fds[i]);
+	}
+	if (fchdir(fds[3]) != 0)
+		_exit(EXIT_FAILURE);
+	close(fds[3]);
+	close(fds[4]);
+	umask((mode_t)req->umask);
+
+	char **argv = malloc((req->argc + 1) * sizeof(*argv));
+	if (!argv)
+		_exit(EXIT_FAILURE);
+	char *p = strings;
+	for (uint32_t i = 0; i < req->argc; ++i, p += strlen(p) + 1)
+		argv[i] = p;
+	argv[req->argc] = NULL;
+	clearenv();
+	for (uint32_t i = 0; i < req->envc; ++i, p += strlen(p) + 1)
+		putenv(p);
+
+	// Colors are parsed again for a different LS_COLORS, and the listings
+	// colored for the server's are no use
+	const char *colors = getenv("LS_COLORS");
+	if (strcmp(colors ? colors : "", server_colors) != 0) {
+		free_ls_colors();
+		for (size_t i = 0; i < SERVER_CACHE_SIZE; ++i) {
+			if (server_cache[i].cached)
+				listing_free(&server_cache[i].listing);
+			server_cache[i].cached = false;
+		}
+	}
+	server_client = client;
+	exit(explorer_main((int)req->argc, argv));
+}
+
+// Takes a request off conn and starts its session, with the directory it
+// lists in the cache. A directory not cached yet, or changed, is read again
+// once the session is started, so that the next request finds it.
+static void server_accept(int conn)
+{
+	pid_t client;
+	struct server_request req;
+	int fds[SERVER_FDS];
+	size_t received = 0;
+	char *strings = NULL;
+
+	struct timeval timeout = { .tv_sec = 1 };
+	setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	union {
+		char buf[CMSG_SPACE(sizeof(fds))];
+		struct cmsghdr align;
+	} control;
+	struct iovec iov = { .iov_base = &req, .iov_len = sizeof(req) };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buf,
+		.msg_controllen = sizeof(control.buf),
+	};
+	bool ok = peer_trusted(conn, &client) && recvmsg(conn, &msg, MSG_CMSG_CLOEXEC) == (ssize_t)sizeof(req);
+	struct cmsghdr *cmsg = ok ? CMSG_FIRSTHDR(&msg) : NULL;
+	if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+		received = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		memcpy(fds, CMSG_DATA(cmsg), received * sizeof(int));
+	}
+	ok = ok && received == SERVER_FDS && req.argc > 0 && req.size <= SERVER_REQUEST_MAX
+		&& (strings = malloc(req.size + 1)) && read_full(conn, strings, req.size);
+	if (ok) {
+		// Exactly argc + envc strings
+		strings[req.size] = '\0';
+		size_t n = 0;
+		for (size_t i = 0; i < req.size; ++i)
+			n += strings[i] == '\0';
+		ok = n == (size_t)req.argc + req.envc && strings[req.size - 1] == '\0';
+	}
+	struct server_session *grown = ok
+		? realloc(server_sessions, (server_sessions_size + 1) * sizeof(*server_sessions)) : NULL;
+	if (grown)
+		server_sessions = grown;
+	pid_t pid = grown ? fork() : -1;
+	if (pid == 0) {
+		for (size_t i = 0; i < server_sessions_size; ++i)
+			close(server_sessions[i].conn);
+		close(conn);
+		server_session_run(client, &req, fds, strings);
+	}
+	int32_t started = pid;
+	if (pid > 0 && write_full(conn, &started, sizeof(started))) {
+		server_sessions[server_sessions_size++] = (struct server_session){ .pid = pid, .conn = conn };
+		conn = -1;
+		server_listing_refresh(fds[4]);
+	}
+	if (conn >= 0)
+		close(conn);
+	for (size_t i = 0; i < received; ++i)
+		close(fds[i]);
+	free(strings);
+}
+
+static int server_main(void)
+{
+	struct sockaddr_un addr;
+	if (!server_address(&addr)) {
+		PUTS_ERR("Error: the socket path is too long\n");
+		return EXIT_FAILURE;
+	}
+	int listen_fd = server_listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (listen_fd < 0) {
+		perror("socket");
+		return EXIT_FAILURE;
+	}
+	if (connect(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+		PRINTF_ERR("Error: a server is already listening on %s\n", addr.sun_path);
+		return EXIT_FAILURE;
+	}
+	// Only a socket left by a server that is gone is replaced
+	struct stat st;
+	if (lstat(addr.sun_path, &st) == 0 && S_ISSOCK(st.st_mode) && st.st_uid == getuid())
+		unlink(addr.sun_path);
+	mode_t mask = umask(0077);
+	bool bound = bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+	umask(mask);
+	if (!bound || listen(listen_fd, 64) != 0) {
+		perror(addr.sun_path);
+		return EXIT_FAILURE;
+	}
+
+	parse_ls_colors();
+	utf8_build_bmp_widths();
+	const char *colors = getenv("LS_COLORS");
+	server_colors = strdup(colors ? colors : "");
+
+	sigset_t handled;
+	sigemptyset(&handled);
+	sigaddset(&handled, SIGCHLD);
+	sigaddset(&handled, SIGINT);
+	sigaddset(&handled, SIGTERM);
+	sigaddset(&handled, SIGHUP);
+	sigprocmask(SIG_BLOCK, &handled, &server_sigmask);
+	signal(SIGPIPE, SIG_IGN);
+	int signal_fd = server_signal_fd = signalfd(-1, &handled, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (!server_colors || signal_fd < 0) {
+		perror("signalfd");
+		return EXIT_FAILURE;
+	}
+	worker_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (worker_fd < 0) {
+		perror("eventfd");
+		return EXIT_FAILURE;
+	}
+
+	bool quit = false;
+	while (!quit || server_sessions_size > 0) {
+		// Without room for the sessions, only the server's own fds are polled
+		struct pollfd *grown = realloc(server_pfds, (server_sessions_size + 3) * sizeof(*server_pfds));
+		if (grown)
+			server_pfds = grown;
+		else if (!server_pfds)
+			break;
+		size_t polled = grown ? server_sessions_size : 0;
+		struct pollfd *pfds = server_pfds;
+		pfds[0] = (struct pollfd){ .fd = quit ? -1 : listen_fd, .events = POLLIN };
+		pfds[1] = (struct pollfd){ .fd = signal_fd, .events = POLLIN };
+		pfds[2] = (struct pollfd){ .fd = worker_fd, .events = POLLIN };
+		for (size_t i = 0; i < polled; ++i)
+			pfds[i + 3] = (struct pollfd){
+				.fd = server_sessions[i].hung_up ? -1 : server_sessions[i].conn,
+				.events = POLLIN,
+			};
+		if (poll(pfds, polled + 3, -1) < 0 && errno != EINTR) {
+			perror("poll");
+			break;
+		}
+
+		// A client that goes away takes its session with it
+		for (size_t i = 0; i < polled; ++i) {
+			if (pfds[i + 3].revents) {
+				kill(server_sessions[i].pid, SIGHUP);
+				server_sessions[i].hung_up = true;
+			}
+		}
+
+		// Sessions running when asked to quit are waited for, as their
+		// clients wait for their status
+		struct signalfd_siginfo info;
+		while (read(signal_fd, &info, sizeof(info)) == sizeof(info))
+			quit |= info.ssi_signo != SIGCHLD;
+		int status;
+		pid_t pid;
+		while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+			for (size_t i = 0; i < server_sessions_size; ++i) {
+				struct server_session *session = &server_sessions[i];
+				if (session->pid != pid)
+					continue;
+				int32_t code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+				write_full(session->conn, &code, sizeof(code));
+				close(session->conn);
+				*session = server_sessions[--server_sessions_size];
+				break;
+			}
+		}
+		if (pfds[2].revents & POLLIN)
+			on_worker(worker_fd, POLLIN);
+		if (quit && listen_fd >= 0) {
+			unlink(addr.sun_path);
+			close(listen_fd);
+			listen_fd = -1;
+		}
+
+		if (!quit && (pfds[0].revents & POLLIN)) {
+			int conn = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+			if (conn >= 0)
+				server_accept(conn);
+		}
+	}
+	if (listen_fd >= 0)
+		unlink(addr.sun_path);
+	for (size_t i = 0; i < SERVER_CACHE_SIZE; ++i)
+		if (server_cache[i].cached)
+			listing_free(&server_cache[i].listing);
+	free(server_sessions);
+	free(server_pfds);
+	free(server_colors);
+	return EXIT_SUCCESS;
+}
+
+static void window_release(void)
+{
+	if (window_names)
+		munmap((void *)window_names, window_names_size);
+	free(window_index);
+	window_names = NULL;
+	window_names_size = 0;
+	window_index = NULL;
+	window_index_capacity = 0;
+	windowed = false;
+}
+
+// Replaces files[] with a loaded listing, which is left empty
+static void install_listing(struct listing *listing)
+{
+	name_pool_reset();
+	free(files);
+	window_release();
+
+	files = listing->files;
+	files_size = listing->size;
+	file_names = listing->file_names;
+	lazy_stat = listing->lazy_stat;
+	listing_truncated = listing->truncated;
+	if (listing->index) {
+		if (!window_cache)
+			window_cache = malloc(WINDOW_SLOTS * sizeof(*window_cache));
+		if (!window_cache) {
+			perror("malloc");
+			exit(EXIT_FAILURE);
+		}
+		for (size_t i = 0; i < WINDOW_SLOTS; ++i)
+			window_cache[i].used = false;
+		windowed = true;
+		window_index = listing->index;
+		window_index_capacity = listing->index_capacity;
+		window_names = listing->names;
+		window_names_size = listing->spill_size;
+		close(listing->spill_fd);  // The mapping keeps the file
+	}
+	*listing = (struct listing){ 0 };
+	meta_reset();
+	counts_reset();
+	marks_clear();
+	du_clear();
+
+	// No search: the view is every entry, without an array
+	free(filtered);
+	filtered = NULL;
+	filtered_capacity = 0;
+	filtered_size = files_size;
+	filter_truncated = false;
+
+	prev_search_len = 0;  // Reset incremental filter state
+	update_layout();
+}
+
+static size_t entry_cols(const struct file *file)
+{
+	return file->cols + (file->type == DT_DIR ? 1 : 0);
+}
+
+// Measures the widest entry of every column of rows entries. Returns the
+// number of columns, or 0 if out of memory.
+static size_t grid_measure(size_t rows)
+{
+	size_t count = (filtered_size + rows - 1) / rows;
+	if (count > grid_widths_capacity) {
+		uint16_t *widths = realloc(grid_widths, count * sizeof(*grid_widths));
+		if (!widths)
+			return 0;
+		grid_widths = widths;
+		grid_widths_capacity = count;
+	}
+
+	for (size_t c = 0, i = 0; c < count; ++c) {
+		size_t end = i + rows < filtered_size ? i + rows : filtered_size;
+		size_t widest = 0;
+		for (; i < end; ++i) {
+			size_t w = entry_cols(file_at(view_idx(i)));
+			if (w > widest)
+				widest = w;
+		}
+		grid_widths[c] = (uint16_t)(widest < UINT16_MAX ? widest : UINT16_MAX);
+	}
+	return count;
+}
+
+// Returns true if every screen of ncols measured columns fits the list width
+static bool grid_fits(size_t count, size_t ncols)
+{
+	for (size_t first = 0; first < count; first += ncols) {
+		size_t used = 1;  // Terminal edge
+		for (size_t c = first; c < first + ncols && c < count; ++c) {
+			used += 2 + grid_widths[c];  // Marker, then the name
+			if (used > list_cols)
+				return false;
+		}
+	}
+	return true;
+}
+
+// Picks the most columns that fit. Columns of a full page share one
+// measurement; only lists shorter than a screen, which are balanced over
+// fewer rows, need one per candidate.
+static void update_grid(void)
+{
+	grid_cols = 1;
+	grid_rows = page_size;
+
+	// A windowed listing cannot measure every entry, and a streamed one
+	// would be measured again with every batch
+	if (grid_mode && !long_mode && !sizes_shown && !windowed && !stream_mode && filtered_size > 1) {
+		size_t measured_rows = 0, count = 0;
+		for (size_t ncols = list_cols / 3; ncols > 1; --ncols) {
+			size_t rows = (filtered_size + ncols - 1) / ncols;
+			if (rows > page_size)
+				rows = page_size;
+			if (rows != measured_rows) {
+				count = grid_measure(rows);
+				if (count == 0)
+					break;
+				measured_rows = rows;
+			}
+			if (count > 1 && grid_fits(count, ncols)) {
+				grid_cols = ncols < count ? ncols : count;
+				grid_rows = rows;
+				break;
+			}
+		}
+	}
+	page_entries = grid_rows * grid_cols;
+}
+
+// Finds the query in entry i. Names are folded as they stream past, from
+// the front-coded names or the spill file, without materializing entries.
+static bool entry_match(size_t i, uint32_t *match_start)
+{
+	const char *needle = filter_case_sensitive ? search_query : search_query_lower;
+	const char *hay = entry_name(i);
+	char folded[STREAM_PATH_MAX + 1];
+
+	if (!filter_case_sensitive) {
+		fold_name(folded, hay, entry_length(i));
+		hay = folded;
+	}
+
+	const char *match = strstr(hay, needle);
+	if (!match)
+		return false;
+	*match_start = (uint32_t)(match - hay);
+	return true;
+}
+
+// Appends a match. Returns false when a windowed listing has no memory
+// budget left for it.
+static bool filtered_push(uint32_t i, uint32_t match_start)
+{
+	if (filtered_size == filtered_capacity) {
+		size_t capacity = filtered_capacity ? filtered_capacity * 2 : 256;
+		if (capacity > files_size)
+			capacity = files_size;
+		if (windowed) {
+			size_t used = window_index_capacity * sizeof(struct window_entry) + window_overhead();
+			size_t limit = memory_budget > used ? (memory_budget - used) / sizeof(struct filtered_file) : 0;
+			if (capacity > limit)
+				capacity = limit;
+		}
+		struct filtered_file *grown = capacity > filtered_size
+			? realloc(filtered, capacity * sizeof(*grown)) : NULL;
+		if (!grown)
+			return false;
+		filtered = grown;
+		filtered_capacity = capacity;
+	}
+	filtered[filtered_size++] = (struct filtered_file){ .idx = i, .match_start = match_start };
+	return true;
+}
+
+// Largest first, then the ones not measured, each in name order
+static int compare_view_size(const void *a, const void *b)
+{
+	uint32_t i = ((const struct filtered_file *)a)->idx, j = ((const struct filtered_file *)b)->idx;
+	uint64_t x = du_sizes ? du_sizes[i] : SIZE_UNKNOWN, y = du_sizes ? du_sizes[j] : SIZE_UNKNOWN;
+	if (x != y)
+		return x == SIZE_UNKNOWN ? 1 : y == SIZE_UNKNOWN ? -1 : x < y ? 1 : -1;
+	return i < j ? -1 : i > j;
+}
+
+static int compare_view_name(const void *a, const void *b)
+{
+	uint32_t i = ((const struct filtered_file *)a)->idx, j = ((const struct filtered_file *)b)->idx;
+	return i < j ? -1 : i > j;
+}
+
+// Orders the view by size or by name. The order of files[] is name order,
+// so the view by name without a search needs no array.
+static void sort_filtered(void)
+{
+	sort_pending = false;
+	if (windowed)
+		return;
+	if (!sort_by_size && search_len == 0) {
+		free(filtered);
+		filtered = NULL;
+		filtered_capacity = 0;
+		return;
+	}
+	if (!filtered) {
+		filtered = malloc(files_size * sizeof(*filtered));
+		if (!filtered)
+			return;
+		filtered_capacity = files_size;
+		for (size_t k = 0; k < files_size; ++k)
+			filtered[k] = (struct filtered_file){ .idx = (uint32_t)k };
+	}
+	qsort(filtered, filtered_size, sizeof(*filtered), sort_by_size ? compare_view_size : compare_view_name);
+}
+
+// Sorts the view again, keeping the cursor on its entry
+static void sort_view(void)
+{
+	if (filtered_size == 0) {
+		sort_pending = false;
+		return;
+	}
+	uint32_t at = view_idx(idx);
+	sort_filtered();
+	for (size_t k = 0; k < filtered_size; ++k) {
+		if (view_idx(k) == at) {
+			idx = k;
+			break;
+		}
+	}
+	scroll_to_idx();
+}
+
+static void toggle_sort(void)
+{
+	if (windowed || stream_mode)
+		return;
+	sort_by_size = !sort_by_size;
+	sort_view();
+	request_redraw(REDRAW_FULL);
+}
+
+static void apply_filter(void)
+{
+	// Determine case sensitivity (only when query changes)
+	filter_case_sensitive = utf8_fold(search_query_lower, search_query, search_len);
+	search_query_lower[search_len] = '\0';
+
+	// Incremental filtering: if the query grew around the previous one, filter from current matches
+	bool incremental = search_len > prev_search_len && prev_search_len > 0
+					   && strstr(search_query, prev_query) && !filter_truncated;
+	prev_search_len = search_len;
+	memcpy(prev_query, search_query, search_len + 1);
+
+	if (search_len == 0) {
+		// No filter - show all files
+		free(filtered);
+		filtered = NULL;
+		filtered_capacity = 0;
+		filtered_size = files_size;
+		filter_truncated = false;
+	} else if (incremental) {
+		// Filter from current matches (subset)
+		size_t new_size = 0;
+		for (size_t i = 0; i < filtered_size; ++i) {
+			uint32_t match_start;
+			if (entry_match(filtered[i].idx, &match_start)) {
+				filtered[new_size].idx = filtered[i].idx;
+				filtered[new_size].match_start = match_start;
+				new_size++;
+			}
+		}
+		filtered_size = new_size;
+	} else {
+		// Full filter from all files
+		filtered_size = 0;
+		filter_truncated = false;
+		for (size_t i = 0; i < files_size; ++i) {
+			uint32_t match_start;
+			if (entry_match(i, &match_start) && !filtered_push((uint32_t)i, match_start)) {
+				filter_truncated = true;
+				break;
+			}
+		}
+	}
+
+	if (sort_by_size)
+		sort_filtered();
+	idx = cursor = top = 0;
+	update_grid();
+}
+
+// Applies a query edit deferred by input coalescing
+static void sync_filter(void)
+{
+	if (filter_pending) {
+		filter_pending = false;
+		apply_filter();
+		request_redraw(REDRAW_FULL);
+	}
+}
+
+static void schedule_filter(void)
+{
+	filter_pending = true;
+	request_redraw(REDRAW_FULL);
+}
+
+// Stdin mode (--stdin): the listing is a list of paths read from stdin,
+// such as the output of find or git ls-files, rather than a directory. A
+// reader thread takes the input in blocks of up to STREAM_BLOCK bytes,
+// splits and measures the names, and hands each block over as a batch
+// that is appended to files[] and the front-coded names, so the list is
+// usable at once and grows as the input comes. Keys come from the
+// terminal instead. Entries keep the input order and are classified as
+// they are shown, like in the lazy stat mode.
+enum { STREAM_BLOCK = 1 << 20 };
+
+struct stream_batch
+{
+	struct completion completion;
+	struct file *files;
+	char *names;            // Back to back, each NUL terminated
+	size_t count;
+	size_t skipped;         // Longer than STREAM_PATH_MAX
+	bool end;               // End of the input, or a read error
+};
+
+static int stream_fd = -1;
+static bool stream_reading;
+static size_t stream_skipped;
+static size_t files_capacity;   // Of files[] as it grows
+static size_t stream_bytes;     // Estimated size of the listing, against the memory budget
+
+// Makes a batch of the names in data, each ended by sep. An unended last
+// name is taken too at the end of the input.
+static struct stream_batch *stream_batch_new(const char *data, size_t size, char sep, bool end)
+{
+	size_t count = 0;
+	for (const char *p = data; (p = memchr(p, sep, (size_t)(data + size - p))); ++p)
+		count++;
+	count++;
+
+	struct stream_batch *batch = malloc(sizeof(*batch));
+	struct file *files = malloc(count * sizeof(*files));
+	char *names = malloc(size + 1);
+	if (!batch || !files || !names) {
+		free(batch);
+		free(files);
+		free(names);
+		return NULL;
+	}
+	*batch = (struct stream_batch){ .files = files, .names = names, .end = end };
+
+	char *out = names;
+	for (const char *p = data, *stop = data + size; p < stop; ) {
+		const char *q = memchr(p, sep, (size_t)(stop - p));
+		if (!q)
+			q = stop;
+		size_t len = (size_t)(q - p);
+		if (len > STREAM_PATH_MAX) {
+			batch->skipped++;
+		} else if (len > 0) {
+			memcpy(out, p, len);
+			out[len] = '\0';
+			bool ascii = utf8_is_ascii(out, len);
+			size_t cols = ascii ? len : utf8_width(out, len);
+			files[batch->count++] = (struct file){
+				.length = (uint16_t)len,
+				.type = DT_UNKNOWN,
+				.ascii = ascii,
+				.unresolved = true,
+				.cols = (uint16_t)(cols < UINT16_MAX ? cols : UINT16_MAX),
+				.color = LsColor_fi,
+			};
+			out += len + 1;
+		}
+		p = q + 1;
+	}
+	return batch;
+}
+
+static void stream_done(void *arg);
+
+static void stream_post(struct stream_batch *batch)
+{
+	batch->completion = (struct completion){ .fn = stream_done, .arg = batch };
+	post_completion(&batch->completion);
+}
+
+static void *stream_reader(void *arg)
+{
+	(void)arg;
+	char sep = null_output ? '\0' : '\n';
+	char *buf = malloc(STREAM_BLOCK);
+	size_t used = 0;
+	bool skipping = false;  // In the rest of a name too long to keep
+
+	for (bool end = !buf; !end; ) {
+		// Fill the block with what is there, but hand over as soon as the
+		// producer pauses
+		ssize_t n;
+		for (;;) {
+			n = read(stream_fd, buf + used, STREAM_BLOCK - used);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				break;
+			used += (size_t)n;
+			struct pollfd more = { .fd = stream_fd, .events = POLLIN };
+			if (used == STREAM_BLOCK || poll(&more, 1, 0) <= 0)
+				break;
+		}
+		end = n <= 0;
+
+		size_t from = 0;
+		size_t skipped = 0;
+		if (skipping) {
+			const char *q = memchr(buf, sep, used);
+			if (q || end) {
+				from = q ? (size_t)(q - buf) + 1 : used;
+				skipping = false;
+				skipped++;
+			} else {
+				used = 0;
+				continue;
+			}
+		}
+		// Names not ended yet wait for the next block
+		size_t stop = used;
+		if (!end) {
+			while (stop > from && buf[stop - 1] != sep)
+				stop--;
+		}
+
+		struct stream_batch *batch = stream_batch_new(buf + from, stop - from, sep, end);
+		if (batch) {
+			batch->skipped += skipped;
+			stream_post(batch);
+		} else if (end) {
+			// Still say the input is over
+			static struct stream_batch last = { .end = true };
+			stream_post(&last);
+		}
+
+		memmove(buf, buf + stop, used - stop);
+		used -= stop;
+		if (used > STREAM_PATH_MAX) {
+			skipping = true;
+			used = 0;
+		}
+	}
+	free(buf);
+	close(stream_fd);
+	return NULL;
+}
+
+static bool stream_start(void)
+{
+	// A larger pipe lets the producer run ahead while a block is appended
+	fcntl(stream_fd, F_SETPIPE_SZ, STREAM_BLOCK);
+
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, stream_reader, NULL) != 0)
+		return false;
+	pthread_detach(thread);
+	stream_reading = true;
+	return true;
+}
+
+static const char *long_name_find(size_t i)
+{
+	size_t lo = 0, hi = long_names_size;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (long_names[mid].idx < i)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo < long_names_size && long_names[lo].idx == i ? long_names[lo].name : "";
+}
+
+static bool long_name_add(size_t i, const char *name, size_t len)
+{
+	if (long_names_size == long_names_capacity) {
+		size_t capacity = long_names_capacity ? long_names_capacity * 2 : 64;
+		struct long_name *grown = realloc(long_names, capacity * sizeof(*grown));
+		if (!grown)
+			return false;
+		long_names = grown;
+		long_names_capacity = capacity;
+	}
+	char *copy = malloc(len + 1);
+	if (!copy)
+		return false;
+	memcpy(copy, name, len + 1);
+	long_names[long_names_size++] = (struct long_name){ .idx = i, .name = copy };
+	return true;
+}
+
+// Runs on the main thread with a batch read
+static void stream_done(void *arg)
+{
+	struct stream_batch *batch = arg;
+	stream_skipped += batch->skipped;
+	if (batch->end)
+		stream_reading = false;
+
+	// New entries are matched against the query in effect
+	sync_filter();
+
+	// Marks are a bit per entry
+	size_t words = (files_size + batch->count) / 64 + 1;
+	if (marks && words > files_size / 64 + 1) {
+		uint64_t *grown = realloc(marks, words * sizeof(*marks));
+		if (grown) {
+			memset(grown + files_size / 64 + 1, 0, (words - files_size / 64 - 1) * sizeof(*grown));
+			marks = grown;
+		} else {
+			listing_truncated = true;
+		}
+	}
+
+	size_t first = files_size;
+	const char *name = batch->names;
+	for (size_t k = 0; k < batch->count && !listing_truncated; ++k) {
+		size_t len = batch->files[k].length;
+		stream_bytes += sizeof(struct file) + sizeof(struct filtered_file) + len + 2;
+		if (files_size == files_capacity) {
+			size_t capacity = files_capacity ? files_capacity * 2 : 4096;
+			struct file *grown = stream_bytes <= memory_budget ? realloc(files, capacity * sizeof(*grown)) : NULL;
+			if (grown) {
+				files = grown;
+				files_capacity = capacity;
+			}
+		}
+		if (stream_bytes > memory_budget || files_size == files_capacity
+			|| (len > FRONT_MAX && !long_name_add(files_size, name, len))
+			|| !front_coded_append(&file_names, len > FRONT_MAX ? "" : name, len > FRONT_MAX ? 0 : len)) {
+			listing_truncated = true;
+			break;
+		}
+		files[files_size++] = batch->files[k];
+		name += len + 1;
+	}
+	if (batch->files) {
+		free(batch->files);
+		free(batch->names);
+		free(batch);
+	}
+
+	if (search_len == 0) {
+		filtered_size = files_size;
+	} else {
+		for (size_t i = first; i < files_size && !filter_truncated; ++i) {
+			uint32_t match_start;
+			if (entry_match(i, &match_start) && !filtered_push((uint32_t)i, match_start))
+				filter_truncated = true;
+		}
+	}
+	request_redraw(REDRAW_FULL);
+}
+
+static void print_view(void);
+static void render(void);
+
+static void clear_screen(void)
+{
+	PUTS_ERR(CLS);
+}
+
+static void clear_screen_and_reset(void)
+{
+	PUTS_ERR(SYNC_END DISABLE_BRACKETED_PASTE HOME CLSB);
+}
+
+// Puts the terminal in the mode the UI expects
+static void enter_ui(void)
+{
+	disable_tty_flags(tty_flags);
+	PUTS_ERR(ENABLE_BRACKETED_PASTE);
+}
+
+// Hands the terminal back, e.g. to an editor or the shell
+static void leave_ui(void)
+{
+	clear_screen();
+	PUTS_ERR(DISABLE_BRACKETED_PASTE);
+	FLUSH_FILE(stderr);
+	reset_tty();
+}
+
+static void print_stats(void)
+{
+	PRINTF_ERR("frames rendered: %zu\n", stats.frames_rendered);
+	PRINTF_ERR("frames skipped: %zu\n", stats.frames_skipped);
+	PRINTF_ERR("frames throttled: %zu\n", stats.frames_throttled);
+}
+
+static void draw_row(size_t i, size_t j);
+
+static inline bool preview_visible(void);
+
+// Shifts the list region from old_top to top with a scroll region, drawing only
+// the rows that scroll into view. Returns false if the shift is a page or more.
+static bool scroll_view(size_t old_top)
+{
+	size_t delta = top > old_top ? top - old_top : old_top - top;
+	// The region spans whole lines, so it would drag the preview pane along
+	if (delta >= page_size || preview_visible() || grid_cols > 1 || status_shown)
+		return false;
+
+	PRINTF_ERR(SYNC_BEGIN DECSTBM(3, %zu) CUP(3, 1), page_size + 2);
+	if (top > old_top) {
+		PRINTF_ERR(DL(%zu), delta);
+		for (size_t j = page_size - delta; j < page_size; ++j) {
+			PRINTF_ERR(CUP(%zu, 1), j + 3);
+			draw_row(top + j, j);
+		}
+	} else {
+		PRINTF_ERR(IL(%zu), delta);
+		for (size_t j = 0; j < delta; ++j) {
+			PRINTF_ERR(CUP(%zu, 1), j + 3);
+			draw_row(top + j, j);
+		}
+	}
+	PUTS_ERR(DECSTBM_RESET);
+
+	if ((top > 0) != (old_top > 0))
+		PUTS_ERR(top > 0 ? CUP(2, 1) "↑" : CUP(2, 1) EL(0));
+	bool more = top + page_size < filtered_size;
+	if (more != (old_top + page_size < filtered_size))
+		PRINTF_ERR(more ? CUP(%zu, 1) "↓" : CUP(%zu, 1) EL(0), page_size + 3);
+	PUTS_ERR(SYNC_END);
+
+	// The old marker moved with the rows, or scrolled out of view
+	if (top > old_top)
+		prev_cursor = prev_cursor >= delta ? prev_cursor - delta : SIZE_MAX;
+	else
+		prev_cursor = prev_cursor + delta < page_size ? prev_cursor + delta : SIZE_MAX;
+	drawn_top = top;
+	return true;
+}
+
+// Sets top and cursor so that idx is visible: the page containing idx, or in
+// continuous-scroll mode the smallest shift of the current view. The grid
+// always moves by page.
+static void scroll_to_idx(void)
+{
+	if (continuous_scroll && grid_cols == 1) {
+		if (top + page_size > filtered_size)
+			top = filtered_size > page_size ? filtered_size - page_size : 0;
+		if (idx < top)
+			top = idx;
+		else if (idx >= top + page_size)
+			top = idx - page_size + 1;
+	} else {
+		top = idx - idx % page_entries;
+	}
+	cursor = idx - top;
+}
+
+static void show_idx(void)
+{
+	scroll_to_idx();
+	request_redraw(REDRAW_SELECTION);
+}
+
+static void move_to_previous(void)
+{
+	if (filtered_size == 0)
+		return;
+
+	idx = idx == 0 ? filtered_size - 1 : idx - 1;
+	show_idx();
+}
+
+static void move_to_next(void)
+{
+	if (filtered_size == 0)
+		return;
+
+	idx = idx == filtered_size - 1 ? 0 : idx + 1;
+	show_idx();
+}
+
+static void move_to_first(void)
+{
+	if (filtered_size == 0)
+		return;
+
+	idx = 0;
+	show_idx();
+}
+
+static void move_to_last(void)
+{
+	if (filtered_size == 0)
+		return;
+
+	idx = filtered_size - 1;
+	show_idx();
+}
+
+static void move_page_up(void)
+{
+	if (filtered_size == 0)
+		return;
+
+	if (idx == top) {
+		if (top == 0)
+			return;
+		idx = top > page_entries ? top - page_entries : 0;
+	} else {
+		idx = top;
+	}
+	show_idx();
+}
+
+static void move_page_down(void)
+{
+	if (filtered_size == 0)
+		return;
+
+	size_t last = filtered_size - 1;
+	size_t bottom = top + page_entries - 1 < last ? top + page_entries - 1 : last;
+
+	if (idx == bottom) {
+		if (bottom == last)
+			return;
+		idx = bottom + page_entries < last ? bottom + page_entries : last;
+	} else {
+		idx = bottom;
+	}
+	show_idx();
+}
+
+// Moves to the same row of the previous or next grid column
+static void move_column(bool forward)
+{
+	if (filtered_size == 0 || grid_cols == 1)
+		return;
+
+	if (!forward) {
+		if (idx < grid_rows)
+			return;
+		idx -= grid_rows;
+	} else if (idx + grid_rows < filtered_size) {
+		idx += grid_rows;
+	} else if (idx - idx % grid_rows + grid_rows < filtered_size) {
+		idx = filtered_size - 1;  // The next column is shorter
+	} else {
+		return;
+	}
+	show_idx();
+}
+
+static void clear_search(void)
+{
+	char selection[STREAM_PATH_MAX + 1] = "";
+
+	sync_filter();
+
+	if (filtered_size > 0)
+		snprintf(selection, sizeof(selection), "%s", entry_name(view_idx(idx)));
+
+	search_query[0] = '\0';
+	search_len = search_cursor = 0;
+	search_open = false;
+	prev_search_len = 0;  // Reset incremental filter state
+	apply_filter();
+
+	size_t found = selection[0] ? view_find(selection) : SIZE_MAX;
+	if (found != SIZE_MAX) {
+		idx = found;
+		scroll_to_idx();
+	}
+}
+
+// Length of the code point after the search cursor
+static size_t search_next_len(void)
+{
+	if (search_cursor >= search_len)
+		return 0;
+	uint32_t cp;
+	return utf8_decode(search_query + search_cursor, search_len - search_cursor, &cp);
+}
+
+static void search_delete_char_back(void)
+{
+	size_t n = utf8_prev_len(search_query, search_cursor);
+	if (n > 0) {
+		memmove(search_query + search_cursor - n, search_query + search_cursor, search_len - search_cursor + 1);
+		search_cursor -= n;
+		search_len -= n;
+	}
+}
+
+static void search_delete_char_forward(void)
+{
+	size_t n = search_next_len();
+	if (n > 0) {
+		memmove(search_query + search_cursor, search_query + search_cursor + n, search_len - search_cursor - n + 1);
+		search_len -= n;
+	}
+}
+
+// Non-ASCII bytes count as word characters so words never split a code point
+static inline bool is_word_char(char c)
+{
+	return isalnum((unsigned char)c) || c == '_' || (unsigned char)c >= 0x80;
+}
+
+static void search_delete_word_back(void)
+{
+	if (search_cursor > 0) {
+		size_t end = search_cursor;
+		bool word = is_word_char(search_query[search_cursor - 1]);
+		while (search_cursor > 0 && is_word_char(search_query[search_cursor - 1]) == word)
+			search_cursor--;
+		memmove(search_query + search_cursor, search_query + end, search_len - end + 1);
+		search_len -= (end - search_cursor);
+	}
+}
+
+static void search_delete_word_forward(void)
+{
+	if (search_cursor < search_len) {
+		size_t start = search_cursor;
+		bool word = is_word_char(search_query[search_cursor]);
+		while (search_cursor < search_len && is_word_char(search_query[search_cursor]) == word)
+			search_cursor++;
+		memmove(search_query + start, search_query + search_cursor, search_len - search_cursor + 1);
+		search_len -= (search_cursor - start);
+		search_cursor = start;
+	}
+}
+
+static void search_delete_to_start(void)
+{
+	if (search_cursor > 0) {
+		memmove(search_query, search_query + search_cursor, search_len - search_cursor + 1);
+		search_len -= search_cursor;
+		search_cursor = 0;
+	}
+}
+
+static void search_insert_bytes(const char *bytes, size_t n)
+{
+	if (search_len + n < sizeof(search_query)) {
+		memmove(search_query + search_cursor + n, search_query + search_cursor, search_len - search_cursor + 1);
+		memcpy(search_query + search_cursor, bytes, n);
+		search_cursor += n;
+		search_len += n;
+	}
+}
+
+// Typed bytes of a multibyte character, inserted once it is complete
+static char search_pending[4];
+static size_t search_pending_len;
+
+static void search_insert_char(int ch)
+{
+	if (ch >= 32 && ch < 127) {
+		search_pending_len = 0;
+		char c = (char)ch;
+		search_insert_bytes(&c, 1);
+		return;
+	}
+	if (ch < 0x80 || ch > 0xff) {
+		search_pending_len = 0;
+		return;
+	}
+
+	if (ch >= 0xc0)
+		search_pending_len = 0;  // A lead byte starts a new character
+	else if (search_pending_len == 0)
+		return;                  // Stray continuation byte
+	search_pending[search_pending_len++] = (char)ch;
+
+	unsigned char lead = (unsigned char)search_pending[0];
+	size_t need = lead < 0xe0 ? 2 : lead < 0xf0 ? 3 : 4;
+	if (search_pending_len < need)
+		return;
+
+	uint32_t cp;
+	if (utf8_decode(search_pending, need, &cp) == need)
+		search_insert_bytes(search_pending, need);
+	search_pending_len = 0;
+}
+
+// Inserts pasted text as one edit; invalid UTF-8 and control characters
+// such as newlines are dropped
+static void search_insert_text(const char *text, size_t len)
+{
+	for (size_t i = 0; i < len; ) {
+		uint32_t cp;
+		size_t n = utf8_decode(text + i, len - i, &cp);
+		bool valid = !(cp == UTF8_REPLACEMENT && n == 1);
+		if (valid && cp >= 32 && cp != 127 && !(cp >= 0x80 && cp < 0xa0))
+			search_insert_bytes(text + i, n);
+		i += n;
+	}
+	search_pending_len = 0;
+}
+
+static void search_move_word_back(void)
+{
+	if (search_cursor > 0) {
+		bool word = is_word_char(search_query[search_cursor - 1]);
+		while (search_cursor > 0 && is_word_char(search_query[search_cursor - 1]) == word)
+			search_cursor--;
+	}
+}
+
+static void search_move_word_forward(void)
+{
+	if (search_cursor < search_len) {
+		bool word = is_word_char(search_query[search_cursor]);
+		while (search_cursor < search_len && is_word_char(search_query[search_cursor]) == word)
+			search_cursor++;
+	}
+}
+
+static void delete_selected(void)
+{
+	if ((filtered_size == 0 && marks_count == 0) || stream_mode)
+		return;
+
+	confirm_delete = true;
+	request_redraw(REDRAW_FULL);
+}
+
+// Sets the mark of entry i. Returns false if out of memory.
+static bool set_mark(size_t i, bool on)
+{
+	if (!marks && !(marks = bit_set_new(files_size)))
+		return false;
+	if (bit_test(marks, i) != on) {
+		bit_assign(marks, i, on);
+		marks_count += on ? 1 : (size_t)-1;
+	}
+	return true;
+}
+
+// Toggles the mark of the entry under the cursor and moves to the next
+static void toggle_mark(void)
+{
+	if (filtered_size == 0)
+		return;
+	if (!set_mark(view_idx(idx), !is_marked(view_idx(idx))))
+		return;
+	if (idx + 1 < filtered_size)
+		idx++;
+	scroll_to_idx();
+	request_redraw(REDRAW_FULL);
+}
+
+// Marks every entry shown, that is every match of the search, or with
+// invert flips their marks
+static void mark_shown(bool invert)
+{
+	for (size_t k = 0; k < filtered_size; ++k) {
+		size_t i = view_idx(k);
+		if (!set_mark(i, invert ? !is_marked(i) : true))
+			break;
+	}
+	request_redraw(REDRAW_FULL);
+}
+
+static void unmark_all(void)
+{
+	marks_clear();
+	request_redraw(REDRAW_FULL);
+}
+
+// Prints the path of entry i to stdout, after the paths printed before
+static void print_path(size_t i)
+{
+	static bool printed;
+	if (printed && !null_output)
+		PUTC('\n');
+	printed = true;
+	// Paths read from stdin are given back as they were
+	if (!stream_mode) {
+		PUTS(cwd);
+		if (strcmp(cwd, "/") != 0)
+			PUTC('/');
+	}
+	WRITE(entry_name(i), entry_length(i));
+	if (null_output)
+		PUTC('\0');
+}
+
+// Filesystem work that can hang on a dead mount (opening, reading and
+// deleting in directories) runs as a task on a thread of its own, so the
+// main loop only ever waits on its fds. Only the newest task counts: a
+// newer one supersedes it, and whatever a superseded task returns later
+// is thrown away. A task still running after FS_DEADLINE_MS is reported
+// as not responding. Its thread may stay blocked in the kernel for good,
+// which is why every task gets a fresh one.
+enum {
+	FS_BUSY_MS = 250,        // Say "Loading…" after this
+	FS_DEADLINE_MS = 2000,   // Say the filesystem is not responding after this
+};
+
+struct fs_task
+{
+	struct completion completion;
+	void (*run)(struct fs_task *task);                  // On the task's thread
+	void (*done)(struct fs_task *task, bool current);   // On the main thread; frees the task
+	uint64_t id;
+};
+
+static uint64_t fs_task_id;         // Id of the newest task
+static uint64_t fs_task_started;    // When the newest task started, 0 once it finished
+
+static enum fs_status fs_status(void)
+{
+	if (fs_task_started == 0)
+		return FS_IDLE;
+	uint64_t elapsed = now_ms() - fs_task_started;
+	if (elapsed >= FS_DEADLINE_MS)
+		return FS_NOT_RESPONDING;
+	return elapsed >= FS_BUSY_MS ? FS_LOADING : FS_IDLE;
+}
+
+// Returns ms until the status of the outstanding task changes, or -1
+static int fs_status_delay(void)
+{
+	if (fs_task_started == 0)
+		return -1;
+	uint64_t elapsed = now_ms() - fs_task_started;
+	if (elapsed < FS_BUSY_MS)
+		return (int)(FS_BUSY_MS - elapsed);
+	if (elapsed < FS_DEADLINE_MS)
+		return (int)(FS_DEADLINE_MS - elapsed);
+	return -1;
+}
+
+static void fs_task_complete(void *arg)
+{
+	struct fs_task *task = arg;
+	bool current = task->id == fs_task_id;
+	if (current) {
+		fs_task_started = 0;
+		if (fs_status_shown != FS_IDLE)
+			request_redraw(REDRAW_FULL);
+	}
+	task->done(task, current);
+}
+
+static void *fs_task_thread(void *arg)
+{
+	struct fs_task *task = arg;
+	task->run(task);
+	task->completion = (struct completion){ .fn = fs_task_complete, .arg = task };
+	post_completion(&task->completion);
+	return NULL;
+}
+
+// Starts task, superseding the outstanding one if any
+static void fs_submit(struct fs_task *task)
+{
+	task->id = ++fs_task_id;
+	fs_task_started = 0;
+
+	// The thread inherits the blocked signal mask, so signals stay on the signalfd
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, fs_task_thread, task) != 0) {
+		task->done(task, false);
+		return;
+	}
+	pthread_detach(thread);
+	fs_task_started = now_ms();
+}
+
+// Recursive delete, copy, move and disk usage, on a pool of background
+// workers so that the UI stays live. Every directory is a node: for a delete, a worker
+// reads it, unlinks what is not a directory and queues the subdirectories
+// as nodes of their own. The worker that finishes the last entry of a
+// directory removes it, and so on up to the entry being deleted. A copy
+// creates the directory first and queues every entry, so the files of one
+// directory are copied in parallel. Measuring adds up the sizes of the
+// entries of a directory and queues its subdirectories, whose totals are
+// added in as they finish. The queue is a stack, so workers go deep before
+// wide and few directories are held open at a time.
+enum {
+	JOB_WORKERS_MAX = 8,
+	JOB_PROGRESS_MS = 250,      // Progress redraw interval
+	COPY_CHUNK = 16 << 20,      // Copied between checks for cancellation
+	COPY_BUFFER = 1 << 17,      // When the data has to pass through userspace
+};
+
+enum job_kind { JOB_DELETE, JOB_COPY, JOB_MOVE, JOB_SIZE };
+
+struct file_job
+{
+	struct completion completion;
+	struct file_job *next;      // In file_jobs
+	enum job_kind kind;
+	int dir_fd;                 // Owned; the directory the entry is in
+	dev_t dev;                  // Of that directory
+	ino_t ino;
+	int dest_fd;                // Owned; where a copy or move goes, else -1
+	dev_t dest_dev;
+	ino_t dest_ino;
+	dev_t copy_dev;             // The directory copied to, once created: not copied into itself
+	ino_t copy_ino;
+	uint64_t started;
+	atomic_size_t done;         // Entries removed or copied, directories measured
+	atomic_ullong bytes;        // Copied or measured
+	size_t entries;             // Measuring: entries of the listing to measure
+	atomic_size_t roots;        // Measuring: of those, the ones not done yet
+	bool use_cache;             // Measuring: take directory sizes from size_cache
+	pthread_mutex_t links_lock;
+	struct inode_map links;     // Measuring: files with several links, counted once
+	atomic_bool cancelled;
+	bool removing;              // A move across filesystems, copied: the original is being deleted
+	bool failed;                // Something is left; set by the worker that completes the job
+	bool trash;                 // Move to the trash rather than delete, if possible
+	bool trashed;               // Results: moved to trash_fd as trash_name
+	int trash_fd;
+	char trash_name[NAME_MAX + 1];
+	bool in_place;              // A copy into the directory of the entry itself
+	char copy_name[NAME_MAX + 1]; // Then: the name found for the copy, "name (copy)" or "name (copy N)"
+	char name[];
+};
+
+// Loading a directory: entering one, going up, or reloading after a delete
+enum load_kind { LOAD_ENTER, LOAD_PARENT, LOAD_RELOAD };
+
+struct load_task
+{
+	struct fs_task task;
+	enum load_kind kind;
+	int base_fd;            // Owned; what path is relative to, or AT_FDCWD
+	size_t restore_idx;     // Entry to select once loaded: the one we came from
+	char *cwd;              // Path to show for the directory
+	struct file_job *restore; // LOAD_RELOAD: trashed entry to move back first, or NULL
+	int restore_error;      // Results: errno of the move back, 0 if done
+	int fd;                 // Results: the directory and its entries
+	struct stat stat;
+	struct listing listing;
+	int error;
+	char path[];
+};
+
+// The directories above the shown one, held open with the entry that was
+// selected in each, so that going up neither walks a path nor depends on
+// the name still resolving. Deeper than NAV_DEPTH, the oldest are closed
+// and going up past them opens the parent by path.
+enum { NAV_DEPTH = 64 };
+
+static struct {
+	int fd;
+	size_t idx;
+} nav_stack[NAV_DEPTH];
+static size_t nav_depth;
+
+// While going up is pending: how many levels, and the path of the target.
+// Going up again starts from there, not from a directory that may hang.
+static size_t pending_up;
+static const char *pending_parent;  // The cwd of the newest task
+
+static void load_task_run(struct fs_task *task)
+{
+	struct load_task *load = (struct load_task *)task;
+	// A failed restore still reloads
+	if (load->restore) {
+		const struct file_job *job = load->restore;
+		if (renameat2(job->trash_fd, job->trash_name, job->dir_fd, job->name, RENAME_NOREPLACE) != 0)
+			load->restore_error = errno;
+	}
+
+	load->fd = openat(load->base_fd, load->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (load->fd < 0 || fstat(load->fd, &load->stat) != 0) {
+		load->error = errno;
+		return;
+	}
+	load->error = load_listing(load->fd, &load->listing);
+}
+
+static void file_job_free(struct file_job *job);
+
+static void load_task_free(struct load_task *load)
+{
+	if (load->base_fd >= 0)
+		close(load->base_fd);
+	if (load->fd >= 0)
+		close(load->fd);
+	listing_free(&load->listing);
+	if (load->restore)
+		file_job_free(load->restore);
+	free(load->cwd);
+	free(load);
+}
+
+static void pending_up_clear(void)
+{
+	pending_up = 0;
+	pending_parent = NULL;
+}
+
+static void nav_push(int fd, size_t restore_idx)
+{
+	if (nav_depth == NAV_DEPTH) {
+		close(nav_stack[0].fd);
+		memmove(nav_stack, nav_stack + 1, (NAV_DEPTH - 1) * sizeof(*nav_stack));
+		nav_depth--;
+	}
+	nav_stack[nav_depth].fd = fd;
+	nav_stack[nav_depth].idx = restore_idx;
+	nav_depth++;
+}
+
+static void hide_deleting(void);
+
+static void restore_failed(const struct file_job *job, int error)
+{
+	// The purger removes entries a minute old, and U may come later
+	const char *reason = error == ENOENT ? "purged from the trash already"
+		: error == EEXIST ? "the name is taken" : strerror(error);
+	snprintf(restore_error, sizeof(restore_error), "  Cannot restore '%s': %s", job->name, reason);
+	request_redraw(REDRAW_FULL);
+}
+
+static void load_task_done(struct fs_task *task, bool current)
+{
+	struct load_task *load = (struct load_task *)task;
+	if (load->restore_error)
+		restore_failed(load->restore, load->restore_error);
+	if (current && load->kind == LOAD_PARENT) {
+		if (!load->error) {
+			for (size_t i = 0; i < pending_up && nav_depth > 0; ++i)
+				close(nav_stack[--nav_depth].fd);
+		}
+		pending_up_clear();
+	}
+	if (!current || load->error) {
+		load_task_free(load);
+		return;
+	}
+
+	if (load->kind == LOAD_ENTER)
+		nav_push(dir_fd, load->restore_idx);
+	else
+		close(dir_fd);
+	dir_fd = load->fd;
+	dir_dev = load->stat.st_dev;
+	dir_ino = load->stat.st_ino;
+	load->fd = -1;
+	free(cwd);
+	cwd = load->cwd;
+	load->cwd = NULL;
+
+	switch (load->kind) {
+		case LOAD_ENTER:
+			search_query[0] = '\0';
+			search_len = search_cursor = 0;
+			search_open = false;
+			filter_pending = false;
+			install_listing(&load->listing);
+			hide_deleting();
+			idx = cursor = top = 0;
+			break;
+
+		case LOAD_PARENT:
+			search_query[0] = '\0';
+			search_len = search_cursor = 0;
+			search_open = false;
+			filter_pending = false;
+			install_listing(&load->listing);
+			hide_deleting();
+			idx = load->restore_idx;
+			if (idx >= filtered_size)
+				idx = filtered_size > 0 ? filtered_size - 1 : 0;
+			top = 0;
+			scroll_to_idx();
+			break;
+
+		case LOAD_RELOAD:
+			install_listing(&load->listing);
+			hide_deleting();
+			apply_filter();
+			idx = load->restore_idx;
+			if (idx >= filtered_size)
+				idx = filtered_size > 0 ? filtered_size - 1 : 0;
+			if (load->restore && load->restore->dev == dir_dev && load->restore->ino == dir_ino) {
+				size_t found = view_find(load->restore->name);
+				if (found != SIZE_MAX)
+					idx = found;
+			}
+			scroll_to_idx();
+			break;
+	}
+
+	load_task_free(load);
+	request_redraw(REDRAW_FULL);
+}
+
+// Starts loading path, relative to base_fd (owned) unless it is absolute,
+// to be shown as cwd (owned)
+static struct load_task *load_start(enum load_kind kind, int base_fd, const char *path, char *cwd)
+{
+	size_t len = strlen(path);
+	struct load_task *load = cwd ? calloc(1, sizeof(*load) + len + 1) : NULL;
+	if (!load) {
+		if (base_fd >= 0)
+			close(base_fd);
+		free(cwd);
+		return NULL;
+	}
+	load->task.run = load_task_run;
+	load->task.done = load_task_done;
+	load->kind = kind;
+	load->base_fd = base_fd;
+	load->cwd = cwd;
+	load->fd = -1;
+	memcpy(load->path, path, len + 1);
+	return load;
+}
+
+// Returns dir/name as a new string
+static char *path_join(const char *dir, const char *name)
+{
+	size_t dir_len = strlen(dir), name_len = strlen(name);
+	if (dir_len == 1 && dir[0] == '/')
+		dir_len = 0;
+	char *path = malloc(dir_len + name_len + 2);
+	if (path) {
+		memcpy(path, dir, dir_len);
+		path[dir_len] = '/';
+		memcpy(path + dir_len + 1, name, name_len + 1);
+	}
+	return path;
+}
+
+// Returns the parent of an absolute path as a new string, or NULL at the root
+static char *path_parent(const char *path)
+{
+	const char *slash = strrchr(path, '/');
+	if (!slash || path[1] == '\0')
+		return NULL;
+	size_t len = slash == path ? 1 : (size_t)(slash - path);
+	return strndup(path, len);
+}
+
+// Loads the shown directory again, then selects restore_idx. A trashed
+// entry to restore (owned), if any, is moved back first.
+static void reload_directory(size_t restore_idx, struct file_job *restore)
+{
+	int base_fd = fcntl(dir_fd, F_DUPFD_CLOEXEC, 0);
+	struct load_task *load = base_fd >= 0 ? load_start(LOAD_RELOAD, base_fd, ".", strdup(cwd)) : NULL;
+	if (!load) {
+		if (restore) {
+			restore_failed(restore, errno);
+			file_job_free(restore);
+		}
+		return;
+	}
+	load->restore_idx = restore_idx;
+	load->restore = restore;
+	pending_up_clear();
+	fs_submit(&load->task);
+}
+
+struct job_node
+{
+	struct job_node *next;      // In the queue
+	struct job_node *parent;    // NULL for the entry of the job
+	struct file_job *job;
+	int fd;                     // A directory once read, until removed
+	int dest_fd;                // Copying: the directory created for it
+	mode_t mode;                // Copying: what to give it once filled
+	struct timespec times[2];   // Copying: to give it; measuring: mtime keys the size cache
+	dev_t dev;                  // Measuring: of a directory
+	ino_t ino;
+	atomic_ullong size;         // Measuring: of what it holds, so far
+	atomic_size_t pending;      // Subdirectories left, plus one until read
+	atomic_bool failed;         // Something in it is left
+	atomic_bool shared;         // Measuring: a link in it was counted elsewhere first
+	char name[];
+};
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	struct job_node *head;
+	size_t workers;
+} job_queue = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.wake = PTHREAD_COND_INITIALIZER,
+};
+
+static struct file_job *file_jobs;     // In progress
+static uint64_t jobs_drawn;            // When their progress was last drawn
+
+static struct job_node *job_node_new(struct file_job *job, struct job_node *parent, const char *name)
+{
+	size_t len = strlen(name);
+	struct job_node *node = malloc(sizeof(*node) + len + 1);
+	if (!node)
+		return NULL;
+	node->next = NULL;
+	node->parent = parent;
+	node->job = job;
+	node->fd = -1;
+	node->dest_fd = -1;
+	node->dev = 0;
+	node->ino = 0;
+	atomic_init(&node->size, 0);
+	atomic_init(&node->pending, 1);
+	atomic_init(&node->failed, false);
+	atomic_init(&node->shared, false);
+	memcpy(node->name, name, len + 1);
+	return node;
+}
+
+static void file_job_free(struct file_job *job)
+{
+	close(job->dir_fd);
+	if (job->dest_fd >= 0)
+		close(job->dest_fd);
+	if (job->trash_fd >= 0)
+		close(job->trash_fd);
+	inode_map_free(&job->links);
+	pthread_mutex_destroy(&job->links_lock);
+	free(job);
+}
+
+static void job_push(struct job_node *node)
+{
+	pthread_mutex_lock(&job_queue.lock);
+	node->next = job_queue.head;
+	job_queue.head = node;
+	pthread_cond_signal(&job_queue.wake);
+	pthread_mutex_unlock(&job_queue.lock);
+}
+
+// Trash (-T): D moves the entry into a trash directory on the same
+// filesystem, one atomic rename however big the tree, and a detached
+// purger process deletes it from there at idle priority once it has been
+// there TRASH_GRACE_S. Until then, U moves it back. The trash is
+// explorer-trash in $XDG_DATA_HOME if that is on the same filesystem, and
+// .explorer-trash-<uid> at the top of the filesystem otherwise.
+enum {
+	TRASH_GRACE_S = 60,
+	TRASH_UNDO_MAX = 32,    // Entries U can restore
+};
+
+static bool trash_enabled;
+static atomic_uint trash_counter;
+static struct file_job *trashed;  // Newest first, for U
+static size_t trashed_size;
+
+// Opens dir_fd/name as the trash, creating it. It must be ours and private.
+static int trash_open_at(int dir_fd, const char *name, dev_t dev)
+{
+	if (mkdirat(dir_fd, name, 0700) != 0 && errno != EEXIST)
+		return -1;
+	int fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	struct stat st;
+	if (fd >= 0 && (fstat(fd, &st) != 0 || st.st_dev != dev || st.st_uid != getuid() || (st.st_mode & 077))) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// Returns the trash for entries of dir_fd, a directory on dev, or -1
+static int trash_open(int dir_fd, dev_t dev)
+{
+	char path[PATH_MAX];
+	const char *data = getenv("XDG_DATA_HOME");
+	int n = data && *data ? snprintf(path, sizeof(path), "%s", data)
+		: home_dir ? snprintf(path, sizeof(path), "%s/.local/share", home_dir) : -1;
+	int data_fd = n > 0 && (size_t)n < sizeof(path) ? open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC) : -1;
+	struct stat st;
+	if (data_fd >= 0) {
+		int fd = fstat(data_fd, &st) == 0 && st.st_dev == dev ? trash_open_at(data_fd, "explorer-trash", dev) : -1;
+		close(data_fd);
+		if (fd >= 0)
+			return fd;
+	}
+
+	// The top of the filesystem: going up from there leaves it, or stays put at /
+	int top = fcntl(dir_fd, F_DUPFD_CLOEXEC, 0);
+	if (top < 0 || fstat(top, &st) != 0) {
+		if (top >= 0)
+			close(top);
+		return -1;
+	}
+	for (;;) {
+		struct stat parent_st;
+		int parent = openat(top, "..", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (parent < 0 || fstat(parent, &parent_st) != 0 || parent_st.st_dev != dev || parent_st.st_ino == st.st_ino) {
+			if (parent >= 0)
+				close(parent);
+			break;
+		}
+		close(top);
+		top = parent;
+		st = parent_st;
+	}
+	char name[32];
+	snprintf(name, sizeof(name), ".explorer-trash-%u", (unsigned)getuid());
+	int fd = trash_open_at(top, name, dev);
+	close(top);
+	return fd;
+}
+
+// Starts a purger for the trash open as trash_fd. It runs detached, in a
+// session of its own, so it outlives explorer and its terminal.
+static void purge_spawn(int trash_fd)
+{
+	char link[32], path[PATH_MAX];
+	snprintf(link, sizeof(link), "/proc/self/fd/%d", trash_fd);
+	ssize_t len = readlink(link, path, sizeof(path) - 1);
+	if (len <= 0)
+		return;
+	path[len] = '\0';
+
+	// Not even stdout: a shell reading it would wait for the purger
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+	for (int fd = 0; fd < 3; ++fd)
+		posix_spawn_file_actions_addopen(&actions, fd, "/dev/null", O_RDWR, 0);
+	posix_spawnattr_t attr;
+	posix_spawnattr_init(&attr);
+	sigset_t none;
+	sigemptyset(&none);
+	posix_spawnattr_setsigmask(&attr, &none);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSID);
+
+	char *argv[] = { "explorer", "--purge", path, NULL };
+	pid_t pid;
+	if (posix_spawn(&pid, "/proc/self/exe", &actions, &attr, argv, environ) == 0)
+		waitpid(pid, NULL, 0);  // It forks the purger and exits at once
+	posix_spawnattr_destroy(&attr);
+	posix_spawn_file_actions_destroy(&actions);
+}
+
+// Trashes that the deletes in progress moved entries to. Each gets one
+// purger once the last of them is over, rather than one per entry.
+struct purge_pending
+{
+	dev_t dev;
+	ino_t ino;
+	int fd;                 // Owned
+};
+
+static struct purge_pending *purge_pending;
+static size_t purge_pending_size;
+
+static void purge_note(int trash_fd)
+{
+	struct stat st;
+	if (fstat(trash_fd, &st) != 0)
+		return;
+	for (size_t i = 0; i < purge_pending_size; ++i)
+		if (purge_pending[i].dev == st.st_dev && purge_pending[i].ino == st.st_ino)
+			return;
+	struct purge_pending *grown = realloc(purge_pending, (purge_pending_size + 1) * sizeof(*grown));
+	if (!grown)
+		return;
+	purge_pending = grown;
+	int fd = fcntl(trash_fd, F_DUPFD_CLOEXEC, 0);
+	if (fd >= 0)
+		purge_pending[purge_pending_size++] = (struct purge_pending){ .dev = st.st_dev, .ino = st.st_ino, .fd = fd };
+}
+
+static void purge_flush(void)
+{
+	for (size_t i = 0; i < purge_pending_size; ++i) {
+		purge_spawn(purge_pending[i].fd);
+		close(purge_pending[i].fd);
+	}
+	purge_pending_size = 0;
+}
+
+// The purger (explorer --purge TRASH) deletes what has been in the trash
+// for TRASH_GRACE_S, until it is empty. Entries are claimed into .purging
+// before they are deleted, so that U never gets half a tree back. One
+// purger runs per trash: another one finds the trash locked and leaves it
+// to the first.
+enum {
+	PURGE_IOPRIO_WHO_PROCESS = 1,
+	PURGE_IOPRIO_IDLE = 3 << 13,    // IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT
+};
+
+static bool purge_tree(int parent_fd, const char *name)
+{
+	int fd = openat(parent_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0)
+		return (errno == ENOTDIR || errno == ELOOP) && unlinkat(parent_fd, name, 0) == 0;
+
+	DIR *dir = fdopendir(fd);
+	if (!dir) {
+		close(fd);
+		return false;
+	}
+	bool ok = true;
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL) {
+		if (entry->d_name[0] == '.' &&
+			(entry->d_name[1] == '\0' ||
+			 (entry->d_name[1] == '.' && entry->d_name[2] == '\0')))
+			continue;
+		if (entry->d_type == DT_DIR || entry->d_type == DT_UNKNOWN)
+			ok &= purge_tree(dirfd(dir), entry->d_name);
+		else
+			ok &= unlinkat(dirfd(dir), entry->d_name, 0) == 0;
+	}
+	closedir(dir);
+	return ok && unlinkat(parent_fd, name, AT_REMOVEDIR) == 0;
+}
+
+// Purges the trashed entries that are due, and whatever a purger that was
+// killed left claimed. Returns the seconds until the next entry is due, 0
+// if none is left, or -1 on error.
+static long purge_pass(int trash_fd)
+{
+	if (mkdirat(trash_fd, ".purging", 0700) != 0 && errno != EEXIST)
+		return -1;
+	int claim_fd = openat(trash_fd, ".purging", O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	int list_fd = claim_fd >= 0 ? fcntl(claim_fd, F_DUPFD_CLOEXEC, 0) : -1;
+	DIR *dir = list_fd >= 0 ? fdopendir(list_fd) : NULL;
+	if (!dir) {
+		if (list_fd >= 0)
+			close(list_fd);
+		if (claim_fd >= 0)
+			close(claim_fd);
+		return -1;
+	}
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL) {
+		if (entry->d_name[0] != '.')
+			purge_tree(claim_fd, entry->d_name);
+	}
+	closedir(dir);
+
+	long next = 0;
+	list_fd = fcntl(trash_fd, F_DUPFD_CLOEXEC, 0);
+	dir = list_fd >= 0 ? fdopendir(list_fd) : NULL;
+	if (!dir) {
+		if (list_fd >= 0)
+			close(list_fd);
+		close(claim_fd);
+		return -1;
+	}
+	time_t now = time(NULL);
+	while ((entry = readdir(dir)) != NULL) {
+		// Named <time trashed>.<pid>.<n>[-<name>]; anything else is left alone
+		char *end;
+		long long trashed_at = strtoll(entry->d_name, &end, 10);
+		if (end == entry->d_name || *end != '.')
+			continue;
+		long wait = trashed_at + TRASH_GRACE_S - now;
+		if (wait > 0) {
+			if (next == 0 || wait < next)
+				next = wait;
+		} else if (renameat(trash_fd, entry->d_name, claim_fd, entry->d_name) == 0) {
+			purge_tree(claim_fd, entry->d_name);
+		}
+	}
+	closedir(dir);
+	close(claim_fd);
+	return next;
+}
+
+static int purge_main(const char *path)
+{
+	// Explorer waits for this process, not for the purger
+	pid_t pid = fork();
+	if (pid != 0)
+		return pid < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+
+	prctl(PR_SET_NAME, "explorer-purge");  // Rather than "exe"
+	setpriority(PRIO_PROCESS, 0, 19);
+	syscall(SYS_ioprio_set, PURGE_IOPRIO_WHO_PROCESS, 0, PURGE_IOPRIO_IDLE);
+
+	int fd = open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0)
+		return EXIT_FAILURE;
+	for (;;) {
+		if (flock(fd, LOCK_EX | LOCK_NB) != 0)
+			return EXIT_SUCCESS;
+		long wait;
+		while ((wait = purge_pass(fd)) > 0)
+			sleep((unsigned)wait);
+		flock(fd, LOCK_UN);
+		if (wait < 0)
+			return EXIT_FAILURE;
+
+		// A purger started while the lock was held has left; its entries
+		// may have come in after the last pass
+		bool left = false;
+		int list_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+		DIR *dir = list_fd >= 0 ? fdopendir(list_fd) : NULL;
+		if (!dir)
+			return EXIT_FAILURE;
+		struct dirent *entry;
+		while (!left && (entry = readdir(dir)) != NULL)
+			left = entry->d_name[0] != '.';
+		closedir(dir);
+		if (!left)
+			return EXIT_SUCCESS;
+	}
+}
+
+// Moves the entry of job into the trash. Returns false if it cannot be,
+// e.g. for lack of a trash on its filesystem.
+static bool trash_move(struct file_job *job)
+{
+	int fd = trash_open(job->dir_fd, job->dev);
+	if (fd < 0)
+		return false;
+
+	// Named for when it was trashed, which the purger goes by, and what it was
+	long long now = (long long)time(NULL);
+	unsigned n = atomic_fetch_add(&trash_counter, 1);
+	int len = snprintf(job->trash_name, sizeof(job->trash_name), "%lld.%d.%u-%s", now, (int)getpid(), n, job->name);
+	if (len < 0 || (size_t)len >= sizeof(job->trash_name))
+		snprintf(job->trash_name, sizeof(job->trash_name), "%lld.%d.%u", now, (int)getpid(), n);
+	if (renameat2(job->dir_fd, job->name, fd, job->trash_name, RENAME_NOREPLACE) != 0) {
+		close(fd);
+		return false;
+	}
+	job->trash_fd = fd;
+	job->trashed = true;
+	return true;
+}
+
+static void job_done(void *arg);
+
+static mode_t creation_mask;  // The umask, which copies are created with
+
+// Sizes of the directories measured, by (dev, ino), valid while their mtime
+// is the one recorded. Z takes them from here rather than walking again.
+// A change deep inside does not touch the mtime of a directory further up,
+// so z always measures afresh.
+enum { SIZE_CACHE_MAX = 1 << 18 };
+
+static struct {
+	pthread_mutex_t lock;
+	struct inode_map map;
+} size_cache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static bool size_cache_get(dev_t dev, ino_t ino, struct timespec mtime, uint64_t *size)
+{
+	pthread_mutex_lock(&size_cache.lock);
+	const struct inode_entry *entry = inode_map_find(&size_cache.map, dev, ino);
+	bool hit = entry && entry->stamp.tv_sec == mtime.tv_sec && entry->stamp.tv_nsec == mtime.tv_nsec;
+	if (hit)
+		*size = entry->value;
+	pthread_mutex_unlock(&size_cache.lock);
+	return hit;
+}
+
+static void size_cache_put(dev_t dev, ino_t ino, struct timespec mtime, uint64_t size)
+{
+	pthread_mutex_lock(&size_cache.lock);
+	if (size_cache.map.size >= SIZE_CACHE_MAX)
+		inode_map_free(&size_cache.map);  // Start over rather than track what is oldest
+	bool added;
+	struct inode_entry *entry = inode_map_insert(&size_cache.map, dev, ino, &added);
+	if (entry) {
+		entry->stamp = mtime;
+		entry->value = size;
+	}
+	pthread_mutex_unlock(&size_cache.lock);
+}
+
+// The size of an entry of the listing, for the main thread
+struct size_result
+{
+	struct completion completion;
+	dev_t dev;                  // Of the directory it is in
+	ino_t ino;
+	uint64_t size;
+	char name[];
+};
+
+static void size_done(void *arg);
+
+// Adds up the size of a node measured: into its parent, or as the result
+// for an entry of the listing. A directory measured whole is cached, unless
+// a hard link in it was left out for being counted elsewhere: its size on
+// its own is larger. Where that was is not known, so the directories above
+// are not cached either.
+static void size_node_finish(struct job_node *node, bool failed)
+{
+	struct file_job *job = node->job;
+	unsigned long long size = atomic_load(&node->size);
+	bool shared = atomic_load(&node->shared);
+	if (!failed && !shared && node->ino != 0)
+		size_cache_put(node->dev, node->ino, node->times[1], size);
+	if (node->parent) {
+		if (shared)
+			atomic_store(&node->parent->shared, true);
+		atomic_fetch_add(&node->parent->size, size);
+		return;
+	}
+	if (atomic_load(&job->cancelled))
+		return;
+
+	size_t len = strlen(node->name);
+	struct size_result *result = malloc(sizeof(*result) + len + 1);
+	if (!result)
+		return;
+	result->completion = (struct completion){ .fn = size_done, .arg = result };
+	result->dev = job->dev;
+	result->ino = job->ino;
+	result->size = size;
+	memcpy(result->name, node->name, len + 1);
+	post_completion(&result->completion);
+}
+
+// Drops a reference to node. The last one removes it if it is a directory
+// left empty, gives a copied directory its permissions, or adds up a size,
+// and drops the reference it held on its parent. A move across filesystems goes on with
+// deleting the original once it is copied.
+static void job_node_release(struct job_node *node)
+{
+	while (node && atomic_fetch_sub(&node->pending, 1) == 1) {
+		struct job_node *parent = node->parent;
+		struct file_job *job = node->job;
+		bool failed = atomic_load(&node->failed);
+		bool deleting = job->kind == JOB_DELETE || job->removing;
+		bool copying = job->kind == JOB_COPY || (job->kind == JOB_MOVE && !job->removing);
+		bool dir_copied = node->dest_fd >= 0;
+		if (node->dest_fd >= 0) {
+			fchmod(node->dest_fd, job->kind == JOB_MOVE ? node->mode : node->mode & ~creation_mask);
+			if (job->kind == JOB_MOVE)
+				futimens(node->dest_fd, node->times);
+			close(node->dest_fd);
+			if (!failed)
+				atomic_fetch_add(&job->done, 1);
+		}
+		if (node->fd >= 0) {
+			close(node->fd);
+			if (deleting) {
+				if (!failed && unlinkat(parent ? parent->fd : job->dir_fd, node->name, AT_REMOVEDIR) == 0)
+					atomic_fetch_add(&job->done, 1);
+				else
+					failed = true;
+			}
+		}
+
+		if (job->kind == JOB_SIZE)
+			size_node_finish(node, failed);
+
+		if (parent) {
+			if (failed)
+				atomic_store(&parent->failed, true);
+		} else if (job->kind == JOB_MOVE && copying && dir_copied && !failed) {
+			// Copied across filesystems: the same node deletes the original
+			job->removing = true;
+			node->fd = node->dest_fd = -1;
+			atomic_store(&node->pending, 1);
+			job_push(node);
+			return;
+		} else if (job->kind != JOB_SIZE || atomic_fetch_sub(&job->roots, 1) == 1) {
+			// The last entry of the job
+			job->failed = failed;
+			job->completion = (struct completion){ .fn = job_done, .arg = job };
+			post_completion(&job->completion);
+		}
+		free(node);
+		node = parent;
+	}
+}
+
+// Unlinks the entry of a node that is not a directory, or the entries of
+// one that is, queueing its subdirectories
+static void delete_node_run(struct job_node *node)
+{
+	struct file_job *job = node->job;
+	int parent_fd = node->parent ? node->parent->fd : node->job->dir_fd;
+	if (atomic_load(&job->cancelled)) {
+		atomic_store(&node->failed, true);
+		job_node_release(node);
+		return;
+	}
+	if (!node->parent && job->trash && trash_move(job)) {
+		job_node_release(node);
+		return;
+	}
+
+	int fd = openat(parent_fd, node->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0) {
+		// ELOOP is a symlink, which goes rather than what it points to
+		if ((errno == ENOTDIR || errno == ELOOP) && unlinkat(parent_fd, node->name, 0) == 0)
+			atomic_fetch_add(&job->done, 1);
+		else
+			atomic_store(&node->failed, true);
+		job_node_release(node);
+		return;
+	}
+	node->fd = fd;
+
+	int list_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	DIR *dir = list_fd >= 0 ? fdopendir(list_fd) : NULL;
+	if (!dir) {
+		if (list_fd >= 0)
+			close(list_fd);
+		atomic_store(&node->failed, true);
+		job_node_release(node);
+		return;
+	}
+
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL) {
+		if (entry->d_name[0] == '.' &&
+			(entry->d_name[1] == '\0' ||
+			 (entry->d_name[1] == '.' && entry->d_name[2] == '\0')))
+			continue;
+
+		if (atomic_load(&job->cancelled)) {
+			atomic_store(&node->failed, true);
+			break;
+		}
+		if (entry->d_type != DT_DIR && entry->d_type != DT_UNKNOWN) {
+			if (unlinkat(fd, entry->d_name, 0) == 0)
+				atomic_fetch_add(&job->done, 1);
+			else
+				atomic_store(&node->failed, true);
+			continue;
+		}
+
+		struct job_node *child = job_node_new(job, node, entry->d_name);
+		if (!child) {
+			atomic_store(&node->failed, true);
+			continue;
+		}
+		atomic_fetch_add(&node->pending, 1);
+		job_push(child);
+	}
+	closedir(dir);
+	job_node_release(node);
+}
+
+// Copies the data of in to out: by sharing extents where the filesystem
+// can clone them, else within the kernel, else through a buffer when the
+// kernel cannot copy between the two filesystems
+static bool copy_data(struct file_job *job, int in, int out, off_t size)
+{
+	if (ioctl(out, FICLONE, in) == 0) {
+		atomic_fetch_add(&job->bytes, (unsigned long long)size);
+		return true;
+	}
+
+	bool in_kernel = true;
+	bool copied = false;
+	char *buf = NULL;
+	for (;;) {
+		if (atomic_load(&job->cancelled))
+			break;
+		ssize_t n;
+		if (in_kernel) {
+			n = copy_file_range(in, NULL, out, NULL, COPY_CHUNK, 0);
+			if (n < 0 && !copied && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)) {
+				in_kernel = false;
+				continue;
+			}
+		} else {
+			if (!buf && !(buf = malloc(COPY_BUFFER)))
+				break;
+			n = read(in, buf, COPY_BUFFER);
+			for (ssize_t written = 0, w; n > 0 && written < n; written += w) {
+				w = write(out, buf + written, (size_t)(n - written));
+				if (w < 0) {
+					n = -1;
+					break;
+				}
+			}
+		}
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			free(buf);
+			return n == 0;
+		}
+		copied = true;
+		atomic_fetch_add(&job->bytes, (unsigned long long)n);
+	}
+	free(buf);
+	return false;
+}
+
+// Copies an entry that is not a directory from src_dir to dest_dir. A move
+// keeps its permissions and times; a copy is created with the umask.
+static bool copy_entry(struct file_job *job, int src_dir, int dest_dir, const char *name, const char *dest_name,
+                       const struct stat *st)
+{
+	struct timespec times[2] = { st->st_atim, st->st_mtim };
+	mode_t mode = st->st_mode & 07777;
+
+	if (S_ISLNK(st->st_mode)) {
+		char target[PATH_MAX];
+		ssize_t len = readlinkat(src_dir, name, target, sizeof(target));
+		if (len < 0 || (size_t)len >= sizeof(target))
+			return false;
+		target[len] = '\0';
+		if (symlinkat(target, dest_dir, dest_name) != 0)
+			return false;
+		if (job->kind == JOB_MOVE)
+			utimensat(dest_dir, dest_name, times, AT_SYMLINK_NOFOLLOW);
+		return true;
+	}
+	if (!S_ISREG(st->st_mode)) {
+		// Fifos and sockets; devices only with the privilege to make them
+		if (mknodat(dest_dir, dest_name, st->st_mode, st->st_rdev) != 0)
+			return false;
+		if (job->kind == JOB_MOVE)
+			utimensat(dest_dir, dest_name, times, AT_SYMLINK_NOFOLLOW);
+		return true;
+	}
+
+	int in = openat(src_dir, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (in < 0)
+		return false;
+	int out = openat(dest_dir, dest_name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, mode);
+	bool ok = out >= 0 && copy_data(job, in, out, st->st_size);
+	if (ok && job->kind == JOB_MOVE)
+		ok = fchmod(out, mode) == 0 && futimens(out, times) == 0;
+	if (out >= 0) {
+		if (close(out) != 0)
+			ok = false;
+		if (!ok)
+			unlinkat(dest_dir, dest_name, 0);  // Only ever one we created
+	}
+	close(in);
+	return ok;
+}
+
+// Finds a name for a copy of the entry of job next to it, the first of
+// "name (copy)", "name (copy 2)", ... not taken. Returns false if none fits.
+static bool copy_name_find(struct file_job *job)
+{
+	struct stat st;
+	for (unsigned n = 1; n < 1000; ++n) {
+		int len = n == 1 ? snprintf(job->copy_name, sizeof(job->copy_name), "%s (copy)", job->name)
+			: snprintf(job->copy_name, sizeof(job->copy_name), "%s (copy %u)", job->name, n);
+		if (len < 0 || (size_t)len >= sizeof(job->copy_name))
+			return false;
+		if (fstatat(job->dest_fd, job->copy_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+			return errno == ENOENT;
+	}
+	return false;
+}
+
+// Copies the entry of a node. A directory is created, filled by queueing
+// its entries, and given its permissions by the last of them. The entry
+// of a move is renamed instead, unless it is on another filesystem.
+static void copy_node_run(struct job_node *node)
+{
+	struct file_job *job = node->job;
+	int src_dir = node->parent ? node->parent->fd : job->dir_fd;
+	int dest_dir = node->parent ? node->parent->dest_fd : job->dest_fd;
+	if (atomic_load(&job->cancelled)) {
+		atomic_store(&node->failed, true);
+		job_node_release(node);
+		return;
+	}
+	if (!node->parent && job->kind == JOB_MOVE) {
+		if (renameat2(src_dir, node->name, dest_dir, node->name, RENAME_NOREPLACE) == 0) {
+			atomic_fetch_add(&job->done, 1);
+			job_node_release(node);
+			return;
+		}
+		if (errno != EXDEV) {
+			atomic_store(&node->failed, true);
+			job_node_release(node);
+			return;
+		}
+	}
+
+	// A copy next to the original is made under a name of its own
+	const char *dest_name = node->name;
+	if (!node->parent && job->in_place) {
+		if (!copy_name_find(job)) {
+			atomic_store(&node->failed, true);
+			job_node_release(node);
+			return;
+		}
+		dest_name = job->copy_name;
+	}
+
+	struct stat st;
+	if (fstatat(src_dir, node->name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+		atomic_store(&node->failed, true);
+		job_node_release(node);
+		return;
+	}
+	if (!S_ISDIR(st.st_mode)) {
+		bool ok = copy_entry(job, src_dir, dest_dir, node->name, dest_name, &st);
+		// The entry of a move across filesystems: the original goes once copied
+		if (ok && !node->parent && job->kind == JOB_MOVE)
+			ok = unlinkat(src_dir, node->name, 0) == 0;
+		if (ok)
+			atomic_fetch_add(&job->done, 1);
+		else
+			atomic_store(&node->failed, true);
+		job_node_release(node);
+		return;
+	}
+
+	// The copy of a directory is met again when copying into the directory itself
+	if (st.st_dev == job->copy_dev && st.st_ino == job->copy_ino) {
+		job_node_release(node);
+		return;
+	}
+	int fd = openat(src_dir, node->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	int list_fd = fd >= 0 ? fcntl(fd, F_DUPFD_CLOEXEC, 0) : -1;
+	DIR *dir = list_fd >= 0 ? fdopendir(list_fd) : NULL;
+	// Writable by us while it is filled, whatever it ends up as
+	int dest = dir && mkdirat(dest_dir, dest_name, S_IRWXU) == 0
+		? openat(dest_dir, dest_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC) : -1;
+	struct stat dest_st;
+	if (dest < 0 || (!node->parent && fstat(dest, &dest_st) != 0)) {
+		if (dir)
+			closedir(dir);
+		else if (list_fd >= 0)
+			close(list_fd);
+		if (fd >= 0)
+			close(fd);
+		if (dest >= 0)
+			close(dest);
+		atomic_store(&node->failed, true);
+		job_node_release(node);
+		return;
+	}
+	if (!node->parent) {
+		job->copy_dev = dest_st.st_dev;
+		job->copy_ino = dest_st.st_ino;
+	}
+	node->fd = fd;
+	node->dest_fd = dest;
+	node->mode = st.st_mode & 07777;
+	node->times[0] = st.st_atim;
+	node->times[1] = st.st_mtim;
+
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL) {
+		if (entry->d_name[0] == '.' &&
+			(entry->d_name[1] == '\0' ||
+			 (entry->d_name[1] == '.' && entry->d_name[2] == '\0')))
+			continue;
+
+		if (atomic_load(&job->cancelled)) {
+			atomic_store(&node->failed, true);
+			break;
+		}
+		struct job_node *child = job_node_new(job, node, entry->d_name);
+		if (!child) {
+			atomic_store(&node->failed, true);
+			continue;
+		}
+		atomic_fetch_add(&node->pending, 1);
+		job_push(child);
+	}
+	closedir(dir);
+	job_node_release(node);
+}
+
+// Counts the blocks of a file towards node, a file with several links
+// only the first time one of them is met
+static void size_add(struct job_node *node, const struct stat *st)
+{
+	struct file_job *job = node->job;
+	if (st->st_nlink > 1 && !S_ISDIR(st->st_mode)) {
+		bool added;
+		pthread_mutex_lock(&job->links_lock);
+		inode_map_insert(&job->links, st->st_dev, st->st_ino, &added);
+		pthread_mutex_unlock(&job->links_lock);
+		if (!added) {
+			atomic_store(&node->shared, true);
+			return;
+		}
+	}
+	unsigned long long bytes = (unsigned long long)st->st_blocks * 512;
+	atomic_fetch_add(&node->size, bytes);
+	atomic_fetch_add(&job->bytes, bytes);
+}
+
+// Measures the disk usage of the entry of a node like du -x: the blocks of
+// all it holds, without going into other filesystems mounted inside
+static void size_node_run(struct job_node *node)
+{
+	struct file_job *job = node->job;
+	int parent_fd = node->parent ? node->parent->fd : job->dir_fd;
+	struct stat st;
+	if (atomic_load(&job->cancelled) || fstatat(parent_fd, node->name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+		atomic_store(&node->failed, true);
+		job_node_release(node);
+		return;
+	}
+	if (!S_ISDIR(st.st_mode)) {
+		size_add(node, &st);
+		job_node_release(node);
+		return;
+	}
+	if (node->parent && st.st_dev != node->parent->dev) {
+		job_node_release(node);
+		return;
+	}
+	node->dev = st.st_dev;
+	node->ino = st.st_ino;
+	node->times[1] = st.st_mtim;
+
+	uint64_t cached;
+	if (job->use_cache && size_cache_get(st.st_dev, st.st_ino, st.st_mtim, &cached)) {
+		atomic_store(&node->size, cached);
+		atomic_fetch_add(&job->bytes, cached);
+		job_node_release(node);
+		return;
+	}
+
+	int fd = openat(parent_fd, node->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	int list_fd = fd >= 0 ? fcntl(fd, F_DUPFD_CLOEXEC, 0) : -1;
+	DIR *dir = list_fd >= 0 ? fdopendir(list_fd) : NULL;
+	if (!dir) {
+		if (list_fd >= 0)
+			close(list_fd);
+		if (fd >= 0)
+			close(fd);
+		atomic_store(&node->failed, true);
+		job_node_release(node);
+		return;
+	}
+	node->fd = fd;
+	size_add(node, &st);
+
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL) {
+		if (entry->d_name[0] == '.' &&
+			(entry->d_name[1] == '\0' ||
+			 (entry->d_name[1] == '.' && entry->d_name[2] == '\0')))
+			continue;
+
+		if (atomic_load(&job->cancelled)) {
+			atomic_store(&node->failed, true);
+			break;
+		}
+		if (entry->d_type != DT_DIR && entry->d_type != DT_UNKNOWN) {
+			struct stat entry_st;
+			if (fstatat(fd, entry->d_name, &entry_st, AT_SYMLINK_NOFOLLOW) == 0)
+				size_add(node, &entry_st);
+			else
+				atomic_store(&node->failed, true);
+			continue;
+		}
+
+		struct job_node *child = job_node_new(job, node, entry->d_name);
+		if (!child) {
+			atomic_store(&node->failed, true);
+			continue;
+		}
+		atomic_fetch_add(&node->pending, 1);
+		job_push(child);
+	}
+	closedir(dir);
+	atomic_fetch_add(&job->done, 1);
+	job_node_release(node);
+}
+
+static void *job_worker(void *arg)
+{
+	(void)arg;
+
+	for (;;) {
+		pthread_mutex_lock(&job_queue.lock);
+		while (!job_queue.head)
+			pthread_cond_wait(&job_queue.wake, &job_queue.lock);
+		struct job_node *node = job_queue.head;
+		job_queue.head = node->next;
+		pthread_mutex_unlock(&job_queue.lock);
+
+		struct file_job *job = node->job;
+		if (job->kind == JOB_SIZE)
+			size_node_run(node);
+		else if (job->kind == JOB_DELETE || job->removing)
+			delete_node_run(node);
+		else
+			copy_node_run(node);
+	}
+	return NULL;
+}
+
+// Returns the index of the entry called name in the listing, or SIZE_MAX
+static size_t listing_find(const char *name)
+{
+	size_t lo = 0, hi = files_size;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		int c = strcmp(name, entry_name(mid));
+		if (c == 0)
+			return mid;
+		if (c < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return SIZE_MAX;
+}
+
+// Takes the entries in the set drop out of the listing, and out of the
+// marks. The view must be rebuilt after.
+static void listing_remove(const uint64_t *drop)
+{
+	if (!windowed) {
+		// The names after one removed are coded against it, so all are coded again
+		struct front_coded names = { 0 };
+		for (size_t k = 0; k < files_size; ++k) {
+			if (!bit_test(drop, k) && !front_coded_append(&names, entry_name(k), files[k].length)) {
+				front_coded_free(&names);
+				return;
+			}
+		}
+		front_coded_shrink(&names);
+		name_pool_reset();
+		file_names = names;
+	}
+
+	size_t kept = 0;
+	marks_count = 0;
+	du_known = 0;
+	for (size_t k = 0; k < files_size; ++k) {
+		if (bit_test(drop, k))
+			continue;
+		if (windowed)
+			window_index[kept] = window_index[k];
+		else
+			files[kept] = files[k];
+		if (marks) {
+			bool marked = bit_test(marks, k);
+			bit_assign(marks, kept, marked);
+			marks_count += marked;
+		}
+		if (du_sizes) {
+			du_sizes[kept] = du_sizes[k];
+			du_known += du_sizes[k] != SIZE_UNKNOWN;
+		}
+		kept++;
+	}
+	if (marks)
+		for (size_t k = kept; k < files_size; ++k)
+			bit_assign(marks, k, false);
+	if (windowed)
+		for (size_t k = 0; k < WINDOW_SLOTS; ++k)
+			window_cache[k].used = false;
+	files_size = kept;
+	meta_reset();  // Indexed like files[]
+	counts_reset();
+}
+
+// Hides the entries being deleted or moved away from a listing just installed
+static void hide_deleting(void)
+{
+	uint64_t *drop = file_jobs ? bit_set_new(files_size) : NULL;
+	if (!drop)
+		return;
+	bool removed = false;
+	for (struct file_job *job = file_jobs; job; job = job->next) {
+		if ((job->kind != JOB_DELETE && job->kind != JOB_MOVE) || job->dev != dir_dev || job->ino != dir_ino)
+			continue;
+		size_t i = listing_find(job->name);
+		if (i != SIZE_MAX) {
+			bit_assign(drop, i, true);
+			removed = true;
+		}
+	}
+	if (removed) {
+		listing_remove(drop);
+		apply_filter();
+	}
+	free(drop);
+}
+
+// Starts the workers, one per CPU within limits, unless already started.
+// Returns false if there are none.
+static bool job_workers_start(void)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t wanted = cpus < 2 ? 2 : cpus > JOB_WORKERS_MAX ? JOB_WORKERS_MAX : (size_t)cpus;
+	while (job_queue.workers < wanted) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, job_worker, NULL) != 0)
+			break;
+		pthread_detach(thread);
+		job_queue.workers++;
+	}
+	return job_queue.workers > 0;
+}
+
+// Starts a job on the entry called name in the directory src_fd: deleting
+// it, or copying or moving it to the shown directory. Returns false if it
+// could not be started.
+static bool job_start(enum job_kind kind, const char *name, int src_fd, dev_t src_dev, ino_t src_ino)
+{
+	if (!job_workers_start())
+		return false;
+
+	size_t len = strlen(name);
+	struct file_job *job = malloc(sizeof(*job) + len + 1);
+	struct job_node *root = job ? job_node_new(job, NULL, name) : NULL;
+	int fd = fcntl(src_fd, F_DUPFD_CLOEXEC, 0);
+	int dest_fd = kind == JOB_DELETE ? -1 : fcntl(dir_fd, F_DUPFD_CLOEXEC, 0);
+	if (!job || !root || fd < 0 || (kind != JOB_DELETE && dest_fd < 0)) {
+		free(job);
+		free(root);
+		if (fd >= 0)
+			close(fd);
+		if (dest_fd >= 0)
+			close(dest_fd);
+		return false;
+	}
+	*job = (struct file_job){
+		.next = file_jobs,
+		.kind = kind,
+		.dir_fd = fd,
+		.dev = src_dev,
+		.ino = src_ino,
+		.dest_fd = dest_fd,
+		.dest_dev = dir_dev,
+		.dest_ino = dir_ino,
+		.started = now_ms(),
+		.trash = kind == JOB_DELETE && trash_enabled,
+		.trash_fd = -1,
+		.in_place = kind == JOB_COPY && src_dev == dir_dev && src_ino == dir_ino,
+	};
+	atomic_init(&job->done, 0);
+	atomic_init(&job->bytes, 0);
+	atomic_init(&job->roots, 1);
+	atomic_init(&job->cancelled, false);
+	pthread_mutex_init(&job->links_lock, NULL);
+	memcpy(job->name, name, len + 1);
+	file_jobs = job;
+	job_push(root);
+	return true;
+}
+
+static bool delete_start(const char *name)
+{
+	return job_start(JOB_DELETE, name, dir_fd, dir_dev, dir_ino);
+}
+
+// Returns true if a copy or move into the shown directory is in progress
+static bool copying_here(void)
+{
+	for (const struct file_job *job = file_jobs; job; job = job->next)
+		if ((job->kind == JOB_COPY || job->kind == JOB_MOVE) && job->dest_dev == dir_dev && job->dest_ino == dir_ino)
+			return true;
+	return false;
+}
+
+// Measures the disk usage of filtered entries [first, end), or only of the
+// directories among them, taking cached sizes of those unchanged if
+// use_cache is set. Returns false if nothing was started.
+static bool size_measure(size_t first, size_t end, bool dirs_only, bool use_cache)
+{
+	// Sizes are kept like files[], which a windowed listing does not have,
+	// and a streamed one keeps growing
+	if (windowed || stream_mode || first >= end || end > filtered_size || !job_workers_start())
+		return false;
+
+	// Named for the progress shown: the entry, or nothing for several
+	bool all = end - first > 1 || dirs_only;
+	size_t len = all ? 0 : entry_length(view_idx(first));
+	struct file_job *job = malloc(sizeof(*job) + len + 1);
+	int fd = job ? fcntl(dir_fd, F_DUPFD_CLOEXEC, 0) : -1;
+	if (fd < 0) {
+		free(job);
+		return false;
+	}
+	*job = (struct file_job){
+		.kind = JOB_SIZE,
+		.dir_fd = fd,
+		.dev = dir_dev,
+		.ino = dir_ino,
+		.dest_fd = -1,
+		.trash_fd = -1,
+		.started = now_ms(),
+		.use_cache = use_cache,
+	};
+	memcpy(job->name, all ? "" : entry_name(view_idx(first)), len + 1);
+
+	// Every node is made before any is queued, as the last one done ends the job
+	struct job_node *nodes = NULL;
+	for (size_t k = first; k < end; ++k) {
+		unsigned char type = files[view_idx(k)].type;
+		if (dirs_only && type != DT_DIR && type != DT_UNKNOWN)
+			continue;
+		struct job_node *node = job_node_new(job, NULL, entry_name(view_idx(k)));
+		if (!node)
+			break;
+		node->next = nodes;
+		nodes = node;
+		job->entries++;
+	}
+	if (job->entries == 0) {
+		close(fd);
+		free(job);
+		return false;
+	}
+
+	atomic_init(&job->done, 0);
+	atomic_init(&job->bytes, 0);
+	atomic_init(&job->roots, job->entries);
+	atomic_init(&job->cancelled, false);
+	pthread_mutex_init(&job->links_lock, NULL);
+	job->next = file_jobs;
+	file_jobs = job;
+	while (nodes) {
+		struct job_node *next = nodes->next;
+		job_push(nodes);
+		nodes = next;
+	}
+	request_redraw(REDRAW_FULL);
+	return true;
+}
+
+// Measures the entry under the cursor afresh, or every directory shown,
+// taking the sizes cached of those unchanged
+static void size_start(bool all)
+{
+	if (all)
+		size_measure(0, filtered_size, true, true);
+	else
+		size_measure(idx, idx + 1, false, false);
+}
+
+// Runs on the main thread once a job is over
+static void job_done(void *arg)
+{
+	struct file_job *job = arg;
+	for (struct file_job **p = &file_jobs; *p; p = &(*p)->next) {
+		if (*p == job) {
+			*p = job->next;
+			break;
+		}
+	}
+	// What is left comes back, and what was copied here shows up once the
+	// last copy is over, unless a load is under way anyway
+	bool copied_here = (job->kind == JOB_COPY || job->kind == JOB_MOVE)
+		&& job->dest_dev == dir_dev && job->dest_ino == dir_ino;
+	bool left_here = job->kind != JOB_SIZE && job->failed && job->dev == dir_dev && job->ino == dir_ino;
+	if ((left_here || (copied_here && !copying_here())) && fs_task_started == 0)
+		reload_directory(idx, NULL);
+	request_redraw(REDRAW_FULL);
+
+	if (job->trashed)
+		purge_note(job->trash_fd);
+	bool trashing = false;
+	for (const struct file_job *other = file_jobs; other && !trashing; other = other->next)
+		trashing = other->trash;
+	if (!trashing)
+		purge_flush();
+
+	if (!job->trashed) {
+		file_job_free(job);
+		return;
+	}
+
+	// Kept for U, up to TRASH_UNDO_MAX
+	job->next = trashed;
+	trashed = job;
+	if (++trashed_size > TRASH_UNDO_MAX) {
+		struct file_job **last = &trashed;
+		while ((*last)->next)
+			last = &(*last)->next;
+		file_job_free(*last);
+		*last = NULL;
+		trashed_size--;
+	}
+}
+
+// Runs on the main thread with the size of an entry measured
+static void size_done(void *arg)
+{
+	struct size_result *result = arg;
+	size_t i = result->dev == dir_dev && result->ino == dir_ino && !windowed
+		? listing_find(result->name) : SIZE_MAX;
+	if (i != SIZE_MAX && !du_sizes && (du_sizes = malloc(files_size * sizeof(*du_sizes))))
+		for (size_t k = 0; k < files_size; ++k)
+			du_sizes[k] = SIZE_UNKNOWN;
+	if (i != SIZE_MAX && du_sizes) {
+		du_known += du_sizes[i] == SIZE_UNKNOWN;
+		du_sizes[i] = result->size;
+		if (!sizes_shown)
+			update_layout();
+		sort_pending = sort_by_size;
+		request_redraw(REDRAW_FULL);
+	}
+	free(result);
+}
+
+// Moves the entry last deleted to the trash back, if it was not purged yet
+static void restore_trashed(void)
+{
+	struct file_job *job = trashed;
+	if (!job)
+		return;
+	trashed = job->next;
+	trashed_size--;
+	reload_directory(idx, job);
+}
+
+// Entries taken with c or x, for P to copy or move to the shown directory
+static struct {
+	int dir_fd;     // Owned; the directory they are in, -1 when empty
+	dev_t dev;
+	ino_t ino;
+	bool cut;       // Moved rather than copied
+	char **names;
+	size_t size;
+} clipboard = { .dir_fd = -1 };
+
+static void clipboard_clear(void)
+{
+	for (size_t i = 0; i < clipboard.size; ++i)
+		free(clipboard.names[i]);
+	free(clipboard.names);
+	if (clipboard.dir_fd >= 0)
+		close(clipboard.dir_fd);
+	clipboard.names = NULL;
+	clipboard.size = 0;
+	clipboard.dir_fd = -1;
+	request_redraw(REDRAW_FULL);
+}
+
+// Takes the marked entries, or the one under the cursor, to be copied or
+// moved (cut) by P
+static void clipboard_take(bool cut)
+{
+	size_t count = marks_count > 0 ? marks_count : filtered_size > 0 ? 1 : 0;
+	if (count == 0 || stream_mode)
+		return;
+	clipboard_clear();
+	clipboard.names = malloc(count * sizeof(*clipboard.names));
+	clipboard.dir_fd = fcntl(dir_fd, F_DUPFD_CLOEXEC, 0);
+	if (!clipboard.names || clipboard.dir_fd < 0) {
+		clipboard_clear();
+		return;
+	}
+	clipboard.dev = dir_dev;
+	clipboard.ino = dir_ino;
+	clipboard.cut = cut;
+	for (size_t k = 0; k < files_size && clipboard.size < count; ++k) {
+		if (marks_count > 0 ? is_marked(k) : k == view_idx(idx)) {
+			char *name = strdup(entry_name(k));
+			if (!name) {
+				clipboard_clear();
+				return;
+			}
+			clipboard.names[clipboard.size++] = name;
+		}
+	}
+	marks_clear();
+}
+
+// Copies or moves the entries taken to the shown directory. Copies can be
+// pasted again; moved entries are gone from the clipboard.
+static void clipboard_paste(void)
+{
+	// Moving into the same directory would change nothing; the status
+	// line says to paste elsewhere
+	if (clipboard.size == 0 || (clipboard.cut && clipboard.dev == dir_dev && clipboard.ino == dir_ino))
+		return;
+	for (size_t i = 0; i < clipboard.size; ++i)
+		job_start(clipboard.cut ? JOB_MOVE : JOB_COPY, clipboard.names[i], clipboard.dir_fd, clipboard.dev, clipboard.ino);
+	if (clipboard.cut)
+		clipboard_clear();
+	request_redraw(REDRAW_FULL);
+}
+
+static void cancel_jobs(void)
+{
+	for (struct file_job *job = file_jobs; job; job = job->next)
+		atomic_store(&job->cancelled, true);
+	request_redraw(REDRAW_FULL);
+}
+
+// Returns ms until the progress of jobs should be redrawn, or -1
+static int job_progress_delay(void)
+{
+	if (!file_jobs)
+		return -1;
+	uint64_t elapsed = now_ms() - jobs_drawn;
+	return elapsed >= JOB_PROGRESS_MS ? 0 : (int)(JOB_PROGRESS_MS - elapsed);
+}
+
+// Handles a key while the delete prompt is shown
+static void confirm_delete_key(int ch)
+{
+	if (ch == 'y' || ch == 'Y') {
+		// The entries leave the listing now, not once they are gone. The
+		// marked ones all go to the workers at once.
+		size_t restore_idx = idx;
+		uint64_t *drop = bit_set_new(files_size);
+		bool started = false;
+		for (size_t k = 0; drop && k < files_size; ++k) {
+			if (marks_count > 0 ? is_marked(k) : k == view_idx(idx)) {
+				if (delete_start(entry_name(k))) {
+					bit_assign(drop, k, true);
+					started = true;
+				}
+			}
+		}
+		if (started) {
+			listing_remove(drop);
+			apply_filter();
+			idx = restore_idx;
+			if (idx >= filtered_size)
+				idx = filtered_size > 0 ? filtered_size - 1 : 0;
+			scroll_to_idx();
+		}
+		free(drop);
+	} else if (ch != 'n' && ch != 'N' && ch != KEY_ESCAPE) {
+		return;
+	}
+
+	confirm_delete = false;
+	request_redraw(REDRAW_FULL);
+}
+
+// Handles a key while the prompt to cancel the jobs is shown. A delete or
+// move cancelled halfway leaves part of the tree behind, so X asks first.
+static void confirm_cancel_key(int ch)
+{
+	if (ch == 'y' || ch == 'Y')
+		cancel_jobs();
+	else if (ch != 'n' && ch != 'N' && ch != KEY_ESCAPE)
+		return;
+
+	confirm_cancel = false;
+	request_redraw(REDRAW_FULL);
+}
+
+static void enter_directory(void)
+{
+	if (filtered_size == 0 || stream_mode)
+		return;
+
+	// Symlinks and DT_UNKNOWN can still be directories; opening them tells
+	const struct file *selection = file_at(view_idx(idx));
+	const char *name = entry_name(view_idx(idx));
+	if (selection->type != DT_DIR && selection->type != DT_LNK && selection->type != DT_UNKNOWN
+		&& !selection->unresolved)
+		return;
+
+	// The path is kept as navigated, like the shell's $PWD: through a
+	// symlink it shows the link, and going up comes back the same way
+	int base_fd = fcntl(dir_fd, F_DUPFD_CLOEXEC, 0);
+	struct load_task *load = base_fd >= 0
+		? load_start(LOAD_ENTER, base_fd, name, path_join(cwd, name))
+		: NULL;
+	if (!load)
+		return;
+	load->restore_idx = idx;
+	pending_up_clear();
+	fs_submit(&load->task);
+}
+
+// Goes up to a held directory, or by path past the held ones. Pressed
+// again while pending, goes up one more level from the pending target.
+static void go_to_parent(void)
+{
+	if (stream_mode)
+		return;
+	char *parent = path_parent(pending_parent ? pending_parent : cwd);
+	if (!parent)
+		return;  // At the root
+
+	struct load_task *load;
+	size_t up = pending_up + 1;
+	if (up <= nav_depth) {
+		size_t level = nav_depth - up;
+		int base_fd = fcntl(nav_stack[level].fd, F_DUPFD_CLOEXEC, 0);
+		load = base_fd >= 0 ? load_start(LOAD_PARENT, base_fd, ".", parent) : NULL;
+		if (load)
+			load->restore_idx = nav_stack[level].idx;
+	} else {
+		load = load_start(LOAD_PARENT, AT_FDCWD, parent, strdup(parent));
+		free(parent);
+	}
+	if (!load)
+		return;
+
+	pending_up = up;
+	pending_parent = load->cwd;
+	fs_submit(&load->task);
+}
+
+static bool preview_cancelled(void *arg)
+{
+	return atomic_load(&preview_generation) != *(const uint64_t *)arg;
+}
+
+// Runs on the main thread with a preview loaded by the worker
+static void preview_done(void *arg)
+{
+	struct preview_result *result = arg;
+	if (result->generation == atomic_load(&preview_generation)) {
+		if (preview_shown)
+			preview_release(&preview_cache, preview_shown);
+		preview_shown = result->preview;
+		preview_dirty = true;
+	} else {
+		preview_release(&preview_cache, result->preview);
+	}
+	free(result);
+}
+
+static void *preview_worker(void *arg)
+{
+	(void)arg;
+	char name[STREAM_PATH_MAX + 1];
+
+	for (;;) {
+		pthread_mutex_lock(&preview_job.lock);
+		while (!preview_job.pending)
+			pthread_cond_wait(&preview_job.wake, &preview_job.lock);
+		memcpy(name, preview_job.name, sizeof(name));
+		int dir_fd = preview_job.dir_fd;
+		preview_job.dir_fd = -1;
+		uint64_t generation = preview_job.generation;
+		preview_job.pending = false;
+		pthread_mutex_unlock(&preview_job.lock);
+
+		struct preview *preview = preview_load(&preview_cache, dir_fd, name, preview_cancelled, &generation);
+		close(dir_fd);
+		if (!preview)
+			continue;  // Cancelled, or out of memory
+		struct preview_result *result = malloc(sizeof(*result));
+		if (!result) {
+			preview_release(&preview_cache, preview);
+			continue;
+		}
+		*result = (struct preview_result){
+			.completion = { .fn = preview_done, .arg = result },
+			.preview = preview,
+			.generation = generation,
+		};
+		post_completion(&result->completion);
+	}
+	return NULL;
+}
+
+// Hands preview_wanted to the worker, starting it on first use
+static void preview_request(void)
+{
+	preview_due = 0;
+
+	int fd = fcntl(dir_fd, F_DUPFD_CLOEXEC, 0);
+	if (fd < 0)
+		return;
+
+	pthread_mutex_lock(&preview_job.lock);
+	if (!preview_job.started) {
+		// The thread inherits the blocked signal mask, so signals stay on the signalfd
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, preview_worker, NULL) != 0) {
+			pthread_mutex_unlock(&preview_job.lock);
+			close(fd);
+			return;
 		}
+		pthread_detach(thread);
+		preview_job.started = true;
+	}
+	if (preview_job.dir_fd >= 0)
+		close(preview_job.dir_fd);  // Replaced before the worker took it
+	preview_job.dir_fd = fd;
+	memcpy(preview_job.name, preview_wanted, sizeof(preview_job.name));
+	preview_job.generation = atomic_load(&preview_generation);
+	preview_job.pending = true;
+	pthread_cond_signal(&preview_job.wake);
+	pthread_mutex_unlock(&preview_job.lock);
 }
 
-static void search_delete_char_back(void)
+static void preview_clear(void)
 {
-	if (search_cursor > 0) {
-		memmove(search_query + search_cursor - 1, search_query + search_cursor, search_len - search_cursor + 1);
-		search_cursor--;
-		search_len--;
+	if (preview_shown) {
+		preview_release(&preview_cache, preview_shown);
+		preview_shown = NULL;
 	}
+	preview_wanted[0] = '\0';
+	preview_due = 0;
+	atomic_fetch_add(&preview_generation, 1);
+	preview_dirty = true;
 }
 
-static void search_delete_char_forward(void)
+// Notices a change of the entry under the cursor and restarts the settle
+// delay. The old preview stays up until the new one is loaded.
+static void preview_track(void)
 {
-	if (search_cursor < search_len) {
-		memmove(search_query + search_cursor, search_query + search_cursor + 1, search_len - search_cursor);
-		search_len--;
+	if (!preview_enabled)
+		return;
+
+	const char *name = filtered_size > 0 ? entry_name(view_idx(idx)) : "";
+	if (strcmp(name, preview_wanted) == 0 && (name[0] == '\0' || preview_wanted_files == files_generation))
+		return;
+
+	if (name[0] == '\0') {
+		preview_clear();
+		return;
 	}
+	snprintf(preview_wanted, sizeof(preview_wanted), "%s", name);
+	preview_wanted_files = files_generation;
+	atomic_fetch_add(&preview_generation, 1);
+	preview_due = now_ms() + PREVIEW_SETTLE_MS;
 }
 
-static inline bool is_word_char(char c)
+// Returns ms until the pending preview request is due, or -1 if none is pending
+static int preview_delay(void)
 {
-	return isalnum((unsigned char)c) || c == '_';
+	if (preview_due == 0)
+		return -1;
+	uint64_t now = now_ms();
+	return now >= preview_due ? 0 : (int)(preview_due - now);
 }
 
-static void search_delete_word_back(void)
+static void update_layout(void)
 {
-	if (search_cursor > 0) {
-		size_t end = search_cursor;
-		bool word = is_word_char(search_query[search_cursor - 1]);
-		while (search_cursor > 0 && is_word_char(search_query[search_cursor - 1]) == word)
-			search_cursor--;
-		memmove(search_query + search_cursor, search_query + end, search_len - end + 1);
-		search_len -= (end - search_cursor);
+	list_cols = preview_enabled && win_cols >= PREVIEW_MIN_COLS ? win_cols / 2 : win_cols;
+	meta_shown = long_mode && list_cols >= META_COLS + META_MIN_NAME_COLS;
+	name_cols = meta_shown ? list_cols - META_COLS : list_cols;
+	sizes_shown = du_known > 0 && name_cols >= SIZE_COLS + META_MIN_NAME_COLS;
+	if (sizes_shown)
+		name_cols -= SIZE_COLS;
+	update_grid();
+}
+
+static void toggle_long(void)
+{
+	long_mode = !long_mode;
+	update_layout();
+	if (filtered_size > 0 && idx >= filtered_size)
+		idx = filtered_size - 1;
+	scroll_to_idx();
+	request_redraw(REDRAW_FULL);
+}
+
+static void toggle_counts(void)
+{
+	counts_enabled = !counts_enabled;
+	if (!counts_enabled)
+		atomic_fetch_add(&count_epoch, 1);  // Abandon what is queued
+	count_rows_size = 0;
+	request_redraw(REDRAW_FULL);
+}
+
+static inline bool preview_visible(void)
+{
+	return list_cols < win_cols;
+}
+
+static void toggle_preview(void)
+{
+	preview_enabled = !preview_enabled;
+	if (!preview_enabled)
+		preview_clear();
+	update_layout();
+	request_redraw(REDRAW_FULL);
+}
+
+static size_t search_box_col;  // Column where search query starts (for cursor positioning)
+
+static void draw_search_box(size_t path_cols)
+{
+	PUTS_ERR(" /");
+	PUTS_ERR(search_query);
+	search_box_col = path_cols + 3;  // path + " /" = path + 2, then +1 for 1-indexed
+}
+
+// Returns the screen column (1-based) of the marker of page entry k
+static size_t cell_col(size_t k)
+{
+	if (grid_cols == 1)
+		return 1;
+	size_t col = 1;
+	for (size_t c = top / grid_rows, end = c + k / grid_rows; c < end; ++c)
+		col += 2 + grid_widths[c];
+	return col;
+}
+
+static void update_selection(void)
+{
+	if (prev_cursor != cursor && prev_cursor < page_entries) {
+		// Clear old marker (row = prev_cursor + 3 for header lines)
+		PRINTF_ERR(CUP(%zu, %zu) " ", prev_cursor % grid_rows + 3, cell_col(prev_cursor));
 	}
+	// Set new marker
+	PRINTF_ERR(CUP(%zu, %zu) ">", cursor % grid_rows + 3, cell_col(cursor));
+	prev_cursor = cursor;
 }
 
-static void search_delete_word_forward(void)
+// Fills the render cache of an entry called name for the current name width
+static void build_span(struct file *file, const char *name)
 {
-	if (search_cursor < search_len) {
-		size_t start = search_cursor;
-		bool word = is_word_char(search_query[search_cursor]);
-		while (search_cursor < search_len && is_word_char(search_query[search_cursor]) == word)
-			search_cursor++;
-		memmove(search_query + start, search_query + search_cursor, search_len - search_cursor + 1);
-		search_len -= (search_cursor - start);
-		search_cursor = start;
+	// Max columns: name_cols - 2 (marker) - 1 (dir slash) - 1 (ellipsis) - 1 (terminal edge)
+	size_t max_cols = name_cols > 5 ? name_cols - 5 : 1;
+
+	file->truncated = file->cols > max_cols;
+	if (!file->truncated)
+		file->shown_len = (uint16_t)file->length;
+	else if (file->ascii)
+		file->shown_len = (uint16_t)max_cols;
+	else
+		file->shown_len = (uint16_t)utf8_truncate(name, file->length, max_cols, NULL);
+	file->span_cols = (uint16_t)name_cols;
+}
+
+static void format_mode(mode_t mode, char *out)
+{
+	out[0] = S_ISDIR(mode) ? 'd' : S_ISLNK(mode) ? 'l' : S_ISFIFO(mode) ? 'p' : S_ISSOCK(mode) ? 's'
+		: S_ISCHR(mode) ? 'c' : S_ISBLK(mode) ? 'b' : '-';
+	static const char rwx[] = "rwxrwxrwx";
+	for (int i = 0; i < 9; ++i)
+		out[i + 1] = mode & (1 << (8 - i)) ? rwx[i] : '-';
+	if (mode & S_ISUID)
+		out[3] = mode & S_IXUSR ? 's' : 'S';
+	if (mode & S_ISGID)
+		out[6] = mode & S_IXGRP ? 's' : 'S';
+	if (mode & S_ISVTX)
+		out[9] = mode & S_IXOTH ? 't' : 'T';
+}
+
+// Formats a size in at most 5 columns: 1023, 4.0K, 12M, ...
+static void format_size(off_t size, char *out, size_t out_size)
+{
+	static const char units[] = "KMGTPE";
+	if (size < 1024) {
+		// Sizes are never negative; clamping also bounds the output to 4 bytes
+		snprintf(out, out_size, "%d", size > 0 ? (int)size : 0);
+		return;
 	}
+	double value = (double)size;
+	size_t unit = 0;
+	for (value /= 1024; value >= 1024 && unit + 1 < sizeof(units) - 1; value /= 1024)
+		unit++;
+	if (value < 10)
+		snprintf(out, out_size, "%.1f%c", value, units[unit]);
+	else
+		snprintf(out, out_size, "%.0f%c", value, units[unit]);
 }
 
-static void search_delete_to_start(void)
+// Draws the long listing fields of files[file_idx], blank until fetched
+static void draw_meta(size_t file_idx)
 {
-	if (search_cursor > 0) {
-		memmove(search_query, search_query + search_cursor, search_len - search_cursor + 1);
-		search_len -= search_cursor;
-		search_cursor = 0;
+	const struct file_meta *meta = meta_slot(file_idx, false);
+	if (!meta || meta->state == META_NONE || meta->state == META_PENDING) {
+		PRINTF_ERR("%*s", META_COLS, "");
+		return;
+	}
+	if (meta->state == META_FAILED) {
+		PRINTF_ERR("%-*s", META_COLS, "?");
+		return;
 	}
+
+	char mode[11] = "";
+	format_mode(meta->mode, mode);
+	char size[16];
+	format_size(meta->size, size, sizeof(size));
+
+	// Like ls: the time of day for the last six months, the year otherwise
+	char date[16] = "";
+	struct tm tm;
+	time_t now = time(NULL);
+	bool recent = meta->mtime <= now && now - meta->mtime < 182 * 24 * 3600;
+	if (localtime_r(&meta->mtime, &tm))
+		strftime(date, sizeof(date), recent ? "%b %e %H:%M" : "%b %e  %Y", &tm);
+
+	PRINTF_ERR("%s %-8s %5s %-12s ", mode, meta->owner, size, date);
 }
 
-static void search_insert_char(int ch)
+// Draws the disk usage of files[file_idx], blank until measured
+static void draw_size(size_t file_idx)
+{
+	char size[16] = "";
+	if (du_sizes && du_sizes[file_idx] != SIZE_UNKNOWN)
+		format_size((off_t)du_sizes[file_idx], size, sizeof(size));
+	PRINTF_ERR("%5s ", size);
+}
+
+// Draws " -> target" after a symlink name, in what is left of the row
+static void draw_link_target(size_t file_idx, size_t used_cols)
+{
+	const struct file_meta *meta = meta_slot(file_idx, false);
+	if (!meta || !meta->target || used_cols + 5 >= name_cols)
+		return;
+	size_t room = name_cols - used_cols - 5;  // " -> " and the terminal edge
+	size_t len = strlen(meta->target);
+	size_t cols;
+	size_t shown = utf8_truncate(meta->target, len, room, &cols);
+	PUTS_ERR(" -> ");
+	WRITE_ERR(meta->target, shown);
+	if (shown < len)
+		PUTS_ERR("…");
+}
+
+// Draws " (count)" after a directory name, if it fits in what is left of
+// the row
+static void draw_count(size_t file_idx, size_t used_cols)
+{
+	const struct child_count *slot = count_slot(file_idx, false);
+	if (!slot || slot->state != META_READY)
+		return;
+	char badge[16];
+	int len = slot->count >= COUNT_CAP ? snprintf(badge, sizeof(badge), " (%uk+)", COUNT_CAP / 1000)
+		: snprintf(badge, sizeof(badge), " (%u)", slot->count);
+	if (used_cols + (size_t)len < name_cols)
+		WRITE_ERR(badge, (size_t)len);
+}
+
+// Draws the marker and filtered entry i, ending after the name
+static void draw_entry(size_t i, bool selected)
 {
-	if (ch >= 32 && ch < 127 && search_len < sizeof(search_query) - 1) {
-		memmove(search_query + search_cursor + 1, search_query + search_cursor, search_len - search_cursor + 1);
-		search_query[search_cursor++] = (char)ch;
-		search_len++;
+	struct file *file = file_at(view_idx(i));
+	const char *name = entry_name(view_idx(i));
+	if (file->span_cols != name_cols)
+		build_span(file, name);
+
+	size_t shown = file->shown_len;
+
+	PUTC_ERR(selected ? '>' : ' ');
+	PUTC_ERR(is_marked(view_idx(i)) ? '*' : ' ');
+	if (sizes_shown)
+		draw_size(view_idx(i));
+	if (meta_shown)
+		draw_meta(view_idx(i));
+	WRITE_ERR(color_prefix[file->color].seq, color_prefix[file->color].len);
+
+	if (search_len > 0) {
+		size_t match_start = view_match(i);
+		size_t match_end = match_start + search_len;
+		// Part of the match is cut off: the ellipsis stands in for it
+		bool overflow = match_end > shown;
+		size_t visible_start = match_start < shown ? match_start : shown;
+		size_t visible_end = overflow ? shown : match_end;
+
+		WRITE_ERR(name, visible_start);
+		PUTS_ERR(SGR_UNDERSCORE_ON);
+		WRITE_ERR(name + visible_start, visible_end - visible_start);
+		if (!overflow)
+			PUTS_ERR(SGR_UNDERLINE_OFF);
+		WRITE_ERR(name + visible_end, shown - visible_end);
+		if (file->truncated)
+			PUTS_ERR("…");
+		if (overflow)
+			PUTS_ERR(SGR_UNDERLINE_OFF);
+	} else {
+		WRITE_ERR(name, shown);
+		if (file->truncated)
+			PUTS_ERR("…");
+	}
+
+	PUTS_ERR(SGR_RESET);
+	if (file->type == DT_DIR && !file->truncated) {
+		PUTC_ERR('/');
+		if (counts_shown())
+			draw_count(view_idx(i), 3 + file->cols);
 	}
+	if (meta_shown && file->type == DT_LNK && !file->truncated)
+		draw_link_target(view_idx(i), 2 + file->cols);
 }
 
-static void search_move_word_back(void)
+// Draws filtered entry i on list row j, without moving to the next line
+static void draw_row(size_t i, size_t j)
 {
-	if (search_cursor > 0) {
-		bool word = is_word_char(search_query[search_cursor - 1]);
-		while (search_cursor > 0 && is_word_char(search_query[search_cursor - 1]) == word)
-			search_cursor--;
+	if (i < filtered_size)
+		draw_entry(i, j == cursor);
+	PUTS_ERR(EL(0));
+}
+
+// Draws row r of the grid page, padding each entry to its column width
+static void draw_grid_row(size_t r)
+{
+	static const char spaces[] = "                                ";
+
+	for (size_t c = 0; c < grid_cols; ++c) {
+		size_t k = c * grid_rows + r;
+		size_t i = top + k;
+		if (i >= filtered_size)
+			break;
+		draw_entry(i, k == cursor);
+
+		if (c + 1 < grid_cols && i + grid_rows < filtered_size) {
+			size_t pad = grid_widths[top / grid_rows + c] - entry_cols(file_at(view_idx(i)));
+			for (; pad > sizeof(spaces) - 1; pad -= sizeof(spaces) - 1)
+				WRITE_ERR(spaces, sizeof(spaces) - 1);
+			WRITE_ERR(spaces, pad);
+		}
 	}
+	PUTS_ERR(EL(0));
 }
 
-static void search_move_word_forward(void)
+// Draws the preview pane to the right of the list rows
+static void draw_preview(void)
 {
-	if (search_cursor < search_len) {
-		bool word = is_word_char(search_query[search_cursor]);
-		while (search_cursor < search_len && is_word_char(search_query[search_cursor]) == word)
-			search_cursor++;
+	size_t width = win_cols - list_cols - 3;  // "│ " and the terminal edge
+
+	for (size_t j = 0; j < page_size; ++j) {
+		PRINTF_ERR(CUP(%zu, %zu) "│ ", j + 3, list_cols + 1);
+		if (preview_shown && j < preview_shown->nlines) {
+			size_t len;
+			const char *line = preview_line(preview_shown, j, &len);
+			WRITE_ERR(line, utf8_truncate(line, len, width, NULL));
+		}
+		PUTS_ERR(EL(0));
 	}
+	preview_dirty = false;
 }
 
-static int remove_recursive_at(int parent_fd, const char *name)
+static void place_cursor(void)
 {
-	if (parent_fd < 0)
-		return -1;
+	if (search_open)
+		PRINTF_ERR(SHOW_CURSOR CUP(1, %zu), search_box_col + utf8_width(search_query, search_cursor));
+	else
+		PUTS_ERR(HIDE_CURSOR);
+}
 
-	struct stat st;
-	if (fstatat(parent_fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+// Formats the progress of the deletes, copies and moves in progress into text
+static void format_job_progress(char *text, size_t size, bool brief)
+{
+	static const char *const verbs[] = { "Deleting", "Copying", "Moving", "Measuring" };
+	static const char *const nouns[] = { "delete", "copy", "move", "measuring" };
+
+	size_t jobs = 0, removed = 0;
+	unsigned long long bytes = 0;
+	uint64_t started = UINT64_MAX;
+	bool cancelled = false;
+	bool kinds[4] = { false };
+	for (const struct file_job *job = file_jobs; job; job = job->next) {
+		jobs += job->kind == JOB_SIZE ? job->entries : 1;
+		kinds[job->kind] = true;
+		removed += atomic_load(&job->done);
+		bytes += atomic_load(&job->bytes);
+		if (job->started < started)
+			started = job->started;
+		cancelled |= atomic_load(&job->cancelled);
+	}
+	enum job_kind kind = file_jobs->kind;
+	bool mixed = kinds[JOB_DELETE] + kinds[JOB_COPY] + kinds[JOB_MOVE] + kinds[JOB_SIZE] > 1;
+	const char *verb = mixed ? "Working on" : verbs[kind];
+
+	// Copies and sizes are counted in bytes, deletes in entries
+	uint64_t elapsed = now_ms() - started;
+	char amount[64];
+	if (kinds[JOB_COPY] || kinds[JOB_MOVE] || kinds[JOB_SIZE]) {
+		char total[16], rate[16];
+		format_size((off_t)bytes, total, sizeof(total));
+		format_size(elapsed > 0 ? (off_t)(bytes * 1000 / elapsed) : 0, rate, sizeof(rate));
+		snprintf(amount, sizeof(amount), brief ? "%s" : "%s, %s/s", total, rate);
+	} else {
+		size_t rate = elapsed > 0 ? (size_t)(removed * 1000 / elapsed) : 0;
+		snprintf(amount, sizeof(amount), brief ? "%zu removed" : "%zu removed, %zu/s", removed, rate);
+	}
+
+	if (brief)
+		snprintf(text, size, "  %s: %s", mixed ? "Working" : verb, amount);
+	else if (cancelled)
+		snprintf(text, size, "  Cancelling%s%s: %s", mixed ? "" : " ", mixed ? "" : nouns[kind], amount);
+	else if (jobs > 1)
+		snprintf(text, size, "  %s %zu entries: %s (X: cancel)", verb, jobs, amount);
+	else
+		snprintf(text, size, "  %s '%s': %s (X: cancel)", verb, file_jobs->name, amount);
+}
+
+// Shown next to the up arrow: a directory slow to load, why U failed,
+// deletes or copies in progress, a listing cut short by the memory
+// budget, the marks, or the entries taken to copy or move
+static void draw_status(void)
+{
+	static const char loading[] = "  Loading…";
+	static const char hung[] = "  Filesystem not responding (Left: go up, q: quit)";
+	static const char hung_short[] = "  Not responding";
+	static const char over_budget[] = "  Memory budget reached, not all entries are listed";
+	static const char over_budget_short[] = "  Incomplete";
+	static const char restore_error_short[] = "  Not restored";
+
+	char progress[NAME_MAX + 128];
+	char streamed[64];
+	if (stream_reading)
+		snprintf(streamed, sizeof(streamed), "  Reading… %zu paths", files_size);
+	else
+		snprintf(streamed, sizeof(streamed), "  %zu paths longer than %d bytes left out", stream_skipped, STREAM_PATH_MAX);
+	char marked[64];
+	if (marks_count > 0)
+		snprintf(marked, sizeof(marked), "  %zu marked", marks_count);
+	else if (clipboard.cut && clipboard.dev == dir_dev && clipboard.ino == dir_ino)
+		snprintf(marked, sizeof(marked), "  %zu to move (already here: paste elsewhere)", clipboard.size);
+	else
+		snprintf(marked, sizeof(marked), "  %zu to %s (P: paste here)", clipboard.size, clipboard.cut ? "move" : "copy");
+
+	fs_status_shown = fs_status();
+	const char *text = fs_status_shown == FS_LOADING ? loading
+		: fs_status_shown == FS_NOT_RESPONDING ? hung
+		: restore_error[0] ? restore_error
+		: file_jobs ? progress
+		: listing_truncated || (filter_truncated && search_len > 0) ? over_budget
+		: marks_count > 0 || clipboard.size > 0 ? marked
+		: stream_reading || stream_skipped > 0 ? streamed : NULL;
+	if (text == hung && utf8_width(hung, sizeof(hung) - 1) + 1 > list_cols)
+		text = hung_short;
+	if (file_jobs) {
+		jobs_drawn = now_ms();
+		format_job_progress(progress, sizeof(progress), false);
+		if (utf8_width(progress, strlen(progress)) + 1 > list_cols)
+			format_job_progress(progress, sizeof(progress), true);
+	}
+	if (text == over_budget && utf8_width(over_budget, sizeof(over_budget) - 1) + 1 > list_cols)
+		text = over_budget_short;
+	if (text == restore_error && utf8_width(restore_error, strlen(restore_error)) + 1 > list_cols)
+		text = restore_error_short;
+	status_shown = text && utf8_width(text, strlen(text)) + 1 <= list_cols;
+	if (status_shown) {
+		PUTS_ERR(top > 0 ? "" : " ");
+		PUTS_ERR(text);
+	}
+}
+
+static void print_view(void)
+{
+	PUTS_ERR(SYNC_BEGIN HOME);
+	WRITE_ERR(color_prefix[LsColor_di].seq, color_prefix[LsColor_di].len);
+
+	const char *path = cwd;
+	size_t len = strlen(cwd);
+
+	// Replace home directory with ~
+	const char *display_path = path;
+	size_t display_len = len;
+	bool use_tilde = home_len > 0 && len >= home_len && strncmp(path, home_dir, home_len) == 0
+					 && (path[home_len] == '/' || path[home_len] == '\0');
+	if (use_tilde) {
+		display_path = path + home_len;
+		display_len = len - home_len;
+	}
+
+	size_t path_cols = (use_tilde ? 1 : 0) + utf8_width(display_path, display_len);
+	if (path_cols <= win_cols) {
+		if (use_tilde)
+			PUTC_ERR('~');
+		WRITE_ERR(display_path, display_len);
+	} else {
+		size_t max_cols = win_cols - (use_tilde ? 2 : 1);
+		if (use_tilde)
+			PUTC_ERR('~');
+		WRITE_ERR(display_path, utf8_truncate(display_path, display_len, max_cols, &path_cols));
+		path_cols += use_tilde ? 2 : 1;
+		PUTS_ERR("…");
+	}
+
+	PUTS_ERR(SGR_RESET);
+
+	if (search_open || search_len > 0)
+		draw_search_box(path_cols);
+
+	PUTS_ERR(EL(0) "\n");
+	if (top > 0)
+		PUTS_ERR("↑");
+	draw_status();
+	PUTS_ERR(EL(0) "\n");
+
+	size_t start = top;
+
+	if (grid_cols > 1) {
+		for (size_t r = 0; r < grid_rows; ++r) {
+			draw_grid_row(r);
+			PUTC_ERR('\n');
+		}
+	} else {
+		for (size_t i = start, j = 0; i < filtered_size && j < page_size; ++i, ++j) {
+			draw_row(i, j);
+			PUTC_ERR('\n');
+		}
+	}
+
+	if (confirm_delete && marks_count > 0) {
+		PRINTF_ERR("Delete %zu marked entries? (y/n) ", marks_count);
+	} else if (confirm_delete) {
+		PUTS_ERR("Delete '");
+		PUTS_ERR(entry_name(view_idx(idx)));
+		PUTS_ERR("'? (y/n) ");
+	} else if (confirm_cancel) {
+		PUTS_ERR("Cancel the work in progress? (y/n) ");
+	} else if (filtered_size > 0 && start + page_entries < filtered_size) {
+		PUTS_ERR("↓");
+	}
+	PUTS_ERR(ED(0));
+
+	if (preview_visible())
+		draw_preview();
+	place_cursor();
+
+	PUTS_ERR(SYNC_END);
+
+	prev_cursor = cursor;
+	drawn_top = top;
+}
+
+static void render(void)
+{
+	sync_filter();
+	if (sort_pending)
+		sort_view();
+
+	if (redraw == REDRAW_NONE && !preview_dirty)
+		return;
+
+	// Fetch what this frame shows, and for the long listing the next page
+	// before it is needed
+	if (meta_shown)
+		meta_prefetch(top, 2 * page_entries);
+	else if (lazy_stat)
+		meta_prefetch(top, page_entries);
+	if (counts_shown())
+		count_prefetch(top, page_entries);
+
+	switch (redraw) {
+		case REDRAW_NONE:
+			break;
+		case REDRAW_SELECTION:
+			if (top == drawn_top || (continuous_scroll && scroll_view(drawn_top))) {
+				update_selection();
+				break;
+			}
+			// fallthrough
+		case REDRAW_FULL:
+			print_view();
+			break;
+	}
+
+	if (preview_dirty) {
+		if (preview_visible()) {
+			PUTS_ERR(SYNC_BEGIN);
+			draw_preview();
+			place_cursor();
+			PUTS_ERR(SYNC_END);
+		}
+		preview_dirty = false;
+	}
+
+	flush_frame();
+	frame_held = false;
+	redraw = REDRAW_NONE;
+	stats.frames_rendered++;
+}
+
+static int prev_key;
+
+// Handles one decoded key. Returns an exit status, or -1 to keep running.
+static int handle_key(const struct key_event *ev)
+{
+	int key = ev->key;
+
+	// Escape Escape: the decoder reports each press on its own
+	bool double_escape = key == KEY_ESCAPE && prev_key == KEY_ESCAPE;
+	prev_key = double_escape ? 0 : key;
+
+	if (restore_error[0]) {
+		restore_error[0] = '\0';
+		request_redraw(REDRAW_FULL);
+	}
+
+	if (confirm_delete) {
+		confirm_delete_key(key);
+		return -1;
+	}
+	if (confirm_cancel) {
+		confirm_cancel_key(key);
 		return -1;
+	}
 
-	if (S_ISDIR(st.st_mode)) {
-		int fd = openat(parent_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
-		if (fd < 0)
+	if (search_open) {
+		if (double_escape) {
+			clear_search();
+			request_redraw(REDRAW_FULL);
 			return -1;
+		}
 
-		DIR *dir = fdopendir(fd);
-		if (!dir) {
-			close(fd);
-			return -1;
+		switch (key) {
+			case K_CTRL_U:
+				search_delete_to_start();
+				schedule_filter();
+				break;
+
+			case K_CTRL_W:
+				search_delete_word_back();
+				schedule_filter();
+				break;
+
+			case KEY_LEFT:
+				if (search_cursor > 0) {
+					search_cursor -= utf8_prev_len(search_query, search_cursor);
+					request_redraw(REDRAW_FULL);
+				}
+				break;
+
+			case KEY_RIGHT:
+				if (search_cursor < search_len) {
+					search_cursor += search_next_len();
+					request_redraw(REDRAW_FULL);
+				}
+				break;
+
+			case KEY_HOME:
+				search_cursor = 0;
+				request_redraw(REDRAW_FULL);
+				break;
+
+			case KEY_END:
+				search_cursor = search_len;
+				request_redraw(REDRAW_FULL);
+				break;
+
+			case KEY_DELETE:
+				search_delete_char_forward();
+				schedule_filter();
+				break;
+
+			case KEY_CTRL | KEY_DELETE:
+				search_delete_word_forward();
+				schedule_filter();
+				break;
+
+			case KEY_CTRL | KEY_LEFT:
+				search_move_word_back();
+				request_redraw(REDRAW_FULL);
+				break;
+
+			case KEY_CTRL | KEY_RIGHT:
+				search_move_word_forward();
+				request_redraw(REDRAW_FULL);
+				break;
+
+			case KEY_PASTE:
+				search_insert_text(ev->text, ev->len);
+				schedule_filter();
+				break;
+
+			case '\n':
+				search_open = false;
+				request_redraw(REDRAW_FULL);
+				break;
+
+			case K_DEL:
+				if (search_len == 0) {
+					search_open = false;
+				} else {
+					search_delete_char_back();
+					schedule_filter();
+				}
+				request_redraw(REDRAW_FULL);
+				break;
+
+			case K_CTRL_H:
+				search_delete_word_back();
+				schedule_filter();
+				break;
+
+			default:
+				if (key < 0x100) {
+					search_insert_char(key);
+					schedule_filter();
+				}
+				break;
 		}
+		return -1;
+	}
 
-		struct dirent *entry;
-		while ((entry = readdir(dir)) != NULL) {
-			if (entry->d_name[0] == '.' &&
-				(entry->d_name[1] == '\0' ||
-				 (entry->d_name[1] == '.' && entry->d_name[2] == '\0')))
-				continue;
+	sync_filter();
 
-			if (remove_recursive_at(dirfd(dir), entry->d_name) != 0) {
-				closedir(dir);
-				return -1;
-			}
+	if (double_escape) {
+		if (search_len > 0) {
+			clear_search();
+			request_redraw(REDRAW_FULL);
 		}
-		closedir(dir);
-		return unlinkat(parent_fd, name, AT_REMOVEDIR);
+		return -1;
 	}
 
-	return unlinkat(parent_fd, name, 0);
-}
-
-static void delete_selected(void)
-{
-	if (filtered_size == 0)
-		return;
+	switch (key) {
+		case '\n':
+			if (marks_count > 0) {
+				for (size_t i = 0; i < files_size; ++i)
+					if (is_marked(i))
+						print_path(i);
+			} else if (filtered_size > 0) {
+				print_path(view_idx(idx));
+			}
+			return EXIT_SUCCESS;
+
+		case KEY_UP:        move_to_previous(); break;
+		case KEY_DOWN:      move_to_next(); break;
+		case KEY_HOME:      move_to_first(); break;
+		case KEY_END:       move_to_last(); break;
+		case KEY_DELETE:    delete_selected(); break;
+		case KEY_PAGE_UP:   move_page_up(); break;
+		case KEY_PAGE_DOWN: move_page_down(); break;
+		case KEY_RIGHT:     enter_directory(); break;
+		case KEY_LEFT:      go_to_parent(); break;
+
+		case '/':  // Open search
+			search_open = true;
+			request_redraw(REDRAW_FULL);
+			break;
 
-	struct file *selection = files + filtered[idx].idx;
-	const char *selection_name = file_name(selection);
+		case 'q':
+			return EXIT_SUCCESS;
 
-	char prompt[PATH_MAX + 64];
-	snprintf(prompt, sizeof(prompt), CUP(%zu, 1) EL(0) "Delete '%s'? (y/n) ", page_size + 3, selection_name);
-	PUTS_ERR(prompt);
+		case 'X':  // Cancel the jobs, after asking
+			if (file_jobs) {
+				confirm_cancel = true;
+				request_redraw(REDRAW_FULL);
+			}
+			break;
 
-	for (;;) {
-		int ch = getchar();
-		if (ch == 'y' || ch == 'Y') {
-			if (remove_recursive_at(AT_FDCWD, selection_name) == 0) {
-				get_files();
-				apply_filter();
-				if (idx >= filtered_size && filtered_size > 0)
-					idx = filtered_size - 1;
-				if (idx > 0) {
-					page = idx / page_size;
-					cursor = idx % page_size;
-				} else {
-					page = cursor = 0;
+		case 'z': size_start(false); break;
+		case 'Z': size_start(true); break;
+		case 's': toggle_sort(); break;
+		case 'c': clipboard_take(false); break;
+		case 'x': clipboard_take(true); break;
+		case 'P': clipboard_paste(); break;
+		case 'C': clipboard_clear(); break;
+
+		case 'U': restore_trashed(); break;
+
+		case ' ': toggle_mark(); break;
+		case 'a': mark_shown(false); break;
+		case 'i': mark_shown(true); break;
+		case 'A': unmark_all(); break;
+
+		case 'g': move_to_first(); break;
+		case 'G': move_to_last(); break;
+		case 'u': move_page_up(); break;
+		case 'd': move_page_down(); break;
+		case 'D': delete_selected(); break;
+		case 'p': toggle_preview(); break;
+		case 'L': toggle_long(); break;
+		case '#': toggle_counts(); break;
+		case 'h': move_column(false); break;
+		case 'l': move_column(true); break;
+		case '\t': move_column(true); break;
+		case KEY_BACKTAB: move_column(false); break;
+		case 'e':  // Open in editor
+			if (filtered_size > 0) {
+				char *editor = getenv("EDITOR");
+				if (editor) {
+					const char *selection_name = entry_name(view_idx(idx));
+					leave_ui();
+					pid_t pid = fork();
+					if (pid == 0) {
+						sigprocmask(SIG_SETMASK, &saved_sigmask, NULL);
+						if (fchdir(dir_fd) != 0)
+							_exit(127);
+						execlp(editor, editor, selection_name, NULL);
+						_exit(127);
+					} else if (pid > 0) {
+						int status;
+						while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+						}
+					}
+					enter_ui();
+					preview_wanted[0] = '\0';  // Reload: the file may have changed
+					request_redraw(REDRAW_FULL);
 				}
 			}
 			break;
-		} else if (ch == 'n' || ch == 'N' || ch == 27) {
-			break;
-		}
 	}
 
-	print_view();
+	return -1;
 }
 
-static void update_cwd(void)
-{
-	if (!getcwd(cwd, PATH_MAX))
-		cwd[0] = '\0';
-}
+static struct key_decoder key_decoder;
+static int esc_timeout = 50;      // ms to wait for the rest of an escape sequence
+static uint64_t input_deadline;   // When a pending escape sequence times out
 
-static void enter_directory(void)
+static void dispatch_key(const struct key_event *ev)
 {
-	if (filtered_size == 0)
-		return;
-
-	struct file *selection = files + filtered[idx].idx;
-	const char *selection_name = file_name(selection);
-
-	if (selection->type != DT_DIR) {
-		// DT_UNKNOWN and symlinks can still be directories; follow stat() for navigation.
-		struct stat st;
-		if (stat(selection_name, &st) != 0 || !S_ISDIR(st.st_mode))
-			return;
-	}
-
-	if (chdir(selection_name) != 0)
-		return;
-
-	if (cursor_stack_size < 64)
-		cursor_stack[cursor_stack_size++] = idx;
-
-	update_cwd();
-	search_query[0] = '\0';
-	search_len = search_cursor = 0;
-	search_open = false;
-	prev_search_len = 0;
-	get_files();
-	idx = cursor = page = 0;
-	print_view();
+	// The frame for the previous key was never drawn
+	if (redraw != REDRAW_NONE)
+		stats.frames_skipped++;
+	exit_status = handle_key(ev);
 }
 
-static void go_to_parent(void)
+static void on_input(int fd, short revents)
 {
-	if (chdir("..") != 0) return;
-	update_cwd();
-	clear_search();
-	get_files();
+	(void)revents;
 
-	if (cursor_stack_size > 0) {
-		idx = cursor_stack[--cursor_stack_size];
-		if (idx >= filtered_size)
-			idx = filtered_size > 0 ? filtered_size - 1 : 0;
-	} else {
-		idx = 0;
+	unsigned char buf[4096];
+	ssize_t n = read(fd, buf, sizeof(buf));
+	if (n <= 0) {
+		if (n == 0 || (errno != EINTR && errno != EAGAIN))
+			exit_status = EXIT_SUCCESS;
+		return;
 	}
 
-	if (idx > 0) {
-		page = idx / page_size;
-		cursor = idx % page_size;
-	} else {
-		page = cursor = 0;
+	struct key_event ev;
+	for (ssize_t i = 0; i < n && exit_status < 0; ++i) {
+		if (key_decode(&key_decoder, buf[i], &ev))
+			dispatch_key(&ev);
 	}
-
-	print_view();
+	if (key_decoder_pending(&key_decoder))
+		input_deadline = now_ms() + (uint64_t)esc_timeout;
 }
 
-static size_t search_box_col;  // Column where search query starts (for cursor positioning)
-
-static void draw_search_box(size_t path_cols)
+// Resolves an escape sequence that stopped arriving, e.g. a lone Escape
+static void input_timeout(void)
 {
-	PUTS_ERR(" /");
-	PUTS_ERR(search_query);
-	search_box_col = path_cols + 3;  // path + " /" = path + 2, then +1 for 1-indexed
+	struct key_event ev;
+	if (key_decoder_timeout(&key_decoder, &ev))
+		dispatch_key(&ev);
 }
 
-static void update_selection(void)
+static void handle_resize(void)
 {
-	if (prev_cursor != cursor) {
-		// Clear old marker (row = prev_cursor + 3 for header lines)
-		PRINTF_ERR(CUP(%zu, 1) " ", prev_cursor + 3);
+	struct winsize *ws = get_win_size();
+	page_size = ws->ws_row > 3 ? ws->ws_row - 3 : 1;
+	win_cols = ws->ws_col;
+	update_layout();
+	// Adjust cursor/page if they're now out of bounds
+	if (filtered_size > 0) {
+		if (idx >= filtered_size)
+			idx = filtered_size - 1;
+		scroll_to_idx();
 	}
-	// Set new marker
-	PRINTF_ERR(CUP(%zu, 1) ">", cursor + 3);
-	prev_cursor = cursor;
+	request_redraw(REDRAW_FULL);
 }
 
-static void print_view(void)
+static void suspend(void)
 {
-	PUTS_ERR(SYNC_BEGIN HOME CSI);
-	PUTS_ERR(ls_colors[LsColor_di]);
-	PUTC_ERR('m');
-
-	const char *path = cwd;
-	size_t len = strlen(cwd);
-
-	// Replace home directory with ~
-	const char *display_path = path;
-	size_t display_len = len;
-	bool use_tilde = home_len > 0 && len >= home_len && strncmp(path, home_dir, home_len) == 0
-					 && (path[home_len] == '/' || path[home_len] == '\0');
-	if (use_tilde) {
-		display_path = path + home_len;
-		display_len = len - home_len;
-	}
-
-	size_t path_cols;
-	if ((use_tilde ? 1 : 0) + display_len <= win_cols) {
-		path_cols = (use_tilde ? 1 : 0) + display_len;
-		if (use_tilde)
-			PUTC_ERR('~');
-		WRITE_ERR(display_path, display_len);
+	leave_ui();
+
+	// SIGTSTP is blocked for the signalfd; let the default action stop us here
+	sigset_t tstp;
+	sigemptyset(&tstp);
+	sigaddset(&tstp, SIGTSTP);
+	// A session of the server is in a session of its own, where SIGTSTP
+	// does not stop; the client is stopped for the shell to see instead
+	if (server_client) {
+		kill(server_client, SIGSTOP);
+		raise(SIGSTOP);
 	} else {
-		path_cols = win_cols;
-		if (use_tilde) {
-			PUTC_ERR('~');
-			WRITE_ERR(display_path, win_cols - 2);
-		} else {
-			WRITE_ERR(display_path, win_cols - 1);
-		}
-		PUTS_ERR("…");
+		raise(SIGTSTP);
 	}
+	sigprocmask(SIG_UNBLOCK, &tstp, NULL);
+	sigprocmask(SIG_BLOCK, &tstp, NULL);
 
-	PUTS_ERR(SGR_RESET);
-
-	if (search_open || search_len > 0)
-		draw_search_box(path_cols);
-
-	PUTS_ERR(EL(0) "\n");
-	if (page > 0)
-		PUTS_ERR("↑");
-	PUTS_ERR(EL(0) "\n");
-
-	size_t start = page * page_size;
-
-	// Max length: win_cols - 2 (marker) - 1 (dir slash) - 1 (ellipsis) - 1 (terminal edge)
-	size_t max_len = win_cols > 5 ? win_cols - 5 : 1;
-
-	for (size_t i = start, j = 0; i < filtered_size && j < page_size; ++i, ++j) {
-		struct file *file = files + filtered[i].idx;
-		const char *name = file_name(file);
-		size_t match_start = filtered[i].match_start;
-		size_t match_end = match_start + search_len;
-		size_t name_len = file->length;
-		bool is_dir = file->type == DT_DIR;
-		bool truncated = name_len > max_len;
+	enter_ui();
+	request_redraw(REDRAW_FULL);
+}
 
-		enum LsColor c;
+static void on_signal(int fd, short revents)
+{
+	(void)revents;
 
-		switch (file->type) {
-			case DT_BLK:
-				c = LsColor_bd;
+	struct signalfd_siginfo info;
+	while (read(fd, &info, sizeof(info)) == sizeof(info)) {
+		switch (info.ssi_signo) {
+			case SIGWINCH:
+				handle_resize();
 				break;
-			case DT_CHR:
-				c = LsColor_cd;
+			case SIGTSTP:
+				suspend();
 				break;
-			case DT_DIR:
-				c = LsColor_di;
-				break;
-			case DT_FIFO:
-				c = LsColor_pi;
-				break;
-			case DT_LNK:
-				c = LsColor_ln;
-				break;
-			case DT_REG:
-				c = file->exec ? LsColor_ex : LsColor_fi;
-				break;
-			case DT_SOCK:
-				c = LsColor_so;
+			case SIGCONT:
+				enter_ui();
+				request_redraw(REDRAW_FULL);
 				break;
 			default:
-				c = LsColor_fi;
+				exit_status = 128 + (int)info.ssi_signo;
 				break;
 		}
+	}
+}
 
-		// Draw selection marker
-		PUTS_ERR(j == cursor ? "> " : "  ");
-		PUTS_ERR(CSI);
-		PUTS_ERR(ls_colors[c]);
-		PUTC_ERR('m');
+static void on_worker(int fd, short revents)
+{
+	(void)revents;
 
-		if (search_len > 0) {
-			if (truncated) {
-				if (match_start >= max_len) {
-					// Match entirely in overflow
-					WRITE_ERR(name, max_len);
-					PUTS_ERR(SGR_UNDERSCORE_ON "…" SGR_UNDERLINE_OFF);
-				} else if (match_end > max_len) {
-					// Match partially in overflow
-					WRITE_ERR(name, match_start);
-					PUTS_ERR(SGR_UNDERSCORE_ON);
-					WRITE_ERR(name + match_start, max_len - match_start);
-					PUTS_ERR("…" SGR_UNDERLINE_OFF);
-				} else {
-					// Match fully visible
-					WRITE_ERR(name, match_start);
-					PUTS_ERR(SGR_UNDERSCORE_ON);
-					WRITE_ERR(name + match_start, search_len);
-					PUTS_ERR(SGR_UNDERLINE_OFF);
-					WRITE_ERR(name + match_end, max_len - match_end);
-					PUTS_ERR("…");
-				}
-			} else {
-				WRITE_ERR(name, match_start);
-				PUTS_ERR(SGR_UNDERSCORE_ON);
-				WRITE_ERR(name + match_start, search_len);
-				PUTS_ERR(SGR_UNDERLINE_OFF);
-				PUTS_ERR(name + match_end);
-			}
-		} else {
-			if (truncated) {
-				WRITE_ERR(name, max_len);
-				PUTS_ERR("…");
-			} else {
-				PUTS_ERR(name);
-			}
-		}
+	uint64_t count;
+	if (read(fd, &count, sizeof(count)) != sizeof(count))
+		return;
 
-		PUTS_ERR(SGR_RESET);
-		if (is_dir && !truncated)
-			PUTC_ERR('/');
-		PUTS_ERR(EL(0) "\n");
+	pthread_mutex_lock(&completions_lock);
+	struct completion *list = completions;
+	completions = NULL;
+	pthread_mutex_unlock(&completions_lock);
+
+	// Posted newest first; run in posting order
+	struct completion *ordered = NULL;
+	while (list) {
+		struct completion *next = list->next;
+		list->next = ordered;
+		ordered = list;
+		list = next;
+	}
+	while (ordered) {
+		struct completion *next = ordered->next;
+		ordered->fn(ordered->arg);
+		ordered = next;
 	}
+}
 
-	if (filtered_size > 0 && start + page_size < filtered_size)
-		PUTS_ERR("↓");
-	PUTS_ERR(ED(0));
+// Batch mode (--list): the listing, search and sort of the browser, run
+// without a terminal. The matches of each directory are written to stdout
+// once it is read and filtered, so a recursive listing streams as it goes.
+// Paths are relative to the directory listed.
+enum list_format { LIST_PATHS, LIST_JSON };
 
-	if (search_open)
-		PRINTF_ERR(SHOW_CURSOR CUP(1, %zu), search_box_col + search_cursor);
-	else
-		PUTS_ERR(HIDE_CURSOR);
+static bool list_mode, list_recursive;
+static enum list_format list_format;
 
-	PUTS_ERR(SYNC_END);
+static const char *type_name(unsigned char type)
+{
+	switch (type) {
+		case DT_REG:  return "file";
+		case DT_DIR:  return "dir";
+		case DT_LNK:  return "symlink";
+		case DT_FIFO: return "fifo";
+		case DT_SOCK: return "socket";
+		case DT_CHR:  return "char";
+		case DT_BLK:  return "block";
+		default:      return "unknown";
+	}
+}
 
-	prev_cursor = cursor;
+// Writes s as a JSON string. Bytes that are not valid UTF-8 become U+FFFD.
+static void put_json_string(const char *s, size_t len)
+{
+	PUTC('"');
+	for (size_t i = 0; i < len; ) {
+		unsigned char c = (unsigned char)s[i];
+		if (c == '"' || c == '\\') {
+			PUTC('\\');
+			PUTC(c);
+			i++;
+		} else if (c < 0x20) {
+			PRINTF("\\u%04x", c);
+			i++;
+		} else if (c < 0x80) {
+			PUTC(c);
+			i++;
+		} else {
+			uint32_t cp;
+			size_t n = utf8_decode(s + i, len - i, &cp);
+			if (cp == UTF8_REPLACEMENT && n == 1)
+				PUTS("\\ufffd");
+			else
+				WRITE(s + i, n);
+			i += n;
+		}
+	}
+	PUTC('"');
 }
 
-// Escape sequence key codes
-enum esc_key {
-	ESC_NONE,
-	ESC_UP, ESC_DOWN, ESC_LEFT, ESC_RIGHT,
-	ESC_HOME, ESC_END, ESC_DELETE,
-	ESC_PAGE_UP, ESC_PAGE_DOWN,
-	ESC_CTRL_LEFT, ESC_CTRL_RIGHT, ESC_CTRL_DELETE,
-	ESC_DOUBLE  // Double escape
-};
+// Writes filtered entry k, in the directory at path (empty at the top)
+static void list_entry(size_t k, const char *path, size_t path_len)
+{
+	size_t i = view_idx(k);
+	const char *name = entry_name(i);
+	size_t len = entry_length(i);
+
+	if (list_format == LIST_PATHS) {
+		WRITE(path, path_len);
+		WRITE(name, len);
+		PUTC(null_output ? '\0' : '\n');
+		return;
+	}
+
+	// The name is copied: entry_name() is only valid until the next call
+	char full[PATH_MAX + NAME_MAX + 1];
+	memcpy(full, path, path_len);
+	memcpy(full + path_len, name, len);
+	PUTS("{\"path\":");
+	put_json_string(full, path_len + len);
+	PRINTF(",\"type\":\"%s\"", type_name(file_at(i)->type));
+	if (du_sizes && du_sizes[i] != SIZE_UNKNOWN)
+		PRINTF(",\"size\":%llu", (unsigned long long)du_sizes[i]);
+	// Offsets into path, as the name is only matched after its directory
+	if (search_len > 0)
+		PRINTF(",\"match\":[%zu,%zu]", path_len + view_match(k), path_len + view_match(k) + search_len);
+	PUTS("}\n");
+}
 
-static enum esc_key read_escape_sequence(void)
-{
-	int next = getchar();
-	if (next == EOF)
-		return ESC_NONE;
-	if (next == K_ESC)
-		return ESC_DOUBLE;
-	if (next != '[' && next != 'O')
-		return ESC_NONE;
-
-	int code = getchar();
-	if (code == EOF) return ESC_NONE;
-	switch (code) {
-		case 'A': return ESC_UP;
-		case 'B': return ESC_DOWN;
-		case 'C': return ESC_RIGHT;
-		case 'D': return ESC_LEFT;
-		case 'H': return ESC_HOME;
-		case 'F': return ESC_END;
-		case '1': {
-			int sub = getchar();
-			if (sub == EOF) return ESC_NONE;
-			if (sub == '~') return ESC_HOME;
-			if (sub == ';') {
-				if (getchar() == EOF) return ESC_NONE;  // consume '5'
-				int dir = getchar();
-				if (dir == EOF) return ESC_NONE;
-				if (dir == 'C') return ESC_CTRL_RIGHT;
-				if (dir == 'D') return ESC_CTRL_LEFT;
+// Lists the directory open as fd, then with --recursive each of its
+// subdirectories. path is its path, ending with '/' unless empty, in a
+// PATH_MAX buffer. Returns false if anything could not be read, or was
+// left out for the memory budget.
+static bool list_directory(int fd, char *path, size_t path_len, const char *label)
+{
+	struct stat st;
+	struct listing listing;
+	int error = fstat(fd, &st) != 0 ? errno : load_listing(fd, &listing);
+	if (error) {
+		errno = error;
+		perror(label);
+		return false;
+	}
+	dir_fd = fd;
+	dir_dev = st.st_dev;
+	dir_ino = st.st_ino;
+	install_listing(&listing);
+
+	if (search_len > 0)
+		apply_filter();
+	if (sort_by_size) {
+		if (size_measure(0, filtered_size, false, true)) {
+			while (file_jobs)
+				event_wait(-1);
+		}
+		sort_filtered();
+	}
+	for (size_t k = 0; k < filtered_size; ++k)
+		list_entry(k, path, path_len);
+	bool complete = !listing_truncated && !(filter_truncated && search_len > 0);
+	if (!complete && list_format == LIST_JSON) {
+		PUTS("{\"truncated\":true,\"dir\":");
+		put_json_string(path, path_len);
+		PUTS("}\n");
+	}
+	FLUSH();
+	if (!complete)
+		PRINTF_ERR("%s: memory budget reached, not all entries are listed\n", label);
+	if (!list_recursive)
+		return complete;
+
+	// Every subdirectory is searched, not only the matching ones. Their
+	// names are taken first, as each one read replaces files[].
+	char *subdirs = NULL;
+	size_t subdirs_size = 0, subdirs_capacity = 0;
+	for (size_t i = 0; i < files_size; ++i) {
+		unsigned char type = file_at(i)->type;
+		if (type != DT_DIR && type != DT_UNKNOWN)
+			continue;
+		size_t len = entry_length(i);
+		if (subdirs_size + len + 1 > subdirs_capacity) {
+			size_t capacity = subdirs_capacity ? subdirs_capacity * 2 : 4096;
+			while (capacity < subdirs_size + len + 1)
+				capacity *= 2;
+			char *grown = realloc(subdirs, capacity);
+			if (!grown) {
+				perror("realloc");
+				free(subdirs);
+				return false;
 			}
-			return ESC_NONE;
-		}
-		case '3': {
-			int sub = getchar();
-			if (sub == EOF) return ESC_NONE;
-			if (sub == '~') return ESC_DELETE;
-			if (sub == ';') {
-				if (getchar() == EOF) return ESC_NONE;  // consume '5'
-				if (getchar() == EOF) return ESC_NONE;  // consume '~'
-				return ESC_CTRL_DELETE;
+			subdirs = grown;
+			subdirs_capacity = capacity;
+		}
+		memcpy(subdirs + subdirs_size, entry_name(i), len + 1);
+		subdirs_size += len + 1;
+	}
+
+	bool ok = complete;
+	for (size_t at = 0; at < subdirs_size; ) {
+		const char *name = subdirs + at;
+		size_t len = strlen(name);
+		at += len + 1;
+
+		if (path_len + len + 2 > PATH_MAX) {
+			errno = ENAMETOOLONG;
+			perror(name);
+			ok = false;
+			continue;
+		}
+		memcpy(path + path_len, name, len);
+		path[path_len + len] = '\0';
+		int sub_fd = openat(fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+		if (sub_fd < 0) {
+			// Entries of unknown type that are not directories after all
+			if (errno != ENOTDIR && errno != ELOOP) {
+				perror(path);
+				ok = false;
 			}
-			return ESC_NONE;
+			continue;
 		}
-		case '4':
-			if (getchar() == EOF) return ESC_NONE;  // consume '~'
-			return ESC_END;
-		case '5':
-			if (getchar() == EOF) return ESC_NONE;  // consume '~'
-			return ESC_PAGE_UP;
-		case '6':
-			if (getchar() == EOF) return ESC_NONE;  // consume '~'
-			return ESC_PAGE_DOWN;
+		path[path_len + len] = '/';
+		ok &= list_directory(sub_fd, path, path_len + len + 1, path);
+		close(sub_fd);
 	}
-	return ESC_NONE;
+	path[path_len] = '\0';
+	free(subdirs);
+	return ok;
 }
 
-int main(int argc, char **argv)
+static int list_main(const char *label)
+{
+	worker_fd = eventfd(0, EFD_CLOEXEC);
+	if (worker_fd < 0) {
+		perror("eventfd");
+		return EXIT_FAILURE;
+	}
+	event_add(worker_fd, POLLIN, on_worker);
+
+	char path[PATH_MAX] = "";
+	bool ok = list_directory(dir_fd, path, 0, label);
+	return ok && !ferror(stdout) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static int explorer_main(int argc, char **argv)
 {
 	struct option options[] = {
 		{ "start", required_argument, 0, 's' },
+		{ "scroll", no_argument, 0, 'c' },
+		{ "stats", no_argument, 0, 'S' },
+		{ "esc-timeout", required_argument, 0, 'E' },
+		{ "preview", no_argument, 0, 'p' },
+		{ "grid", no_argument, 0, 'C' },
+		{ "long", no_argument, 0, 'l' },
+		{ "lazy-stat", no_argument, 0, 'z' },
+		{ "memory-budget", required_argument, 0, 'M' },
+		{ "trash", no_argument, 0, 'T' },
+		{ "null", no_argument, 0, '0' },
+		{ "counts", no_argument, 0, 'n' },
+		{ "filter", required_argument, 0, 'f' },
+		{ "sort", required_argument, 0, 'k' },
+		{ "list", no_argument, 0, 'L' },
+		{ "recursive", no_argument, 0, 'R' },
+		{ "json", no_argument, 0, 'j' },
+		{ "stdin", no_argument, 0, 'I' },
 		{ "help", no_argument, 0, 'h' },
 		{ 0 }
 	};
@@ -1017,13 +6486,92 @@ int main(int argc, char **argv)
 	char *start = NULL;
 	int c;
 
-	while ((c = getopt_long(argc, argv, "s:h", options, NULL)) != -1) {
+	while ((c = getopt_long(argc, argv, "s:cSE:pClzM:T0nf:k:LRjIh", options, NULL)) != -1) {
 		switch (c) {
 			case '?':
 				break;
 			case 's':
 				start = optarg;
 				break;
+			case 'c':
+				continuous_scroll = true;
+				break;
+			case 'S':
+				show_stats = true;
+				break;
+			case 'p':
+				preview_enabled = true;
+				break;
+			case 'C':
+				grid_mode = true;
+				break;
+			case 'l':
+				long_mode = true;
+				break;
+			case 'z':
+				lazy_stat_forced = true;
+				break;
+			case 'T':
+				trash_enabled = true;
+				break;
+			case '0':
+				null_output = true;
+				break;
+			case 'n':
+				counts_enabled = true;
+				break;
+			case 'f':
+				search_len = strlen(optarg);
+				if (search_len >= sizeof(search_query)) {
+					PRINTF_ERR("Error: --filter takes a query of at most %zu bytes\n", sizeof(search_query) - 1);
+					return EXIT_FAILURE;
+				}
+				memcpy(search_query, optarg, search_len + 1);
+				search_cursor = search_len;
+				break;
+			case 'k':
+				if (strcmp(optarg, "size") != 0 && strcmp(optarg, "name") != 0) {
+					PUTS_ERR("Error: --sort takes name or size\n");
+					return EXIT_FAILURE;
+				}
+				sort_by_size = strcmp(optarg, "size") == 0;
+				break;
+			case 'L':
+				list_mode = true;
+				break;
+			case 'R':
+				list_recursive = true;
+				break;
+			case 'j':
+				list_format = LIST_JSON;
+				break;
+			case 'I':
+				stream_mode = true;
+				break;
+			case 'M': {
+				char *end;
+				unsigned long long size = strtoull(optarg, &end, 10);
+				int shift = *end == 'K' ? 10 : *end == 'M' ? 20 : *end == 'G' ? 30 : 0;
+				if (shift)
+					end++;
+				if (*end != '\0' || end == optarg || size > (SIZE_MAX >> shift)
+					|| (size << shift) < ((size_t)1 << 20)) {
+					PUTS_ERR("Error: --memory-budget takes a size of at least 1M, with an optional K, M or G suffix\n");
+					return EXIT_FAILURE;
+				}
+				memory_budget = (size_t)(size << shift);
+				break;
+			}
+			case 'E': {
+				char *end;
+				long ms = strtol(optarg, &end, 10);
+				if (*end != '\0' || ms < 0 || ms > 10000) {
+					PUTS_ERR("Error: --esc-timeout takes milliseconds (0-10000)\n");
+					return EXIT_FAILURE;
+				}
+				esc_timeout = (int)ms;
+				break;
+			}
 			case 'h':
 				PUTS(
 					"Usage: explorer [OPTIONS] [DIR]\n"
@@ -1032,8 +6580,32 @@ int main(int argc, char **argv)
 					"\n"
 					"Options:\n"
 					"  -s, --start NAME    Start with the cursor on the file with the given name\n"
+					"  -c, --scroll        Scroll one line at a time instead of by page\n"
+					"  -S, --stats         Print rendering statistics to stderr on exit\n"
+					"  -E, --esc-timeout MS\n"
+					"                      Wait MS milliseconds for the rest of an escape sequence (default 50)\n"
+					"  -p, --preview       Show a preview of the entry under the cursor\n"
+					"  -C, --grid          Lay entries out in columns, like ls -C\n"
+					"  -l, --long          Show permissions, owner, size, mtime and link targets\n"
+					"  -z, --lazy-stat     Only stat entries as they are shown (automatic on network filesystems)\n"
+					"  -M, --memory-budget SIZE\n"
+					"                      Keep a listing within SIZE bytes (K, M, G suffixes; default 512M)\n"
+					"  -T, --trash         Delete by moving to a trash, purged in the background after a minute\n"
+					"  -0, --null          End each path printed with a NUL, rather than newlines between them\n"
+					"  -n, --counts        Show the number of entries of each directory shown\n"
+					"  -f, --filter QUERY  Start with the search QUERY applied\n"
+					"  -k, --sort KEY      Sort by name (default) or size\n"
+					"  -I, --stdin         Browse the paths read from stdin, one per line (NUL separated with -0)\n"
 					"  -h, --help          Print this help\n"
 					"\n"
+					"Server:\n"
+					"  explorer --server   Stay running, and run the sessions of later explorers with warm caches\n"
+					"\n"
+					"Batch mode:\n"
+					"  -L, --list          Print the entries of DIR, searched and sorted as above, and exit\n"
+					"  -R, --recursive     Also list every subdirectory\n"
+					"  -j, --json          Print a JSON object per entry: path, type, size and match offsets\n"
+					"\n"
 					"Keybindings:\n"
 					"  Navigation:\n"
 					"    Up/Down           Move cursor up/down\n"
@@ -1042,6 +6614,8 @@ int main(int argc, char **argv)
 					"    End, G            Go to last item\n"
 					"    Page Up, u        Move cursor to top of page (then previous page)\n"
 					"    Page Down, d      Move cursor to bottom of page (then next page)\n"
+					"    Tab, l            Move to the next column (grid)\n"
+					"    Shift-Tab, h      Move to the previous column (grid)\n"
 					"\n"
 					"  Search:\n"
 					"    /                 Open search box (filters files by substring)\n"
@@ -1049,13 +6623,29 @@ int main(int argc, char **argv)
 					"    Escape Escape     Clear search and close search box\n"
 					"\n"
 					"  Actions:\n"
-					"    Enter             Select current file and exit\n"
+					"    Enter             Select current file, or the marked ones, and exit\n"
+					"    Space             Mark or unmark current file and move down\n"
+					"    a                 Mark all files shown (the search matches)\n"
+					"    i                 Invert the marks of the files shown\n"
+					"    A                 Unmark all files\n"
 					"    e                 Open file in $EDITOR\n"
-					"    D, Delete         Delete file/directory (with confirmation)\n"
+					"    D, Delete         Delete file/directory, or the marked ones (with confirmation)\n"
+					"    c                 Take the marked files, or the current one, to copy\n"
+					"    x                 Take the marked files, or the current one, to move\n"
+					"    P                 Paste: copy or move the files taken to this directory\n"
+					"    C                 Drop the files taken\n"
+					"    z                 Measure the disk usage of the current entry\n"
+					"    Z                 Measure all directories shown, reusing sizes already known\n"
+					"    s                 Sort by size / by name\n"
+					"    X                 Cancel deletes, copies and measuring in progress (with confirmation)\n"
+					"    U                 Restore the entry last moved to the trash (-T)\n"
+					"    p                 Toggle the preview pane\n"
+					"    L                 Toggle the long listing\n"
+					"    #                 Toggle the entry counts of directories (-n)\n"
 					"    q                 Quit without selection\n"
 					"\n"
 					"Output:\n"
-					"  Prints the absolute path of the selected file to stdout.\n"
+					"  Prints the absolute path of the selected file, or of each marked one, to stdout.\n"
 				);
 				return EXIT_SUCCESS;
 		}
@@ -1065,243 +6655,189 @@ int main(int argc, char **argv)
 		PUTS_ERR("Usage: explorer [OPTIONS] [DIR]\n");
 		return EXIT_FAILURE;
 	}
+	if ((list_recursive || list_format == LIST_JSON) && !list_mode) {
+		PUTS_ERR("Error: --recursive and --json only apply to --list\n");
+		return EXIT_FAILURE;
+	}
+	if (stream_mode && (list_mode || sort_by_size)) {
+		PUTS_ERR("Error: --stdin lists paths in the order read, and cannot be combined with --list or --sort size\n");
+		return EXIT_FAILURE;
+	}
+
+	// Paths come from stdin, so keys come from the terminal
+	if (stream_mode) {
+		stream_fd = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 0);
+		int tty_fd = open("/dev/tty", O_RDWR | O_CLOEXEC);
+		if (stream_fd < 0 || tty_fd < 0 || dup2(tty_fd, STDIN_FILENO) < 0) {
+			perror("/dev/tty");
+			return EXIT_FAILURE;
+		}
+		close(tty_fd);
+	}
+
+	// Batch runs and path lists stay here: they gain little from a warm
+	// server, and stdin is not a terminal
+	if (!list_mode && !stream_mode) {
+		int status = client_attach(argc, argv, argv[optind]);
+		if (status >= 0)
+			return status;
+	}
 
 	if (argv[optind] && chdir(argv[optind]) != 0) {
 		perror(argv[optind]);
 		return EXIT_FAILURE;
 	}
 
+	// Each delete in progress holds its directory open, and marked entries
+	// are deleted all at once
+	struct rlimit nofile;
+	if (getrlimit(RLIMIT_NOFILE, &nofile) == 0 && nofile.rlim_cur < nofile.rlim_max) {
+		nofile.rlim_cur = nofile.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &nofile);
+	}
+	creation_mask = umask(0);
+	umask(creation_mask);
+
 	struct winsize *ws = get_win_size();
 
 	page_size = ws->ws_row > 3 ? ws->ws_row - 3 : 1;
 	win_cols = ws->ws_col;
-	page = 0;
+	update_layout();
+	top = 0;
 
 	home_dir = getenv("HOME");
 	home_len = home_dir ? strlen(home_dir) : 0;
 
-	update_cwd();
-
-	files = calloc(files_capacity, sizeof(struct file));
-	if (!files) {
-		perror("calloc");
+	// The only getcwd(); from here on the path is kept as the user navigates
+	struct stat dir_stat;
+	if (!(cwd = getcwd(NULL, 0)) || (dir_fd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0
+		|| fstat(dir_fd, &dir_stat) != 0) {
+		perror("explorer");
+		return EXIT_FAILURE;
+	}
+	dir_dev = dir_stat.st_dev;
+	dir_ino = dir_stat.st_ino;
+	// A session of the server has both already
+	if (!color_prefix)
+		parse_ls_colors();
+	if (!utf8_bmp_ready)
+		utf8_build_bmp_widths();  // Now, rather than racing on first use in the workers
+	if (list_mode)
+		return list_main(argv[optind] ? argv[optind] : ".");
+
+	// Before the UI is up, signals still interrupt a hung mount
+	struct listing listing = { .lazy_stat = true, .spill_fd = -1 };
+	int error = stream_mode || server_listing_take(dir_fd, &listing) ? 0 : load_listing(dir_fd, &listing);
+	if (error) {
+		errno = error;
+		perror(argv[optind] ? argv[optind] : ".");
 		return EXIT_FAILURE;
 	}
-	get_files();
+	install_listing(&listing);
+	if (search_len > 0)
+		apply_filter();
 
 	if (start) {
-		struct file *found = bsearch(start, files, files_size, sizeof(struct file), compare_name_to_file);
-		if (found) {
-			idx = (size_t)(found - files);
-			page = idx / page_size;
-			cursor = idx % page_size;
+		size_t found = view_find(start);
+		if (found != SIZE_MAX) {
+			idx = found;
+			scroll_to_idx();
 		}
 	}
 
-	parse_ls_colors();
+	sigemptyset(&handled_signals);
+	sigaddset(&handled_signals, SIGINT);
+	sigaddset(&handled_signals, SIGTERM);
+	sigaddset(&handled_signals, SIGHUP);
+	sigaddset(&handled_signals, SIGWINCH);
+	sigaddset(&handled_signals, SIGTSTP);
+	sigaddset(&handled_signals, SIGCONT);
+	sigprocmask(SIG_BLOCK, &handled_signals, &saved_sigmask);
+
+	int signal_fd = signalfd(-1, &handled_signals, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (signal_fd < 0) {
+		perror("signalfd");
+		return EXIT_FAILURE;
+	}
+	worker_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (worker_fd < 0) {
+		perror("eventfd");
+		return EXIT_FAILURE;
+	}
 
-	struct sigaction sa = {
-		.sa_handler = handle_terminate,
-	};
-	sigaction(SIGINT, &sa, NULL);
-	sigaction(SIGTERM, &sa, NULL);
-	sigaction(SIGHUP, &sa, NULL);
-	signal(SIGTSTP, handle_sigtstp);
-	signal(SIGCONT, handle_sigcont);
-	signal(SIGWINCH, handle_sigwinch);
+	event_add(STDIN_FILENO, POLLIN, on_input);
+	event_add(signal_fd, POLLIN, on_signal);
+	event_add(worker_fd, POLLIN, on_worker);
+	if (stream_mode && !stream_start()) {
+		PUTS_ERR("Error: cannot start reading stdin\n");
+		return EXIT_FAILURE;
+	}
 
-	disable_tty_flags(tty_flags);
+	if (show_stats)
+		atexit(print_stats);
+	setvbuf(stderr, frame_buf, _IOFBF, sizeof(frame_buf));
+	enter_ui();
 	atexit(reset_tty);
 	atexit(clear_screen_and_reset);
 
-	print_view();
+	request_redraw(REDRAW_FULL);
 
-	for (;;) {
-		if (terminate_signal)
-			return 128 + terminate_signal;
+	while (exit_status < 0) {
+		preview_track();
 
-		int ch = getchar();
-		if (ch == EOF) {
-			if (errno == EINTR) {
-				clearerr(stdin);
-				continue;
+		// Render only once nothing else is ready, so a burst of events draws one
+		// frame. Streamed stdin and job progress can keep worker_fd ready for
+		// good, so past FRAME_LATENCY_MAX_MS a frame is due regardless.
+		int timeout = -1;
+		if (redraw != REDRAW_NONE || preview_dirty) {
+			timeout = frame_delay();
+			if (timeout > 0 && !frame_held) {
+				frame_held = true;
+				stats.frames_throttled++;
 			}
-			return terminate_signal ? 128 + terminate_signal : EXIT_SUCCESS;
 		}
-
-		if (term_resized) {
-			term_resized = 0;
-			struct winsize *ws = get_win_size();
-			page_size = ws->ws_row > 3 ? ws->ws_row - 3 : 1;
-			win_cols = ws->ws_col;
-			// Adjust cursor/page if they're now out of bounds
-			if (filtered_size > 0) {
-				if (idx >= filtered_size)
-					idx = filtered_size - 1;
-				page = idx / page_size;
-				cursor = idx % page_size;
-			}
-			print_view();
+		if (key_decoder_pending(&key_decoder)) {
+			uint64_t now = now_ms();
+			int remaining = input_deadline > now ? (int)(input_deadline - now) : 0;
+			if (timeout < 0 || remaining < timeout)
+				timeout = remaining;
 		}
-
-		if (search_open) {
-			switch (ch) {
-				case K_CTRL_U:
-					search_delete_to_start();
-					apply_filter();
-					print_view();
-					break;
-
-				case K_CTRL_W:
-					search_delete_word_back();
-					apply_filter();
-					print_view();
-					break;
-
-				case K_ESC:
-					switch (read_escape_sequence()) {
-						case ESC_DOUBLE:
-							clear_search();
-							print_view();
-							break;
-						case ESC_LEFT:
-							if (search_cursor > 0) {
-								search_cursor--;
-								print_view();
-							}
-							break;
-						case ESC_RIGHT:
-							if (search_cursor < search_len) {
-								search_cursor++;
-								print_view();
-							}
-							break;
-						case ESC_HOME:
-							search_cursor = 0;
-							print_view();
-							break;
-						case ESC_END:
-							search_cursor = search_len;
-							print_view();
-							break;
-						case ESC_DELETE:
-							search_delete_char_forward();
-							apply_filter();
-							print_view();
-							break;
-						case ESC_CTRL_DELETE:
-							search_delete_word_forward();
-							apply_filter();
-							print_view();
-							break;
-						case ESC_CTRL_LEFT:
-							search_move_word_back();
-							print_view();
-							break;
-						case ESC_CTRL_RIGHT:
-							search_move_word_forward();
-							print_view();
-							break;
-						default:
-							break;
-					}
-					break;
-
-				case '\n':
-					search_open = false;
-					print_view();
-					break;
-
-				case K_DEL:
-					if (search_len == 0) {
-						search_open = false;
-					} else {
-						search_delete_char_back();
-						apply_filter();
-					}
-					print_view();
-					break;
-
-				case K_CTRL_H:
-					search_delete_word_back();
-					apply_filter();
-					print_view();
-					break;
-
-				default:
-					search_insert_char(ch);
-					apply_filter();
-					print_view();
-					break;
-			}
-			continue;
+		int preview_wait = preview_delay();
+		if (preview_wait >= 0 && (timeout < 0 || preview_wait < timeout))
+			timeout = preview_wait;
+		int fs_wait = fs_status_delay();
+		if (fs_wait >= 0 && (timeout < 0 || fs_wait < timeout))
+			timeout = fs_wait;
+		int delete_wait = job_progress_delay();
+		if (delete_wait >= 0 && (timeout < 0 || delete_wait < timeout))
+			timeout = delete_wait;
+
+		int n = event_wait(timeout);
+		if (n < 0 && errno != EINTR) {
+			perror("poll");
+			return EXIT_FAILURE;
 		}
-
-		switch (ch) {
-			case '\n':
-				if (filtered_size > 0) {
-					struct file *selection = files + filtered[idx].idx;
-					PUTS(cwd);
-					PUTC('/');
-					PUTS(file_name(selection));
-				}
-				return EXIT_SUCCESS;
-
-			case K_ESC:
-				switch (read_escape_sequence()) {
-					case ESC_DOUBLE:
-						if (search_len > 0) {
-							clear_search();
-							print_view();
-						}
-						break;
-					case ESC_UP:    if (!move_to_previous()) update_selection(); break;
-					case ESC_DOWN:  if (!move_to_next()) update_selection(); break;
-					case ESC_HOME:  if (!move_to_first()) update_selection(); break;
-					case ESC_END:   if (!move_to_last()) update_selection(); break;
-					case ESC_DELETE: delete_selected(); break;
-					case ESC_PAGE_UP:   if (!move_page_up()) update_selection(); break;
-					case ESC_PAGE_DOWN: if (!move_page_down()) update_selection(); break;
-					case ESC_RIGHT: enter_directory(); break;
-					case ESC_LEFT:  go_to_parent(); break;
-					default: break;
-				}
-				break;
-
-			case '/':  // Open search
-				search_open = true;
-				print_view();
-				break;
-
-			case 'q':
-				return EXIT_SUCCESS;
-
-			case 'g': if (!move_to_first()) update_selection(); break;
-			case 'G': if (!move_to_last()) update_selection(); break;
-			case 'u': if (!move_page_up()) update_selection(); break;
-			case 'd': if (!move_page_down()) update_selection(); break;
-			case 'D': delete_selected(); break;
-			case 'e':  // Open in editor
-				if (filtered_size > 0) {
-					char *editor = getenv("EDITOR");
-					if (editor) {
-						const char *selection_name = file_name(files + filtered[idx].idx);
-						reset_tty();
-						clear_screen();
-						pid_t pid = fork();
-						if (pid == 0) {
-							execlp(editor, editor, selection_name, NULL);
-							_exit(127);
-						} else if (pid > 0) {
-							int status;
-							while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
-							}
-						}
-						disable_tty_flags(tty_flags);
-						print_view();
-					}
-				}
-				break;
+		bool overdue = n > 0 && now_ms() - throttle.last_frame >= FRAME_LATENCY_MAX_MS;
+		if ((n == 0 || overdue) && exit_status < 0) {
+			if (key_decoder_pending(&key_decoder) && now_ms() >= input_deadline)
+				input_timeout();
+			if (preview_delay() == 0)
+				preview_request();
+			if (fs_status() != fs_status_shown || job_progress_delay() == 0)
+				request_redraw(REDRAW_FULL);
+			if (frame_delay() == 0)
+				render();
 		}
 	}
+
+	return exit_status;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc == 3 && strcmp(argv[1], "--purge") == 0)
+		return purge_main(argv[2]);
+	if (argc == 2 && strcmp(argv[1], "--server") == 0)
+		return server_main();
+	return explorer_main(argc, argv);
 }
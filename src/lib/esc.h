@@ -169,12 +169,17 @@
 #define X10_MOUSE   9       // X10 mouse reporting
 #define DECTCEM     25      // Cursor visible
 #define X11_MOUSE   1000    // X11 mouse reporting
+#define BRACKETED_PASTE 2004  // Pasted text is wrapped in ESC [ 200 ~ ... ESC [ 201 ~
 #define SYNC_OUTPUT 2026    // Synchronized output
 
 // Synchronized output (prevents tearing during multi-part screen updates)
 #define SYNC_BEGIN  CSI "?2026h"
 #define SYNC_END    CSI "?2026l"
 
+// Bracketed paste
+#define ENABLE_BRACKETED_PASTE  DECSET(2004)
+#define DISABLE_BRACKETED_PASTE DECRST(2004)
+
 // Cursor visibility
 #define HIDE_CURSOR     DECRST(25)
 #define SHOW_CURSOR     DECSET(25)
@@ -221,6 +226,7 @@
  * ========================================================================== */
 
 #define DECSTBM(TOP, BOTTOM)    CSI #TOP ";" #BOTTOM "r"    // Set scrolling region
+#define DECSTBM_RESET           CSI "r"                     // Reset scrolling region to full screen
 
 /* ==========================================================================
  * CSI Sequences - Cursor Save/Restore (SCO)
@@ -0,0 +1,49 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <poll.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Minimal poll(2) based event loop: a fixed table of file descriptors, each
+ * with a handler that runs on the loop thread when the descriptor is ready.
+ * Any pollable fd can be registered (tty, signalfd, eventfd, inotify, ...).
+ */
+
+#define EVENT_LOOP_MAX 16
+
+typedef void (*event_handler)(int fd, short revents);
+
+static struct pollfd event_fds[EVENT_LOOP_MAX];
+static event_handler event_handlers[EVENT_LOOP_MAX];
+static size_t event_count;
+
+// Registers fd for the given poll events. Returns false if the table is full.
+static inline bool event_add(int fd, short events, event_handler handler)
+{
+	if (event_count == EVENT_LOOP_MAX)
+		return false;
+	event_fds[event_count] = (struct pollfd){ .fd = fd, .events = events };
+	event_handlers[event_count] = handler;
+	event_count++;
+	return true;
+}
+
+// Waits up to timeout ms (-1 blocks) and runs the handlers of ready fds.
+// Returns the number of ready fds, 0 on timeout, or -1 on error.
+static inline int event_wait(int timeout)
+{
+	int n = poll(event_fds, event_count, timeout);
+	if (n <= 0)
+		return n;
+
+	for (size_t i = 0; i < event_count; ++i) {
+		short revents = event_fds[i].revents;
+		if (revents)
+			event_handlers[i](event_fds[i].fd, revents);
+	}
+	return n;
+}
+
+#endif  // EVENT_LOOP_H
@@ -0,0 +1,160 @@
+#ifndef FRONT_CODING_H
+#define FRONT_CODING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Front-coded string array, for sorted names that share long prefixes. The
+ * strings are stored in blocks of FRONT_BLOCK: the first of a block (the
+ * restart point) in full, the others as the length of the prefix shared
+ * with the previous string plus the rest. Random access decodes from the
+ * restart point of the block; a cursor remembers the last string decoded,
+ * so walking forward costs one suffix copy per string. Strings are at most
+ * FRONT_MAX bytes and may not contain NUL.
+ */
+
+#define FRONT_BLOCK 16
+#define FRONT_MAX 255
+
+struct front_coded
+{
+	unsigned char *data;
+	size_t size, capacity;
+	size_t *restarts;       // Offset in data of each block
+	size_t restarts_capacity;
+	size_t count;
+	unsigned char last[FRONT_MAX];  // Previous string appended
+	size_t last_len;
+};
+
+struct front_cursor
+{
+	size_t idx;             // Index of the string in buf, SIZE_MAX if none
+	size_t next;            // Offset in data of the string after it
+	size_t len;
+	char buf[FRONT_MAX + 1];
+};
+
+static inline void front_coded_free(struct front_coded *fc)
+{
+	free(fc->data);
+	free(fc->restarts);
+	*fc = (struct front_coded){ 0 };
+}
+
+static inline void front_cursor_reset(struct front_cursor *cur)
+{
+	cur->idx = SIZE_MAX;
+}
+
+static inline bool front_coded_reserve(struct front_coded *fc, size_t n)
+{
+	if (fc->size + n <= fc->capacity)
+		return true;
+	size_t capacity = fc->capacity ? fc->capacity * 2 : 4096;
+	while (capacity < fc->size + n)
+		capacity *= 2;
+	unsigned char *data = realloc(fc->data, capacity);
+	if (!data)
+		return false;
+	fc->data = data;
+	fc->capacity = capacity;
+	return true;
+}
+
+// Appends a string of len <= FRONT_MAX bytes. Returns false if out of memory.
+static inline bool front_coded_append(struct front_coded *fc, const char *s, size_t len)
+{
+	const unsigned char *p = (const unsigned char *)s;
+
+	if (fc->count % FRONT_BLOCK == 0) {
+		if (fc->count / FRONT_BLOCK == fc->restarts_capacity) {
+			size_t capacity = fc->restarts_capacity ? fc->restarts_capacity * 2 : 64;
+			size_t *restarts = realloc(fc->restarts, capacity * sizeof(*restarts));
+			if (!restarts)
+				return false;
+			fc->restarts = restarts;
+			fc->restarts_capacity = capacity;
+		}
+		if (!front_coded_reserve(fc, 1 + len))
+			return false;
+		fc->restarts[fc->count / FRONT_BLOCK] = fc->size;
+		fc->data[fc->size++] = (unsigned char)len;
+		memcpy(fc->data + fc->size, p, len);
+		fc->size += len;
+	} else {
+		size_t shared = 0;
+		size_t max = len < fc->last_len ? len : fc->last_len;
+		while (shared < max && p[shared] == fc->last[shared])
+			shared++;
+		if (!front_coded_reserve(fc, 2 + len - shared))
+			return false;
+		fc->data[fc->size++] = (unsigned char)shared;
+		fc->data[fc->size++] = (unsigned char)(len - shared);
+		memcpy(fc->data + fc->size, p + shared, len - shared);
+		fc->size += len - shared;
+	}
+
+	memcpy(fc->last, p, len);
+	fc->last_len = len;
+	fc->count++;
+	return true;
+}
+
+// Gives back the slack of the last doubling once all strings are appended
+static inline void front_coded_shrink(struct front_coded *fc)
+{
+	if (fc->size > 0 && fc->size < fc->capacity) {
+		unsigned char *data = realloc(fc->data, fc->size);
+		if (data) {
+			fc->data = data;
+			fc->capacity = fc->size;
+		}
+	}
+	size_t blocks = (fc->count + FRONT_BLOCK - 1) / FRONT_BLOCK;
+	if (blocks > 0 && blocks < fc->restarts_capacity) {
+		size_t *restarts = realloc(fc->restarts, blocks * sizeof(*restarts));
+		if (restarts) {
+			fc->restarts = restarts;
+			fc->restarts_capacity = blocks;
+		}
+	}
+}
+
+// Returns string i, NUL terminated in the cursor. It stays valid until the
+// next call with the same cursor.
+static inline const char *front_coded_get(const struct front_coded *fc, struct front_cursor *cur, size_t i)
+{
+	if (i == cur->idx)
+		return cur->buf;
+
+	size_t k;               // Index of the string in buf
+	const unsigned char *p;
+	if (cur->idx != SIZE_MAX && i > cur->idx && i / FRONT_BLOCK == cur->idx / FRONT_BLOCK) {
+		k = cur->idx;
+		p = fc->data + cur->next;
+	} else {
+		k = i - i % FRONT_BLOCK;
+		p = fc->data + fc->restarts[i / FRONT_BLOCK];
+		cur->len = *p++;
+		memcpy(cur->buf, p, cur->len);
+		p += cur->len;
+	}
+	for (; k < i; ++k) {
+		size_t shared = p[0], rest = p[1];
+		memcpy(cur->buf + shared, p + 2, rest);
+		cur->len = shared + rest;
+		p += 2 + rest;
+	}
+
+	cur->buf[cur->len] = '\0';
+	cur->idx = i;
+	cur->next = (size_t)(p - fc->data);
+	return cur->buf;
+}
+
+#endif  // FRONT_CODING_H
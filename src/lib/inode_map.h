@@ -0,0 +1,100 @@
+#ifndef INODE_MAP_H
+#define INODE_MAP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <time.h>
+
+/*
+ * Hash map keyed by (device, inode), for what is known about a file apart
+ * from its names: the hard links met in a walk, or the size of a directory
+ * as of its modification time. Open addressing with linear probing, grown
+ * to stay at most half full. Not thread safe.
+ */
+
+struct inode_entry
+{
+	dev_t dev;
+	ino_t ino;
+	struct timespec stamp;  // Whatever the value is valid for
+	uint64_t value;
+	bool used;
+};
+
+struct inode_map
+{
+	struct inode_entry *slots;
+	size_t size, capacity;  // Capacity is 0 or a power of two
+};
+
+static inline size_t inode_hash(dev_t dev, ino_t ino)
+{
+	uint64_t x = (uint64_t)ino ^ ((uint64_t)dev * 0x9e3779b97f4a7c15u);  // splitmix64 finalizer
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9u;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebu;
+	return (size_t)(x ^ (x >> 31));
+}
+
+static inline void inode_map_free(struct inode_map *map)
+{
+	free(map->slots);
+	*map = (struct inode_map){ 0 };
+}
+
+// Returns the entry for (dev, ino), or NULL
+static inline struct inode_entry *inode_map_find(const struct inode_map *map, dev_t dev, ino_t ino)
+{
+	if (map->capacity == 0)
+		return NULL;
+	size_t mask = map->capacity - 1;
+	for (size_t i = inode_hash(dev, ino) & mask; map->slots[i].used; i = (i + 1) & mask) {
+		if (map->slots[i].dev == dev && map->slots[i].ino == ino)
+			return &map->slots[i];
+	}
+	return NULL;
+}
+
+static inline bool inode_map_grow(struct inode_map *map)
+{
+	size_t capacity = map->capacity ? map->capacity * 2 : 256;
+	struct inode_entry *slots = calloc(capacity, sizeof(*slots));
+	if (!slots)
+		return false;
+	for (size_t k = 0; k < map->capacity; ++k) {
+		if (!map->slots[k].used)
+			continue;
+		size_t i = inode_hash(map->slots[k].dev, map->slots[k].ino) & (capacity - 1);
+		while (slots[i].used)
+			i = (i + 1) & (capacity - 1);
+		slots[i] = map->slots[k];
+	}
+	free(map->slots);
+	map->slots = slots;
+	map->capacity = capacity;
+	return true;
+}
+
+// Returns the entry for (dev, ino), added with a zero value if it was not
+// there, or NULL if out of memory. *added tells which.
+static inline struct inode_entry *inode_map_insert(struct inode_map *map, dev_t dev, ino_t ino, bool *added)
+{
+	struct inode_entry *entry = inode_map_find(map, dev, ino);
+	*added = !entry;
+	if (entry)
+		return entry;
+	if ((map->size + 1) * 2 > map->capacity && !inode_map_grow(map))
+		return NULL;
+
+	size_t mask = map->capacity - 1;
+	size_t i = inode_hash(dev, ino) & mask;
+	while (map->slots[i].used)
+		i = (i + 1) & mask;
+	map->slots[i] = (struct inode_entry){ .dev = dev, .ino = ino, .used = true };
+	map->size++;
+	return &map->slots[i];
+}
+
+#endif  // INODE_MAP_H
@@ -0,0 +1,239 @@
+#ifndef KEY_DECODER_H
+#define KEY_DECODER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "keys.h"
+
+/*
+ * Incremental terminal input decoder. Bytes are fed one at a time as they
+ * arrive, and escape sequences (ESC x, SS3, CSI with parameters) and
+ * bracketed paste are assembled across reads, so the caller never blocks in
+ * the middle of a sequence. When no byte follows a pending ESC within the
+ * caller's timeout, key_decoder_timeout() resolves it as a lone Escape.
+ */
+
+#define KEY_DECODER_MAX_PARAMS 8
+#define KEY_DECODER_PASTE_MAX 4096
+
+enum key_decoder_state {
+	KEY_STATE_GROUND,
+	KEY_STATE_ESC,      // After ESC
+	KEY_STATE_CSI,      // After ESC [
+	KEY_STATE_SS3,      // After ESC O
+	KEY_STATE_PASTE,    // Between ESC [ 200 ~ and ESC [ 201 ~
+};
+
+struct key_event
+{
+	int key;            // Byte value or KEY_* code, or'ed with KEY_* modifier bits
+	const char *text;   // KEY_PASTE only: the pasted bytes
+	size_t len;
+};
+
+struct key_decoder
+{
+	enum key_decoder_state state;
+	unsigned params[KEY_DECODER_MAX_PARAMS];
+	size_t nparams;
+	bool private_params;    // CSI < = > ? ...: replies and private modes, never keys
+	char paste[KEY_DECODER_PASTE_MAX];
+	size_t paste_len;
+	size_t paste_end_match; // Bytes of the paste end marker matched so far
+};
+
+// Final byte of CSI [1;<mods>] X and SS3 X
+static const int key_final_table[128] = {
+	['A'] = KEY_UP, ['B'] = KEY_DOWN, ['C'] = KEY_RIGHT, ['D'] = KEY_LEFT,
+	['H'] = KEY_HOME, ['F'] = KEY_END, ['Z'] = KEY_BACKTAB,
+	['P'] = KEY_F1, ['Q'] = KEY_F2, ['R'] = KEY_F3, ['S'] = KEY_F4,
+};
+
+// First parameter of CSI <n> [;<mods>] ~
+static const int key_tilde_table[25] = {
+	[1] = KEY_HOME, [2] = KEY_INSERT, [3] = KEY_DELETE, [4] = KEY_END,
+	[5] = KEY_PAGE_UP, [6] = KEY_PAGE_DOWN, [7] = KEY_HOME, [8] = KEY_END,
+	[11] = KEY_F1, [12] = KEY_F2, [13] = KEY_F3, [14] = KEY_F4,
+	[15] = KEY_F5, [17] = KEY_F6, [18] = KEY_F7, [19] = KEY_F8,
+	[20] = KEY_F9, [21] = KEY_F10, [23] = KEY_F11, [24] = KEY_F12,
+};
+
+#define KEY_PASTE_BEGIN 200
+#define KEY_PASTE_END   "\x1b[201~"
+
+// Converts an xterm modifier parameter (1 + bitmask) to KEY_* modifier bits
+static inline int key_modifiers(unsigned param)
+{
+	if (param < 2)
+		return 0;
+	unsigned mask = param - 1;
+	return (mask & 1 ? KEY_SHIFT : 0) | (mask & 2 ? KEY_ALT : 0) | (mask & 4 ? KEY_CTRL : 0);
+}
+
+// Returns the key for a complete CSI sequence, or 0 if it is not a key
+static inline int key_decoder_csi(struct key_decoder *d, unsigned char final)
+{
+	if (d->private_params)
+		return 0;
+
+	unsigned first = d->params[0];
+	int mods = key_modifiers(d->nparams > 1 ? d->params[1] : 0);
+
+	if (final == '~') {
+		if (first == KEY_PASTE_BEGIN) {
+			d->state = KEY_STATE_PASTE;
+			d->paste_len = 0;
+			d->paste_end_match = 0;
+			return 0;
+		}
+		if (first < sizeof(key_tilde_table) / sizeof(*key_tilde_table) && key_tilde_table[first])
+			return key_tilde_table[first] | mods;
+		return 0;
+	}
+
+	if (final < 128 && key_final_table[final])
+		return key_final_table[final] | mods;
+	return 0;
+}
+
+static inline void key_decoder_paste_append(struct key_decoder *d, char c)
+{
+	// Excess is dropped; the end marker is still tracked
+	if (d->paste_len < sizeof(d->paste))
+		d->paste[d->paste_len++] = c;
+}
+
+static inline bool key_decoder_paste(struct key_decoder *d, unsigned char c, struct key_event *ev)
+{
+	static const char end[] = KEY_PASTE_END;
+
+	if (c == (unsigned char)end[d->paste_end_match]) {
+		if (++d->paste_end_match < sizeof(end) - 1)
+			return false;
+		d->state = KEY_STATE_GROUND;
+		ev->key = KEY_PASTE;
+		ev->text = d->paste;
+		ev->len = d->paste_len;
+		return true;
+	}
+
+	// Not the end marker after all: keep what was matched as pasted text
+	for (size_t i = 0; i < d->paste_end_match; ++i)
+		key_decoder_paste_append(d, end[i]);
+	d->paste_end_match = 0;
+	if (c == (unsigned char)end[0])
+		d->paste_end_match = 1;
+	else
+		key_decoder_paste_append(d, (char)c);
+	return false;
+}
+
+// Feeds one input byte. Returns true and fills *ev when it completes a key.
+// Unrecognized sequences are consumed whole and produce no key.
+static inline bool key_decode(struct key_decoder *d, unsigned char c, struct key_event *ev)
+{
+	ev->text = NULL;
+	ev->len = 0;
+
+	switch (d->state) {
+		case KEY_STATE_GROUND:
+			if (c == K_ESC) {
+				d->state = KEY_STATE_ESC;
+				return false;
+			}
+			ev->key = c;
+			return true;
+
+		case KEY_STATE_ESC:
+			if (c == '[') {
+				d->state = KEY_STATE_CSI;
+				memset(d->params, 0, sizeof(d->params));
+				d->nparams = 0;
+				d->private_params = false;
+				return false;
+			}
+			if (c == 'O') {
+				d->state = KEY_STATE_SS3;
+				return false;
+			}
+			if (c == K_ESC) {
+				// Escape pressed twice: report the first, the second may start a sequence
+				ev->key = KEY_ESCAPE;
+				return true;
+			}
+			d->state = KEY_STATE_GROUND;
+			ev->key = c | KEY_ALT;
+			return true;
+
+		case KEY_STATE_SS3:
+			d->state = KEY_STATE_GROUND;
+			if (c < 128 && key_final_table[c]) {
+				ev->key = key_final_table[c];
+				return true;
+			}
+			return false;
+
+		case KEY_STATE_CSI:
+			if (c >= '0' && c <= '9') {
+				if (d->nparams == 0)
+					d->nparams = 1;
+				unsigned *p = &d->params[d->nparams - 1];
+				if (*p < 100000)
+					*p = *p * 10 + (unsigned)(c - '0');
+				return false;
+			}
+			if (c == ';' || c == ':') {
+				if (d->nparams == 0)
+					d->nparams = 1;
+				if (d->nparams < KEY_DECODER_MAX_PARAMS)
+					d->nparams++;
+				return false;
+			}
+			if (c >= '<' && c <= '?') {
+				d->private_params = true;
+				return false;
+			}
+			if (c >= 0x20 && c <= 0x2f)  // Intermediate bytes
+				return false;
+			if (c >= 0x40 && c <= 0x7e) {
+				d->state = KEY_STATE_GROUND;
+				ev->key = key_decoder_csi(d, c);
+				return ev->key != 0;
+			}
+			// Any other byte aborts the sequence; ESC starts a new one
+			d->state = c == K_ESC ? KEY_STATE_ESC : KEY_STATE_GROUND;
+			return false;
+
+		case KEY_STATE_PASTE:
+			return key_decoder_paste(d, c, ev);
+	}
+	return false;
+}
+
+// Returns true while a sequence has started but is not complete. A paste
+// in progress is not pending: it only ends with its end marker.
+static inline bool key_decoder_pending(const struct key_decoder *d)
+{
+	return d->state != KEY_STATE_GROUND && d->state != KEY_STATE_PASTE;
+}
+
+// Resolves a pending sequence after the input timeout: a lone ESC becomes
+// KEY_ESCAPE, anything else is dropped. Returns true if *ev was filled.
+static inline bool key_decoder_timeout(struct key_decoder *d, struct key_event *ev)
+{
+	if (!key_decoder_pending(d))
+		return false;
+
+	bool lone_escape = d->state == KEY_STATE_ESC;
+	d->state = KEY_STATE_GROUND;
+	if (!lone_escape)
+		return false;
+	ev->key = KEY_ESCAPE;
+	ev->text = NULL;
+	ev->len = 0;
+	return true;
+}
+
+#endif  // KEY_DECODER_H
@@ -31,4 +31,22 @@
 #define K_ESC    27
 #define K_DEL    127
 
+// Special keys decoded from escape sequences (see key_decoder.h). Values
+// start above the byte range; plain bytes are reported as themselves.
+enum {
+	KEY_ESCAPE = 0x100,  // Lone Escape (no sequence followed within the timeout)
+	KEY_UP, KEY_DOWN, KEY_RIGHT, KEY_LEFT,
+	KEY_HOME, KEY_END, KEY_INSERT, KEY_DELETE,
+	KEY_PAGE_UP, KEY_PAGE_DOWN, KEY_BACKTAB,
+	KEY_F1, KEY_F2, KEY_F3, KEY_F4, KEY_F5, KEY_F6,
+	KEY_F7, KEY_F8, KEY_F9, KEY_F10, KEY_F11, KEY_F12,
+	KEY_PASTE,           // Bracketed paste; text is in the key event
+};
+
+// Modifier bits, or'ed into a key code
+#define KEY_SHIFT 0x10000
+#define KEY_ALT   0x20000
+#define KEY_CTRL  0x40000
+#define KEY_MODS  (KEY_SHIFT | KEY_ALT | KEY_CTRL)
+
 #endif  // KEYS_H
@@ -0,0 +1,175 @@
+#ifndef PERFECT_HASH_H
+#define PERFECT_HASH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Static perfect hash over a set of distinct byte strings ("hash and
+ * displace"): keys are grouped into buckets by one hash, and each bucket
+ * gets a displacement that sends all of its keys to free slots. A lookup
+ * is one hash, one displacement load and one slot load; the caller then
+ * compares the single candidate key.
+ */
+
+#define PERFECT_HASH_NONE UINT32_MAX
+
+struct perfect_hash
+{
+	uint32_t *disp;     // Displacement per bucket
+	uint32_t *slots;    // Key index per slot, PERFECT_HASH_NONE when empty
+	uint32_t bucket_mask;
+	uint32_t slot_mask;
+};
+
+static inline uint64_t perfect_hash_key(const char *s, size_t len)
+{
+	uint64_t h = 0xcbf29ce484222325u;  // FNV-1a
+	for (size_t i = 0; i < len; ++i) {
+		h ^= (unsigned char)s[i];
+		h *= 0x100000001b3u;
+	}
+	return h;
+}
+
+static inline uint32_t perfect_hash_slot(uint64_t h, uint32_t d, uint32_t mask)
+{
+	uint64_t x = h + (uint64_t)d * 0x9e3779b97f4a7c15u;  // splitmix64 finalizer
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9u;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebu;
+	return (uint32_t)(x ^ (x >> 31)) & mask;
+}
+
+static inline uint32_t perfect_hash_pow2(size_t n)
+{
+	uint32_t p = 1;
+	while (p < n)
+		p <<= 1;
+	return p;
+}
+
+static inline void perfect_hash_free(struct perfect_hash *ph)
+{
+	free(ph->disp);
+	free(ph->slots);
+	*ph = (struct perfect_hash){ 0 };
+}
+
+// Builds a perfect hash over n distinct keys. Returns false if out of memory.
+static inline bool perfect_hash_build(struct perfect_hash *ph, const char *const *keys,
+                                      const size_t *lens, size_t n)
+{
+	*ph = (struct perfect_hash){ 0 };
+	if (n == 0 || n >= PERFECT_HASH_NONE / 4)
+		return n == 0;
+
+	uint32_t nbuckets = perfect_hash_pow2(n / 2 + 1);
+	uint32_t nslots = perfect_hash_pow2(n * 2);
+
+	uint64_t *hashes = malloc(n * sizeof(*hashes));
+	uint32_t *order = malloc(n * sizeof(*order));        // Key indices grouped by bucket
+	uint32_t *start = calloc(nbuckets + 1, sizeof(*start));
+	uint32_t *by_size = malloc(nbuckets * sizeof(*by_size));
+	if (!hashes || !order || !start || !by_size)
+		goto fail;
+
+	for (size_t i = 0; i < n; ++i) {
+		hashes[i] = perfect_hash_key(keys[i], lens[i]);
+		start[(hashes[i] >> 32) & (nbuckets - 1)]++;
+	}
+	uint32_t max_size = 0, sum = 0;
+	for (uint32_t b = 0; b < nbuckets; ++b) {
+		uint32_t size = start[b];
+		if (size > max_size)
+			max_size = size;
+		start[b] = sum;
+		sum += size;
+	}
+	start[nbuckets] = sum;
+	uint32_t *fill = by_size;  // Reused as a cursor per bucket before sorting
+	memcpy(fill, start, nbuckets * sizeof(*fill));
+	for (size_t i = 0; i < n; ++i)
+		order[fill[(hashes[i] >> 32) & (nbuckets - 1)]++] = (uint32_t)i;
+
+	// Place the largest buckets first, while the table is emptiest
+	uint32_t count = 0;
+	for (uint32_t size = max_size; size > 0; --size)
+		for (uint32_t b = 0; b < nbuckets; ++b)
+			if (start[b + 1] - start[b] == size)
+				by_size[count++] = b;
+
+	for (;;) {
+		ph->disp = calloc(nbuckets, sizeof(*ph->disp));
+		ph->slots = malloc(nslots * sizeof(*ph->slots));
+		if (!ph->disp || !ph->slots)
+			goto fail;
+		memset(ph->slots, 0xff, nslots * sizeof(*ph->slots));
+		ph->bucket_mask = nbuckets - 1;
+		ph->slot_mask = nslots - 1;
+
+		bool placed_all = true;
+		for (uint32_t k = 0; k < count && placed_all; ++k) {
+			uint32_t b = by_size[k];
+			bool placed = false;
+			for (uint32_t d = 0; d < 4096 && !placed; ++d) {
+				placed = true;
+				for (uint32_t j = start[b]; j < start[b + 1] && placed; ++j) {
+					uint32_t s = perfect_hash_slot(hashes[order[j]], d, ph->slot_mask);
+					if (ph->slots[s] != PERFECT_HASH_NONE)
+						placed = false;
+					else
+						ph->slots[s] = order[j];
+				}
+				if (!placed) {
+					// Undo the keys of this bucket placed with d
+					for (uint32_t j = start[b]; j < start[b + 1]; ++j) {
+						uint32_t s = perfect_hash_slot(hashes[order[j]], d, ph->slot_mask);
+						if (ph->slots[s] == order[j])
+							ph->slots[s] = PERFECT_HASH_NONE;
+					}
+				} else {
+					ph->disp[b] = d;
+				}
+			}
+			placed_all = placed;
+		}
+		if (placed_all)
+			break;
+
+		// Practically unreachable: retry with a sparser table
+		perfect_hash_free(ph);
+		if (nslots >= (1u << 24))
+			goto fail;
+		nslots *= 2;
+	}
+
+	free(hashes);
+	free(order);
+	free(start);
+	free(by_size);
+	return true;
+
+fail:
+	perfect_hash_free(ph);
+	free(hashes);
+	free(order);
+	free(start);
+	free(by_size);
+	return false;
+}
+
+// Returns the index of the only key that can equal s, or PERFECT_HASH_NONE.
+// The caller must still compare the key.
+static inline uint32_t perfect_hash_lookup(const struct perfect_hash *ph, const char *s, size_t len)
+{
+	if (!ph->slots)
+		return PERFECT_HASH_NONE;
+	uint64_t h = perfect_hash_key(s, len);
+	uint32_t d = ph->disp[(h >> 32) & ph->bucket_mask];
+	return ph->slots[perfect_hash_slot(h, d, ph->slot_mask)];
+}
+
+#endif  // PERFECT_HASH_H
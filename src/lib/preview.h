@@ -0,0 +1,443 @@
+#ifndef PREVIEW_H
+#define PREVIEW_H
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "utf8.h"
+
+/*
+ * File previews: the first lines of a file or the sorted listing of a
+ * directory, cleaned up so they can be written to the terminal as they
+ * are. Loading is meant to run on a worker thread; it checks a cancel
+ * callback between reads so a stale request stops early. Loaded previews
+ * live in a small LRU cache keyed by (dev, ino, mtime), so revisiting an
+ * unchanged entry costs one stat.
+ */
+
+#define PREVIEW_MAX_BYTES  (64 * 1024)   // Read from the start of a file
+#define PREVIEW_MAX_LINES  256
+#define PREVIEW_LINE_BYTES 1024          // Longer lines are cut when loading
+#define PREVIEW_DIR_SCAN   4096          // Directory entries read before sorting
+#define PREVIEW_TAB_WIDTH  8
+
+struct preview_key
+{
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;
+};
+
+struct preview
+{
+	struct preview *newer, *older;   // LRU list links, under the cache lock
+	struct preview_key key;
+	unsigned refs;                   // Under the cache lock
+	size_t nlines;
+	uint32_t *line_start;            // nlines + 1 offsets into text
+	char *text;
+};
+
+typedef bool (*preview_cancelled_fn)(void *arg);
+
+static inline bool preview_key_equal(const struct preview_key *a, const struct preview_key *b)
+{
+	return a->dev == b->dev && a->ino == b->ino
+		&& a->mtime.tv_sec == b->mtime.tv_sec && a->mtime.tv_nsec == b->mtime.tv_nsec;
+}
+
+static inline const char *preview_line(const struct preview *p, size_t i, size_t *len)
+{
+	*len = p->line_start[i + 1] - p->line_start[i];
+	return p->text + p->line_start[i];
+}
+
+// Growable preview under construction
+struct preview_builder
+{
+	char *text;
+	size_t len, capacity;
+	uint32_t line_start[PREVIEW_MAX_LINES + 1];
+	size_t nlines;
+	size_t line_cols;                // Columns used by the current line
+	bool in_line;
+};
+
+static inline bool preview_reserve(struct preview_builder *b, size_t n)
+{
+	if (b->len + n <= b->capacity)
+		return true;
+	size_t capacity = b->capacity ? b->capacity * 2 : 4096;
+	while (capacity < b->len + n)
+		capacity *= 2;
+	char *text = realloc(b->text, capacity);
+	if (!text)
+		return false;
+	b->text = text;
+	b->capacity = capacity;
+	return true;
+}
+
+static inline bool preview_full(const struct preview_builder *b)
+{
+	return b->nlines == PREVIEW_MAX_LINES;
+}
+
+static inline void preview_begin_line(struct preview_builder *b)
+{
+	if (!b->in_line && !preview_full(b)) {
+		b->line_start[b->nlines] = (uint32_t)b->len;
+		b->line_cols = 0;
+		b->in_line = true;
+	}
+}
+
+static inline void preview_end_line(struct preview_builder *b)
+{
+	preview_begin_line(b);
+	if (b->in_line) {
+		b->nlines++;
+		b->in_line = false;
+	}
+}
+
+// Appends bytes that are known to be safe to print
+static inline bool preview_append(struct preview_builder *b, const char *s, size_t n, size_t cols)
+{
+	preview_begin_line(b);
+	if (!b->in_line || b->len - b->line_start[b->nlines] + n > PREVIEW_LINE_BYTES)
+		return true;  // Dropped: past the last line or the line limit
+	if (!preview_reserve(b, n))
+		return false;
+	memcpy(b->text + b->len, s, n);
+	b->len += n;
+	b->line_cols += cols;
+	return true;
+}
+
+// Appends file contents, expanding tabs and replacing control characters
+// and invalid UTF-8 so nothing reaches the terminal as a sequence
+static inline bool preview_append_text(struct preview_builder *b, const char *s, size_t n)
+{
+	static const char spaces[PREVIEW_TAB_WIDTH] = "        ";
+
+	for (size_t i = 0; i < n && !preview_full(b); ) {
+		unsigned char c = (unsigned char)s[i];
+		if (c == '\n') {
+			preview_end_line(b);
+			i++;
+			continue;
+		}
+		if (c == '\t') {
+			preview_begin_line(b);
+			size_t pad = PREVIEW_TAB_WIDTH - b->line_cols % PREVIEW_TAB_WIDTH;
+			if (!preview_append(b, spaces, pad, pad))
+				return false;
+			i++;
+			continue;
+		}
+		if (c < 0x20 || c == 0x7f) {
+			if (c != '\r' && !preview_append(b, "?", 1, 1))
+				return false;
+			i++;
+			continue;
+		}
+
+		uint32_t cp;
+		size_t len = utf8_decode(s + i, n - i, &cp);
+		bool invalid = cp == UTF8_REPLACEMENT && len == 1;
+		if (invalid || (cp >= 0x80 && cp < 0xa0)) {
+			if (!preview_append(b, "?", 1, 1))
+				return false;
+		} else if (!preview_append(b, s + i, len, utf8_cp_width(cp))) {
+			return false;
+		}
+		i += len;
+	}
+	return true;
+}
+
+static inline bool preview_append_line(struct preview_builder *b, const char *s)
+{
+	if (!preview_append_text(b, s, strlen(s)))
+		return false;
+	preview_end_line(b);
+	return true;
+}
+
+static inline struct preview *preview_finish(struct preview_builder *b, const struct preview_key *key)
+{
+	if (b->in_line)
+		preview_end_line(b);
+
+	struct preview *p = malloc(sizeof(*p));
+	uint32_t *line_start = malloc((b->nlines + 1) * sizeof(*line_start));
+	char *text = b->text ? b->text : malloc(1);
+	if (!p || !line_start || !text) {
+		free(p);
+		free(line_start);
+		free(text);
+		return NULL;
+	}
+	memcpy(line_start, b->line_start, b->nlines * sizeof(*line_start));
+	line_start[b->nlines] = (uint32_t)b->len;
+	*p = (struct preview){
+		.key = *key,
+		.refs = 1,
+		.nlines = b->nlines,
+		.line_start = line_start,
+		.text = text,
+	};
+	b->text = NULL;
+	return p;
+}
+
+static inline void preview_free(struct preview *p)
+{
+	free(p->line_start);
+	free(p->text);
+	free(p);
+}
+
+static inline bool preview_load_file(struct preview_builder *b, int fd, const struct stat *st,
+                                     preview_cancelled_fn cancelled, void *arg)
+{
+	char *buf = malloc(PREVIEW_MAX_BYTES);
+	if (!buf)
+		return false;
+
+	// Bounded reads from the start: a huge or growing file costs the same
+	size_t total = 0;
+	while (total < PREVIEW_MAX_BYTES) {
+		if (cancelled(arg)) {
+			free(buf);
+			return false;
+		}
+		ssize_t n = pread(fd, buf + total, PREVIEW_MAX_BYTES - total, (off_t)total);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		total += (size_t)n;
+	}
+
+	bool ok;
+	if (memchr(buf, '\0', total < 8192 ? total : 8192)) {
+		char line[64];
+		snprintf(line, sizeof(line), "(binary, %lld bytes)", (long long)st->st_size);
+		ok = preview_append_line(b, line);
+	} else {
+		ok = preview_append_text(b, buf, total);
+	}
+	free(buf);
+	return ok;
+}
+
+static inline int preview_compare_names(const void *a, const void *b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static inline bool preview_load_dir(struct preview_builder *b, int fd,
+                                    preview_cancelled_fn cancelled, void *arg)
+{
+	DIR *dir = fdopendir(fd);
+	if (!dir) {
+		close(fd);
+		return preview_append_line(b, strerror(errno));
+	}
+
+	// Names with a trailing '/' for directories, sorted like the main list
+	char **names = NULL;
+	size_t count = 0, capacity = 0;
+	bool ok = true;
+	struct dirent *entry;
+	while (count < PREVIEW_DIR_SCAN && (entry = readdir(dir)) != NULL) {
+		if ((count & 255) == 0 && cancelled(arg)) {
+			ok = false;
+			break;
+		}
+		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+			continue;
+		if (count == capacity) {
+			capacity = capacity ? capacity * 2 : 64;
+			char **new_names = realloc(names, capacity * sizeof(*names));
+			if (!new_names) {
+				ok = false;
+				break;
+			}
+			names = new_names;
+		}
+		size_t len = strlen(entry->d_name);
+		char *name = malloc(len + 2);
+		if (!name) {
+			ok = false;
+			break;
+		}
+		memcpy(name, entry->d_name, len);
+		name[len] = entry->d_type == DT_DIR ? '/' : '\0';
+		name[len + 1] = '\0';
+		names[count++] = name;
+	}
+	closedir(dir);
+
+	if (ok) {
+		if (count > 1)
+			qsort(names, count, sizeof(*names), preview_compare_names);
+		if (count == 0)
+			ok = preview_append_line(b, "(empty)");
+		for (size_t i = 0; i < count && ok && !preview_full(b); ++i)
+			ok = preview_append_line(b, names[i]);
+	}
+	for (size_t i = 0; i < count; ++i)
+		free(names[i]);
+	free(names);
+	return ok;
+}
+
+struct preview_cache
+{
+	pthread_mutex_t lock;
+	struct preview *newest, *oldest;
+	size_t size, capacity;
+};
+
+// Drops a reference. Safe to call from any thread.
+static inline void preview_release(struct preview_cache *cache, struct preview *p)
+{
+	pthread_mutex_lock(&cache->lock);
+	bool last = --p->refs == 0;
+	pthread_mutex_unlock(&cache->lock);
+	if (last)
+		preview_free(p);
+}
+
+static inline void preview_cache_unlink(struct preview_cache *cache, struct preview *p)
+{
+	if (p->newer)
+		p->newer->older = p->older;
+	else
+		cache->newest = p->older;
+	if (p->older)
+		p->older->newer = p->newer;
+	else
+		cache->oldest = p->newer;
+	p->newer = p->older = NULL;
+}
+
+static inline void preview_cache_push(struct preview_cache *cache, struct preview *p)
+{
+	p->older = cache->newest;
+	p->newer = NULL;
+	if (cache->newest)
+		cache->newest->newer = p;
+	else
+		cache->oldest = p;
+	cache->newest = p;
+}
+
+// Returns a new reference to the cached preview for key, or NULL
+static inline struct preview *preview_cache_get(struct preview_cache *cache, const struct preview_key *key)
+{
+	pthread_mutex_lock(&cache->lock);
+	struct preview *p = cache->newest;
+	while (p && !preview_key_equal(&p->key, key))
+		p = p->older;
+	if (p) {
+		preview_cache_unlink(cache, p);
+		preview_cache_push(cache, p);
+		p->refs++;
+	}
+	pthread_mutex_unlock(&cache->lock);
+	return p;
+}
+
+// Adds p to the cache, which takes its own reference, and evicts the least
+// recently used previews beyond the capacity
+static inline void preview_cache_put(struct preview_cache *cache, struct preview *p)
+{
+	struct preview *evicted = NULL;
+
+	pthread_mutex_lock(&cache->lock);
+	p->refs++;
+	preview_cache_push(cache, p);
+	cache->size++;
+	while (cache->size > cache->capacity) {
+		struct preview *old = cache->oldest;
+		preview_cache_unlink(cache, old);
+		cache->size--;
+		if (--old->refs == 0) {
+			old->older = evicted;
+			evicted = old;
+		}
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	while (evicted) {
+		struct preview *next = evicted->older;
+		preview_free(evicted);
+		evicted = next;
+	}
+}
+
+// Loads the preview of name in the directory dir_fd, or takes it from the
+// cache. Returns a reference the caller must release, or NULL if cancelled
+// or out of memory.
+static inline struct preview *preview_load(struct preview_cache *cache, int dir_fd, const char *name,
+                                           preview_cancelled_fn cancelled, void *arg)
+{
+	struct preview_builder b = { 0 };
+	struct preview_key key = { 0 };
+	struct stat st;
+	bool ok;
+
+	if (fstatat(dir_fd, name, &st, 0) != 0) {
+		int error = errno;
+		bool broken_link = error == ENOENT && fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0;
+		ok = preview_append_line(&b, broken_link ? "(broken link)" : strerror(error));
+		return ok ? preview_finish(&b, &key) : NULL;
+	}
+
+	key = (struct preview_key){ st.st_dev, st.st_ino, st.st_mtim };
+	struct preview *p = preview_cache_get(cache, &key);
+	if (p)
+		return p;
+
+	if (S_ISREG(st.st_mode) || S_ISDIR(st.st_mode)) {
+		// Only regular files and directories are opened; devices are never touched
+		int flags = O_RDONLY | O_NOCTTY | O_NONBLOCK | O_CLOEXEC | (S_ISDIR(st.st_mode) ? O_DIRECTORY : 0);
+		int fd = openat(dir_fd, name, flags);
+		if (fd < 0) {
+			ok = preview_append_line(&b, strerror(errno));
+		} else if (S_ISDIR(st.st_mode)) {
+			ok = preview_load_dir(&b, fd, cancelled, arg);  // Takes fd
+		} else {
+			ok = preview_load_file(&b, fd, &st, cancelled, arg);
+			close(fd);
+		}
+	} else {
+		ok = preview_append_line(&b, S_ISFIFO(st.st_mode) ? "(fifo)"
+			: S_ISSOCK(st.st_mode) ? "(socket)" : "(device)");
+	}
+
+	if (!ok) {
+		free(b.text);
+		return NULL;
+	}
+	p = preview_finish(&b, &key);
+	if (p)
+		preview_cache_put(cache, p);
+	return p;
+}
+
+#endif  // PREVIEW_H
@@ -0,0 +1,307 @@
+#ifndef UTF8_H
+#define UTF8_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "unicode_tables.h"
+
+/*
+ * UTF-8 helpers for file names: decoding, terminal display width, grapheme
+ * clusters and case folding. Names are arbitrary bytes, so invalid sequences
+ * decode one byte at a time as U+FFFD and are shown one column wide.
+ * Everything has an ASCII fast path; only names with high bytes pay for
+ * the table lookups.
+ */
+
+#define UTF8_REPLACEMENT 0xFFFD
+
+#define UTF8_ARRAY_SIZE(a) (sizeof(a) / sizeof(*(a)))
+
+// Returns true if the first len bytes of s are all ASCII
+static inline bool utf8_is_ascii(const char *s, size_t len)
+{
+	size_t i = 0;
+	for (; i + 8 <= len; i += 8) {
+		uint64_t word;
+		memcpy(&word, s + i, sizeof(word));
+		if (word & 0x8080808080808080u)
+			return false;
+	}
+	for (; i < len; ++i) {
+		if ((unsigned char)s[i] & 0x80)
+			return false;
+	}
+	return true;
+}
+
+// Decodes the code point at s. Returns its length in bytes, at least 1.
+static inline size_t utf8_decode(const char *s, size_t len, uint32_t *cp)
+{
+	const unsigned char *p = (const unsigned char *)s;
+	unsigned char c = p[0];
+
+	if (c < 0x80) {
+		*cp = c;
+		return 1;
+	}
+
+	size_t n;
+	uint32_t min;
+	if (c >= 0xc2 && c <= 0xdf) {
+		n = 2;
+		min = 0x80;
+		*cp = c & 0x1f;
+	} else if (c >= 0xe0 && c <= 0xef) {
+		n = 3;
+		min = 0x800;
+		*cp = c & 0x0f;
+	} else if (c >= 0xf0 && c <= 0xf4) {
+		n = 4;
+		min = 0x10000;
+		*cp = c & 0x07;
+	} else {
+		*cp = UTF8_REPLACEMENT;
+		return 1;
+	}
+
+	if (n > len) {
+		*cp = UTF8_REPLACEMENT;
+		return 1;
+	}
+	for (size_t i = 1; i < n; ++i) {
+		if ((p[i] & 0xc0) != 0x80) {
+			*cp = UTF8_REPLACEMENT;
+			return 1;
+		}
+		*cp = (*cp << 6) | (p[i] & 0x3f);
+	}
+	// Overlong forms, surrogates and values past U+10FFFF
+	if (*cp < min || (*cp >= 0xd800 && *cp <= 0xdfff) || *cp > 0x10ffff) {
+		*cp = UTF8_REPLACEMENT;
+		return 1;
+	}
+	return n;
+}
+
+// Returns the length of the code point ending just before s + pos
+static inline size_t utf8_prev_len(const char *s, size_t pos)
+{
+	if (pos == 0)
+		return 0;
+
+	size_t start = pos;
+	while (start > 0 && pos - start < 3 && ((unsigned char)s[start - 1] & 0xc0) == 0x80)
+		start--;
+	if (start > 0)
+		start--;  // Lead byte
+
+	// Only a valid sequence counts as one step back
+	uint32_t cp;
+	return utf8_decode(s + start, pos - start, &cp) == pos - start ? pos - start : 1;
+}
+
+static inline bool utf8_in_ranges(uint32_t cp, const struct unicode_range *ranges, size_t n)
+{
+	if (cp < ranges[0].first || cp > ranges[n - 1].last)
+		return false;
+	size_t lo = 0, hi = n;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (cp > ranges[mid].last)
+			lo = mid + 1;
+		else if (cp < ranges[mid].first)
+			hi = mid;
+		else
+			return true;
+	}
+	return false;
+}
+
+// Widths of the BMP, two bits per code point, expanded from the range
+// tables on first use
+static uint8_t utf8_bmp_widths[0x10000 / 4];
+static bool utf8_bmp_ready;
+
+static inline void utf8_set_bmp_width(uint32_t cp, unsigned width)
+{
+	unsigned shift = (cp & 3) * 2;
+	utf8_bmp_widths[cp >> 2] = (uint8_t)((utf8_bmp_widths[cp >> 2] & ~(3u << shift)) | (width << shift));
+}
+
+static inline void utf8_build_bmp_widths(void)
+{
+	memset(utf8_bmp_widths, 0x55, sizeof(utf8_bmp_widths));  // Width 1 everywhere
+	for (size_t i = 0; i < UTF8_ARRAY_SIZE(unicode_zero_width) && unicode_zero_width[i].first < 0x10000; ++i)
+		for (uint32_t cp = unicode_zero_width[i].first; cp <= unicode_zero_width[i].last && cp < 0x10000; ++cp)
+			utf8_set_bmp_width(cp, 0);
+	for (size_t i = 0; i < UTF8_ARRAY_SIZE(unicode_wide) && unicode_wide[i].first < 0x10000; ++i)
+		for (uint32_t cp = unicode_wide[i].first; cp <= unicode_wide[i].last && cp < 0x10000; ++cp)
+			utf8_set_bmp_width(cp, 2);
+	utf8_bmp_ready = true;
+}
+
+// Returns the number of terminal columns of a code point: 0, 1 or 2
+static inline unsigned utf8_cp_width(uint32_t cp)
+{
+	if (cp < 0x300)
+		return 1;
+	if (cp < 0x10000) {
+		if (!utf8_bmp_ready)
+			utf8_build_bmp_widths();
+		return (utf8_bmp_widths[cp >> 2] >> ((cp & 3) * 2)) & 3;
+	}
+	if (utf8_in_ranges(cp, unicode_zero_width, UTF8_ARRAY_SIZE(unicode_zero_width)))
+		return 0;
+	return utf8_in_ranges(cp, unicode_wide, UTF8_ARRAY_SIZE(unicode_wide)) ? 2 : 1;
+}
+
+static inline bool utf8_is_regional_indicator(uint32_t cp)
+{
+	return cp >= 0x1f1e6 && cp <= 0x1f1ff;
+}
+
+// Returns the length in bytes of the grapheme cluster at s and stores its
+// width in *cols. This approximates UAX #29 with the rules that matter for
+// display: a base with its combining marks and variation selectors, ZWJ
+// sequences, and regional indicator pairs (flags).
+static inline size_t utf8_grapheme(const char *s, size_t len, unsigned *cols)
+{
+	uint32_t cp;
+	size_t n = utf8_decode(s, len, &cp);
+	unsigned width = utf8_cp_width(cp);
+	bool flag = utf8_is_regional_indicator(cp);
+	uint32_t prev = cp;
+
+	while (n < len) {
+		uint32_t next;
+		size_t next_len = utf8_decode(s + n, len - n, &next);
+		bool joins = prev == 0x200d && next != UTF8_REPLACEMENT;
+		if (flag && utf8_is_regional_indicator(next)) {
+			flag = false;
+			joins = true;
+		}
+		if (!joins && (next < 0x300 || utf8_cp_width(next) != 0))
+			break;
+		n += next_len;
+		prev = next;
+	}
+	*cols = width;
+	return n;
+}
+
+// Returns the display width of a string in columns
+static inline size_t utf8_width(const char *s, size_t len)
+{
+	if (utf8_is_ascii(s, len))
+		return len;
+
+	size_t cols = 0;
+	for (size_t i = 0; i < len; ) {
+		unsigned w;
+		i += utf8_grapheme(s + i, len - i, &w);
+		cols += w;
+	}
+	return cols;
+}
+
+// Returns the length in bytes of the longest prefix of whole grapheme
+// clusters that fits in max_cols columns, and its width in *cols
+static inline size_t utf8_truncate(const char *s, size_t len, size_t max_cols, size_t *cols)
+{
+	size_t i = 0, used = 0;
+	while (i < len) {
+		unsigned w;
+		size_t n = utf8_grapheme(s + i, len - i, &w);
+		if (used + w > max_cols)
+			break;
+		i += n;
+		used += w;
+	}
+	if (cols)
+		*cols = used;
+	return i;
+}
+
+// Returns the simple case folding of cp, or cp if it has none that keeps
+// its UTF-8 length
+static inline uint32_t utf8_fold_cp(uint32_t cp)
+{
+	if (cp < 0x80)
+		return cp >= 'A' && cp <= 'Z' ? cp + ('a' - 'A') : cp;
+
+	// The runs do not interleave, so only the last run starting at or
+	// before cp can contain it
+	size_t lo = 0, hi = UTF8_ARRAY_SIZE(unicode_folds);
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (unicode_folds[mid].first <= cp)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == 0)
+		return cp;
+	const struct unicode_fold *fold = unicode_folds + lo - 1;
+	uint32_t offset = cp - fold->first;
+	if (offset % fold->stride != 0 || offset / fold->stride >= fold->count)
+		return cp;
+	return (uint32_t)((int32_t)cp + fold->delta);
+}
+
+static inline size_t utf8_encode(uint32_t cp, char *out)
+{
+	if (cp < 0x80) {
+		out[0] = (char)cp;
+		return 1;
+	}
+	if (cp < 0x800) {
+		out[0] = (char)(0xc0 | (cp >> 6));
+		out[1] = (char)(0x80 | (cp & 0x3f));
+		return 2;
+	}
+	if (cp < 0x10000) {
+		out[0] = (char)(0xe0 | (cp >> 12));
+		out[1] = (char)(0x80 | ((cp >> 6) & 0x3f));
+		out[2] = (char)(0x80 | (cp & 0x3f));
+		return 3;
+	}
+	out[0] = (char)(0xf0 | (cp >> 18));
+	out[1] = (char)(0x80 | ((cp >> 12) & 0x3f));
+	out[2] = (char)(0x80 | ((cp >> 6) & 0x3f));
+	out[3] = (char)(0x80 | (cp & 0x3f));
+	return 4;
+}
+
+// Case folds len bytes of src into dst. The result has the same length,
+// so byte offsets of matches in dst are valid in src. Invalid bytes are
+// copied as they are. Returns true if anything changed.
+static inline bool utf8_fold(char *dst, const char *src, size_t len)
+{
+	bool changed = false;
+	for (size_t i = 0; i < len; ) {
+		unsigned char c = (unsigned char)src[i];
+		if (c < 0x80) {
+			dst[i] = (char)(c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c);
+			changed |= dst[i] != src[i];
+			i++;
+			continue;
+		}
+
+		uint32_t cp;
+		size_t n = utf8_decode(src + i, len - i, &cp);
+		uint32_t folded = cp == UTF8_REPLACEMENT ? cp : utf8_fold_cp(cp);
+		if (folded != cp) {
+			utf8_encode(folded, dst + i);
+			changed = true;
+		} else {
+			memcpy(dst + i, src + i, n);
+		}
+		i += n;
+	}
+	return changed;
+}
+
+#endif  // UTF8_H